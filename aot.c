@@ -0,0 +1,138 @@
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "aot.h"
+
+/* ram has to hold [lo, hi) as it was translated */
+static int aot_matches(struct cpu_state *cs, const struct aot_module *m)
+{
+	uint32_t off = m->lo - cs->ram_base;
+
+	if (m->hi < m->lo || off > cs->ram_size || m->hi - m->lo > cs->ram_size - off)
+		return 0;
+	return !memcmp(cs->ram + off, m->code, m->hi - m->lo);
+}
+
+int aot_load(struct cpu_state *cs, const char *path)
+{
+	const struct aot_module *m;
+	struct aot *a;
+	uint32_t i, s, e;
+
+	a = (struct aot*)calloc(1, sizeof(struct aot));
+	if (!a)
+		return -1;
+	a->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!a->handle) {
+		fprintf(stderr, "can't load %s: %s\n", path, dlerror());
+		goto fail;
+	}
+	m = (const struct aot_module*)dlsym(a->handle, "rv32_aot_module");
+	if (!m || m->version != AOT_VERSION || m->state_size != sizeof(struct cpu_state)) {
+		fprintf(stderr, "%s is not a translation for this emulator, run --translate again\n",
+			path);
+		goto fail;
+	}
+	if (!aot_matches(cs, m)) {
+		fprintf(stderr, "%s was translated from another image\n", path);
+		goto fail;
+	}
+	a->m = m;
+	a->table = (aot_fn*)malloc((m->hi - m->lo) / 2 * sizeof(aot_fn));
+	if (!a->table)
+		goto fail;
+	memcpy(a->table, m->table, (m->hi - m->lo) / 2 * sizeof(aot_fn));
+
+	/* stores to translated code flag jit_flush, see aot_check */
+	if (!cs->jit_pages) {
+		cs->jit_pages = (uint8_t*)calloc((cs->ram_size >> JIT_PAGE_SHIFT) + 1, 1);
+		if (!cs->jit_pages)
+			goto fail;
+		a->own_pages = 1;
+	}
+	for (i = 0; i < m->nblocks; i++) {
+		s = m->blocks[2 * i] - cs->ram_base;
+		e = m->blocks[2 * i + 1] - cs->ram_base;
+		for (; s < e; s = (s | (JIT_PAGE_SIZE - 1)) + 1)
+			cs->jit_pages[s >> JIT_PAGE_SHIFT] = 1;
+	}
+	cs->aot = a;
+	return 0;
+
+fail:
+	if (a->handle)
+		dlclose(a->handle);
+	free(a->table);
+	free(a);
+	return -1;
+}
+
+void aot_free(struct cpu_state *cs)
+{
+	struct aot *a = cs->aot;
+
+	if (!a)
+		return;
+	if (a->own_pages) {
+		free(cs->jit_pages);
+		cs->jit_pages = NULL;
+	}
+	dlclose(a->handle);
+	free(a->table);
+	free(a);
+	cs->aot = NULL;
+}
+
+/* a store hit translated code or emu_reset put ram back. blocks that
+   don't match their bytes are left to the interpreter until they do */
+static void aot_check(struct cpu_state *cs)
+{
+	struct aot *a = cs->aot;
+	const struct aot_module *m = a->m;
+	uint32_t i, s, e;
+
+	for (i = 0; i < m->nblocks; i++) {
+		s = m->blocks[2 * i];
+		e = m->blocks[2 * i + 1];
+		if (memcmp(cs->ram + (s - cs->ram_base), m->code + (s - m->lo), e - s))
+			a->table[(s - m->lo) >> 1] = NULL;
+		else
+			a->table[(s - m->lo) >> 1] = m->table[(s - m->lo) >> 1];
+	}
+	cs->jit_flush = 0;
+}
+
+/* returns 0 when the instruction budget is used up, < 0 like decode_loop */
+int aot_loop(struct cpu_state *cs)
+{
+	struct aot *a = cs->aot;
+	aot_fn fn;
+	int ret;
+
+	/* edges are counted by the interpreter */
+	if (cs->cover)
+		return decode_loop(cs);
+	while (cs->icount < cpu_limit(cs)) {
+		if (cs->jit_flush)
+			aot_check(cs);
+		fn = NULL;
+		if (cs->pc - a->m->lo < a->m->hi - a->m->lo && !(cs->pc & 1))
+			fn = a->table[(cs->pc - a->m->lo) >> 1];
+		if (!fn) {
+			/* one block in the interpreter, like jit_loop */
+			__atomic_store_n(&cs->icount_limit, cs->icount + 1, __ATOMIC_RELAXED);
+			ret = decode_loop(cs);
+			cpu_set_limit(cs);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		fn(cs);
+	}
+	return 0;
+}
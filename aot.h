@@ -0,0 +1,62 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+	ahead of time translation, see --translate and --aot
+
+	--translate walks the code reachable from the entry point of an
+	image: branch and jal targets, return addresses after calls, and
+	jalr and mtvec targets built with lui, auipc and addi in the same
+	block. every basic block becomes a C function working on struct
+	cpu_state, the generated file is built into a shared object
+	against these headers and loaded back with --aot.
+
+	blocks hand over to each other through a table indexed by
+	(pc - lo) / 2 with a tail call, a static branch and a jalr look up
+	the same table. a block returns to aot_loop when the budget is
+	used up, the target isn't translated or one of its stores hit
+	translated code. pcs without a block run in the interpreter up to
+	the end of their basic block, so anything the walk didn't prove
+	reachable and the instructions the translation leaves out (csr
+	access, atomics, ecall, ebreak, mret, wfi) still run.
+
+	the module keeps the bytes it was translated from. aot_load
+	refuses a module whose code doesn't match ram. jit_pages flags
+	the translated pages like it does for the jit, when a store hits
+	one the blocks that no longer match their bytes are dropped until
+	emu_reset brings the bytes back.
+*/
+
+#define AOT_VERSION 1
+#define AOT_MAX_INSNS 256	/* per block */
+
+typedef int (*aot_fn)(struct cpu_state *cs);
+
+/* rv32_aot_module in the shared object */
+struct aot_module {
+	uint32_t version;	/* AOT_VERSION */
+	uint32_t state_size;	/* sizeof(struct cpu_state) it was built with */
+	uint32_t lo, hi;	/* translated code lies in [lo, hi) */
+	const aot_fn *table;	/* (pc - lo) / 2, NULL where no block starts */
+	const uint8_t *code;	/* the guest's bytes in [lo, hi) */
+	const uint32_t *blocks;	/* first and last byte + 1 of every block */
+	uint32_t nblocks;
+};
+
+/* blocks go through table, every emu has its own copy of the module's */
+struct aot {
+	void *handle;
+	const struct aot_module *m;
+	aot_fn *table;
+	int own_pages;		/* jit_pages is ours */
+};
+
+int aot_load(struct cpu_state *cs, const char *path);
+int aot_loop(struct cpu_state *cs);
+void aot_free(struct cpu_state *cs);
+
+#endif
@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "batch.h"
+#include "emu.h"
+
+/*
+	scheduling: the manifest is split into one contiguous range per
+	worker. a worker takes images from the front of its own range,
+	when that is empty it steals the back half of the largest range
+	left. a range is lo and hi packed into one word so both ends move
+	with a single compare and swap.
+*/
+#define RANGE(lo, hi) ((uint64_t)(lo) << 32 | (hi))
+#define LO(r) ((uint32_t)((r) >> 32))
+#define HI(r) ((uint32_t)(r))
+
+struct worker {
+	uint64_t range;
+	struct batch *b;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
+struct batch {
+	char **images;
+	uint32_t n;
+	struct emu_config cfg;
+	uint64_t budget;
+	uint32_t load_addr;
+	struct worker *w;
+	int nworkers;
+	pthread_mutex_t out_lock;
+	int failed;
+};
+
+static const char *results[] = {
+	[EMU_BUDGET] = "budget",
+	[EMU_FAULT] = "fault",
+	[EMU_BAD_PC] = "bad-pc",
+	[EMU_INVALID] = "invalid",
+	[EMU_ERROR] = "load-error",
+	[EMU_AT_PC] = "at-pc",
+	[EMU_ECALL] = "ecall",
+	[EMU_EBREAK] = "ebreak",
+	[EMU_EXIT] = "exit",
+};
+
+/* devices of batch guests, nobody reads their output */
+static uint32_t null_read(void *dev, uint32_t off, int size)
+{
+	return 0;
+}
+
+static void null_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+}
+
+/* next image of w's own range, -1 when it is empty */
+static int take(struct worker *w)
+{
+	uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+	while (LO(r) < HI(r))
+		if (__atomic_compare_exchange_n(&w->range, &r, RANGE(LO(r) + 1, HI(r)), 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return LO(r);
+	return -1;
+}
+
+/* w's range is empty, give it half of the largest one. -1 when all
+   images are taken */
+static int steal(struct worker *w)
+{
+	struct batch *b = w->b;
+	struct worker *v;
+	uint64_t r;
+	uint32_t mid, most;
+	int i;
+
+	for (;;) {
+		v = NULL;
+		most = 0;
+		for (i = 0; i < b->nworkers; i++) {
+			r = __atomic_load_n(&b->w[i].range, __ATOMIC_ACQUIRE);
+			if (HI(r) - LO(r) > most && LO(r) < HI(r)) {
+				most = HI(r) - LO(r);
+				v = &b->w[i];
+			}
+		}
+		if (!v)
+			return -1;
+		r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+		if (LO(r) >= HI(r))
+			continue;
+		/* the victim keeps lo .. mid, a single image goes to the thief */
+		mid = LO(r) + (HI(r) - LO(r)) / 2;
+		if (__atomic_compare_exchange_n(&v->range, &r, RANGE(LO(r), mid), 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&w->range, RANGE(mid, HI(r)), __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+}
+
+/* FNV-1a over the registers and pc, little endian */
+static uint64_t reg_hash(struct emu *e)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t v;
+	int i, k;
+
+	for (i = 0; i <= 32; i++) {
+		v = i < 32 ? emu_get_reg(e, i) : emu_get_pc(e);
+		for (k = 0; k < 4; k++) {
+			h ^= (v >> (8 * k)) & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+static void run_one(struct batch *b, struct emu *e, const char *image)
+{
+	struct timespec t0, t1;
+	char result[32];
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (emu_load(e, image, b->load_addr) < 0) {
+		ret = EMU_ERROR;
+		__atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		ret = emu_run(e, b->budget);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (ret == EMU_EXIT)
+		snprintf(result, sizeof(result), "exit=%d", emu_exit_code(e));
+	else
+		snprintf(result, sizeof(result), "%s", results[ret]);
+
+	pthread_mutex_lock(&b->out_lock);
+	printf("%s %llu %.3f %016llx %s\n", result,
+		(unsigned long long)emu_icount(e),
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+		(unsigned long long)reg_hash(e), image);
+	pthread_mutex_unlock(&b->out_lock);
+	emu_unload(e);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = (struct worker*)arg;
+	struct batch *b = w->b;
+	struct emu *e;
+	int i;
+
+	e = emu_create(&b->cfg);
+	if (!e || emu_add_device(e, "uart", UART_BASE, UART_SIZE, null_read, null_write, NULL) < 0) {
+		__atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+		if (e)
+			emu_destroy(e);
+		return NULL;
+	}
+	for (;;) {
+		i = take(w);
+		if (i < 0) {
+			if (steal(w) < 0)
+				break;
+			continue;
+		}
+		run_one(b, e, b->images[i]);
+	}
+	emu_destroy(e);
+	return NULL;
+}
+
+static void free_images(struct batch *b)
+{
+	uint32_t i;
+
+	for (i = 0; i < b->n; i++)
+		free(b->images[i]);
+	free(b->images);
+}
+
+static int read_manifest(struct batch *b, const char *manifest)
+{
+	char *line = NULL, *p, *end, **images;
+	size_t len = 0, max = 0;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(manifest, "r");
+	if (!f) {
+		fprintf(stderr, "can't open %s\n", manifest);
+		return -1;
+	}
+	while (getline(&line, &len, f) >= 0) {
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		for (end = p + strlen(p); end > p && (end[-1] == '\n' || end[-1] == '\r' ||
+		    end[-1] == ' ' || end[-1] == '\t'); end--)
+			;
+		*end = 0;
+		if (!*p || *p == '#')
+			continue;
+		if (b->n == max) {
+			max = max ? 2 * max : 256;
+			images = (char**)realloc(b->images, max * sizeof(char*));
+			if (!images) {
+				ret = -1;
+				break;
+			}
+			b->images = images;
+		}
+		b->images[b->n] = strdup(p);
+		if (!b->images[b->n]) {
+			ret = -1;
+			break;
+		}
+		b->n++;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "can't read %s\n", manifest);
+		ret = -1;
+	}
+	else if (ret < 0) {
+		fprintf(stderr, "out of memory reading %s\n", manifest);
+	}
+	free(line);
+	fclose(f);
+	if (ret < 0)
+		free_images(b);
+	return ret;
+}
+
+/* 0 when every image was loaded and run */
+int run_batch(const char *manifest, const struct emu_config *cfg, uint64_t budget,
+	uint32_t load_addr, int jobs)
+{
+	struct batch b;
+	uint32_t i;
+	int k, started;
+
+	memset(&b, 0, sizeof(b));
+	b.cfg = *cfg;
+	b.budget = budget;
+	b.load_addr = load_addr;
+	pthread_mutex_init(&b.out_lock, NULL);
+	if (read_manifest(&b, manifest) < 0)
+		return 1;
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > b.n)
+		jobs = b.n ? b.n : 1;
+	b.nworkers = jobs;
+	b.w = (struct worker*)aligned_alloc(64, jobs * sizeof(struct worker));
+	if (!b.w) {
+		fprintf(stderr, "out of memory\n");
+		free_images(&b);
+		return 1;
+	}
+	for (k = 0; k < jobs; k++) {
+		b.w[k].b = &b;
+		b.w[k].range = RANGE((uint64_t)b.n * k / jobs, (uint64_t)b.n * (k + 1) / jobs);
+	}
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&b.w[started].thread, NULL, worker_thread, &b.w[started]))
+			break;
+	/* workers that didn't start get robbed by the others */
+	if (!started)
+		worker_thread(&b.w[0]);
+	for (k = 0; k < started; k++)
+		pthread_join(b.w[k].thread, NULL);
+
+	/* images are only left over when no worker could set up a guest */
+	for (k = 0, i = 0; k < jobs; k++)
+		i += HI(b.w[k].range) - LO(b.w[k].range);
+	if (i) {
+		fprintf(stderr, "%u of %u images not run, no worker could set up a guest\n",
+			i, b.n);
+		b.failed = 1;
+	}
+
+	free_images(&b);
+	free(b.w);
+	pthread_mutex_destroy(&b.out_lock);
+	return b.failed;
+}
@@ -0,0 +1,37 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+#include "emu.h"
+
+/*
+	--batch: many independent guests in one process
+
+	the manifest lists one image per line, blank lines and lines
+	starting with # are skipped. worker threads keep an emu each and
+	load image after image into it, see emu_unload. every guest runs
+	until it stops or uses up the budget and gets one line on stdout:
+
+		<result> <instructions> <wall ms> <register hash> <image>
+
+	result is one of
+
+		budget		ran out of instructions
+		exit=<code>	ended itself with the exit register or tohost
+		fault		load or store outside of ram and devices
+		bad-pc		jump outside of ram or to an odd address
+		invalid		invalid instruction
+		ecall, ebreak	one of them without a trap handler
+		at-pc		stopped at a pc asked for, not used by batch
+		load-error	the image couldn't be loaded
+
+	the hash is FNV-1a over x0 - x31 and pc of hart 0. lines come out
+	in the order the guests finish. device output is dropped, why a
+	guest stopped or couldn't be loaded goes to stderr.
+*/
+
+int run_batch(const char *manifest, const struct emu_config *cfg, uint64_t budget,
+	uint32_t load_addr, int jobs);
+
+#endif
@@ -0,0 +1,45 @@
+#!/bin/sh
+# usage: bench/run.sh <emulator> <instructions> <image>...
+#
+# runs every image with the interpreter, the jit and guard memory,
+# tracing off, and prints one line per run:
+#
+#	<image> <mode> <instructions> <seconds> <MIPS> <ns/insn> <max rss KB> <result>
+#
+# result is ok when the guest ran its budget, failed when it stopped
+# early (a wrong checksum or anything else). the exit status is 1 if
+# any run failed.
+
+emu=$1
+insns=$2
+shift 2
+status=0
+
+echo "# image mode instructions seconds mips ns_per_insn max_rss_kb result"
+for image in "$@"; do
+	for mode in interp jit guard; do
+		case $mode in
+		interp) flags= ;;
+		jit) flags=-j ;;
+		guard) flags=-g ;;
+		esac
+		# the summary is the last line on stderr, the guest's output is dropped
+		out=$("$emu" $flags -n "$insns" "$image" 2>&1 >/dev/null)
+		rc=$?
+		line=$(echo "$out" | tail -n 1)
+		if [ $rc -eq 0 ]; then
+			result=ok
+		else
+			result=failed
+			status=1
+		fi
+		echo "$line" | awk -v image="$(basename "$image" .bin)" -v mode=$mode -v result=$result '
+			/instructions in/ {
+				printf "%s %s %s %s %s %.2f %s %s\n", image, mode, $1, $4, $6,
+					$6 ? 1000 / $6 : 0, $8, result
+				next
+			}
+			{ printf "%s %s 0 0 0 0 0 failed\n", image, mode }'
+	done
+done
+exit $status
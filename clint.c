@@ -0,0 +1,117 @@
+#include <stdint.h>
+
+#include "cpu.h"
+#include "clint.h"
+
+void clint_init(struct clint *c, struct cpu_state *harts, int nharts, uint32_t tick)
+{
+	c->harts = harts;
+	c->nharts = nharts;
+	c->tick = tick ? tick : 1;
+	c->offset = 0;
+}
+
+/* hart 0 may be running on another thread, its icount is read as is */
+uint64_t clint_mtime(struct clint *c)
+{
+	return __atomic_load_n(&c->harts[0].icount, __ATOMIC_RELAXED) / c->tick + c->offset;
+}
+
+/* moves every hart's next timer interrupt along */
+void clint_set_mtime(struct clint *c, uint64_t t)
+{
+	int i;
+
+	c->offset = t - __atomic_load_n(&c->harts[0].icount, __ATOMIC_RELAXED) / c->tick;
+	for (i = 0; i < c->nharts; i++)
+		cpu_irq_update(&c->harts[i]);
+}
+
+/* cs's icount when mtime reaches its mtimecmp. exact for hart 0, the
+   others are taken to run as fast as hart 0 and look again then */
+uint64_t clint_deadline(struct clint *c, struct cpu_state *cs)
+{
+	uint64_t now = clint_mtime(c), ticks;
+
+	if (now >= cs->csr.mtimecmp)
+		return cs->icount;
+	ticks = cs->csr.mtimecmp - now;
+	if (ticks >= (UINT64_MAX - cs->icount) / c->tick)
+		return UINT64_MAX;
+	return cs->icount - cs->icount % c->tick + ticks * c->tick;
+}
+
+/* wfi with nothing pending: on to cs's timer interrupt, if it has one
+   set up */
+void clint_skip(struct clint *c, struct cpu_state *cs)
+{
+	uint64_t now = clint_mtime(c);
+
+	if (c->nharts > 1 || cs->csr.mtimecmp == UINT64_MAX || now >= cs->csr.mtimecmp)
+		return;
+	c->offset += cs->csr.mtimecmp - now;
+}
+
+static uint32_t half(uint64_t v, uint32_t off)
+{
+	return off & 4 ? v >> 32 : (uint32_t)v;
+}
+
+static uint64_t set_half(uint64_t v, uint32_t off, uint32_t w)
+{
+	if (off & 4)
+		return (v & 0xffffffff) | (uint64_t)w << 32;
+	return (v & ~0xffffffffULL) | w;
+}
+
+/* the 32-bit register at off, holes read as 0 */
+static uint32_t reg_read(struct clint *c, uint32_t off)
+{
+	if (off < CLINT_MSIP + 4 * c->nharts)
+		return c->harts[off / 4].csr.msip;
+	if (off >= CLINT_MTIMECMP && off < CLINT_MTIMECMP + 8 * c->nharts)
+		return half(c->harts[(off - CLINT_MTIMECMP) / 8].csr.mtimecmp, off);
+	if (off >= CLINT_MTIME && off < CLINT_MTIME + 8)
+		return half(clint_mtime(c), off);
+	return 0;
+}
+
+static void reg_write(struct clint *c, uint32_t off, uint32_t v)
+{
+	struct cpu_state *cs;
+
+	if (off < CLINT_MSIP + 4 * c->nharts) {
+		cs = &c->harts[off / 4];
+		cs->csr.msip = v & 1;
+		cpu_irq_update(cs);
+	}
+	else if (off >= CLINT_MTIMECMP && off < CLINT_MTIMECMP + 8 * c->nharts) {
+		cs = &c->harts[(off - CLINT_MTIMECMP) / 8];
+		cs->csr.mtimecmp = set_half(cs->csr.mtimecmp, off, v);
+		cpu_irq_update(cs);
+	}
+	else if (off >= CLINT_MTIME && off < CLINT_MTIME + 8) {
+		clint_set_mtime(c, set_half(clint_mtime(c), off, v));
+	}
+}
+
+uint32_t clint_read(void *dev, uint32_t off, int size)
+{
+	uint32_t v = reg_read((struct clint*)dev, off & ~3);
+
+	v >>= (off & 3) * 8;
+	return size == 4 ? v : v & ((1u << (size * 8)) - 1);
+}
+
+/* sub-word writes merge into the register */
+void clint_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+	struct clint *c = (struct clint*)dev;
+	uint32_t shift = (off & 3) * 8, mask;
+
+	if (size < 4) {
+		mask = ((1u << (size * 8)) - 1) << shift;
+		data = (reg_read(c, off & ~3) & ~mask) | ((data << shift) & mask);
+	}
+	reg_write(c, off & ~3, data);
+}
@@ -0,0 +1,42 @@
+#ifndef CLINT_H
+#define CLINT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+	core local interruptor, the layout of the sifive one that qemu's
+	virt board has too: msip per hart at 0, mtimecmp per hart at
+	0x4000 and mtime at 0xbff8, little endian 64-bit registers read
+	and written as 32-bit halves.
+
+	mtime is virtual. it ticks once every tick instructions of hart 0
+	and wfi moves it straight ahead to the hart's mtimecmp, so a guest
+	idling between timer interrupts costs what its handlers run, not
+	what the wait would take. with several harts wfi doesn't skip, the
+	others are still running on hart 0's time.
+*/
+
+#define CLINT_BASE 0x02000000
+#define CLINT_SIZE 0x10000
+#define CLINT_MSIP 0x0
+#define CLINT_MTIMECMP 0x4000
+#define CLINT_MTIME 0xbff8
+
+struct clint {
+	struct cpu_state *harts;
+	int nharts;
+	uint32_t tick;		/* instructions per mtime tick */
+	uint64_t offset;	/* mtime when hart 0 had run nothing */
+};
+
+void clint_init(struct clint *c, struct cpu_state *harts, int nharts, uint32_t tick);
+uint64_t clint_mtime(struct clint *c);
+void clint_set_mtime(struct clint *c, uint64_t t);
+uint64_t clint_deadline(struct clint *c, struct cpu_state *cs);
+void clint_skip(struct clint *c, struct cpu_state *cs);
+uint32_t clint_read(void *dev, uint32_t off, int size);
+void clint_write(void *dev, uint32_t off, uint32_t data, int size);
+
+#endif
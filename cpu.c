@@ -0,0 +1,703 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "trace.h"
+#include "profile.h"
+#include "timing.h"
+#include "syscalls.h"
+#include "clint.h"
+
+int32_t is_compressed(uint16_t c)
+{
+	if ((c & 0x3) == 0x3) return 0;
+	return 1;
+}
+
+struct dec32 {
+	uint32_t match;
+	uint32_t mask;
+	uint8_t op;
+	uint8_t fmt;
+};
+
+#include "decode_tab.h"
+
+/* dec16_tab values index this, 0 is the illegal instruction */
+const struct {
+	uint8_t op;
+	uint8_t fmt;
+} cinsns[] = {
+	{ OP_INVALID, FMT_NONE },
+#define CINSN(name, match, mask, fmt, op) { OP_##op, FMT_##fmt },
+#include "insns.def"
+};
+
+const char *op_names[OP_MAX] = {
+	[OP_NONE] = "?",
+	[OP_INVALID] = "invalid instruction",
+#define INSN(name, mnemonic, match, mask, fmt) [OP_##name] = mnemonic,
+#include "insns.def"
+};
+
+const uint8_t op_base[OP_MAX] = {
+	[OP_INVALID] = OP_INVALID,
+#define INSN(name, mnemonic, match, mask, fmt) [OP_##name] = OP_##name,
+#include "insns.def"
+#define FUSE(name, first, second) [OP_##name] = OP_##first,
+#include "insns.def"
+#define IDIOM(name, first) [OP_##name] = OP_##first,
+#include "insns.def"
+};
+
+const struct {
+	uint8_t op;
+	uint8_t first;
+	uint8_t second;
+} fusions[] = {
+#define FUSE(name, first, second) { OP_##name, OP_##first, OP_##second },
+#include "insns.def"
+};
+
+const uint8_t op_fmt[OP_MAX] = {
+#define INSN(name, mnemonic, match, mask, fmt) [OP_##name] = FMT_##fmt,
+#include "insns.def"
+};
+
+void decode_compressed_cmd(uint16_t cmd, struct insn *in)
+{
+	int32_t imm = 0;
+
+	in->op = cinsns[dec16_tab[cmd]].op;
+	in->len = 2;
+	in->rd = 0;
+	in->rs1 = 0;
+	in->rs2 = 0;
+
+	switch (cinsns[dec16_tab[cmd]].fmt) {
+	case FMT_CIW:	/* addi4spn */
+		imm = ((cmd >> 7) & 0xf) << 6;
+		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
+		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
+		imm |= (cmd & (1 << 5)) ? (1 << 3) : 0;
+		imm |= (cmd & (1 << 6)) ? (1 << 2) : 0;
+		in->rd = 8 + ((cmd >> 2) & 0x7);
+		in->rs1 = 2;
+		break;
+	case FMT_CL:
+	case FMT_CS:
+		imm = (cmd & (1 << 5)) ? (1 << 6) : 0;
+		imm |= (cmd & (1 << 6)) ? (1 << 2) : 0;
+		imm |= ((cmd >> 10) & 0x7) << 3;
+		in->rs1 = 8 + ((cmd >> 7) & 0x7);
+		if (cinsns[dec16_tab[cmd]].fmt == FMT_CL)
+			in->rd = 8 + ((cmd >> 2) & 0x7);
+		else
+			in->rs2 = 8 + ((cmd >> 2) & 0x7);
+		break;
+	case FMT_CI:
+	case FMT_CLI:
+	case FMT_CBI:
+		imm = (cmd >> 2) & 0x1f;
+		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
+		if (imm & (1 << 5)) imm |= 0xffffffc0;
+		in->rd = (cmd >> 7) & 0x1f;
+		if (cinsns[dec16_tab[cmd]].fmt == FMT_CBI)
+			in->rd = 8 + (in->rd & 0x7);
+		if (cinsns[dec16_tab[cmd]].fmt != FMT_CLI)
+			in->rs1 = in->rd;
+		break;
+	case FMT_CI16:	/* addi16sp */
+		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
+		imm |= (cmd & (1 << 3)) ? (1 << 7) : 0;
+		imm |= (cmd & (1 << 4)) ? (1 << 8) : 0;
+		imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
+		imm |= (cmd & (1 << 6)) ? (1 << 4) : 0;
+		imm |= (cmd & (1 << 12)) ? (1 << 9) : 0;
+		if (imm & (1 << 9)) imm |= 0xfffffc00;
+		in->rd = 2;
+		in->rs1 = 2;
+		break;
+	case FMT_CLUI:
+		imm = ((cmd >> 2) & 0x1f) << 12;
+		imm |= (cmd & (1 << 12)) ? (1 << 17) : 0;
+		if (imm & (1 << 17)) imm |= 0xfffc0000;
+		in->rd = (cmd >> 7) & 0x1f;
+		break;
+	case FMT_CBSH:
+	case FMT_CSH:
+		imm = (cmd >> 2) & 0x1f;
+		in->rd = (cmd >> 7) & 0x1f;
+		if (cinsns[dec16_tab[cmd]].fmt == FMT_CBSH)
+			in->rd = 8 + (in->rd & 0x7);
+		in->rs1 = in->rd;
+		break;
+	case FMT_CA:
+		in->rd = 8 + ((cmd >> 7) & 0x7);
+		in->rs1 = in->rd;
+		in->rs2 = 8 + ((cmd >> 2) & 0x7);
+		break;
+	case FMT_CJ:
+	case FMT_CJAL:
+		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
+		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
+		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
+		imm |= (cmd & (1 << 5)) ? (1 << 3) : 0;
+		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
+		imm |= (cmd & (1 << 7)) ? (1 << 6) : 0;
+		imm |= (cmd & (1 << 8)) ? (1 << 10) : 0;
+		imm |= (cmd & (1 << 9)) ? (1 << 8) : 0;
+		imm |= (cmd & (1 << 10)) ? (1 << 9) : 0;
+		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
+		imm |= (cmd & (1 << 12)) ? (1 << 11) : 0;
+		if (imm & (1 << 11)) imm |= 0xfffff000;
+		in->rd = (cinsns[dec16_tab[cmd]].fmt == FMT_CJAL) ? 1 : 0;
+		break;
+	case FMT_CB:	/* beqz, bnez */
+		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
+		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
+		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
+		imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
+		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
+		imm |= (cmd & (1 << 10)) ? (1 << 3) : 0;
+		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
+		imm |= (cmd & (1 << 12)) ? (1 << 8) : 0;
+		if (imm & (1 << 8)) imm |= 0xfffffe00;
+		in->rs1 = 8 + ((cmd >> 7) & 0x7);
+		break;
+	case FMT_CLWSP:
+		imm = ((cmd >> 2) & 0x3) << 6;
+		imm |= ((cmd >> 4) & 0x7) << 2;
+		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
+		in->rd = (cmd >> 7) & 0x1f;
+		in->rs1 = 2;
+		break;
+	case FMT_CJR:
+	case FMT_CJALR:
+		in->rd = (cinsns[dec16_tab[cmd]].fmt == FMT_CJALR) ? 1 : 0;
+		in->rs1 = (cmd >> 7) & 0x1f;
+		break;
+	case FMT_CMV:
+	case FMT_CR:
+		in->rd = (cmd >> 7) & 0x1f;
+		if (cinsns[dec16_tab[cmd]].fmt == FMT_CR)
+			in->rs1 = in->rd;
+		in->rs2 = (cmd >> 2) & 0x1f;
+		break;
+	case FMT_CSWSP:
+		imm = ((cmd >> 7) & 0x3) << 6;
+		imm |= ((cmd >> 9) & 0xf) << 2;
+		in->rs1 = 2;
+		in->rs2 = (cmd >> 2) & 0x1f;
+		break;
+	}
+	in->imm = imm;
+}
+
+void decode_cmd(uint32_t cmd, struct insn *in)
+{
+	const struct dec32 *d;
+	int32_t imm = 0;
+
+	/* opcode[6:2] and funct3 select the candidates */
+	d = &dec32_list[dec32_idx[((cmd >> 2) & 0x1f) << 3 | ((cmd >> 12) & 0x7)]];
+	while ((cmd & d->mask) != d->match)
+		d++;
+
+	in->op = d->op;
+	in->len = 4;
+	in->rd = (cmd >> 7) & 0x1f;
+	in->rs1 = (cmd >> 15) & 0x1f;
+	in->rs2 = (cmd >> 20) & 0x1f;
+
+	/* clear the fields the format does not use */
+	switch (d->fmt) {
+	case FMT_U:
+	case FMT_J:
+		in->rs1 = 0;
+		/* fall through */
+	case FMT_I:
+	case FMT_L:
+	case FMT_SH:
+		in->rs2 = 0;
+		break;
+	case FMT_S:
+	case FMT_B:
+		in->rd = 0;
+		break;
+	}
+
+	switch (d->fmt) {
+	case FMT_I:
+	case FMT_L:
+		imm = (cmd >> 20) & 0xfff;
+		if (imm & (1 << 11)) imm |= 0xfffff000;
+		break;
+	case FMT_SH:
+		imm = (cmd >> 20) & 0x1f;
+		break;
+	case FMT_S:
+		imm = (cmd >> 7) & 0x1f;
+		imm |= ((cmd >> 25) & 0x7f) << 5;
+		if (imm & (1 << 11)) imm |= 0xfffff000;
+		break;
+	case FMT_B:
+		imm = ((cmd >> 25) & 0x3f) << 5;
+		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
+		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
+		imm |= ((cmd >> 8) & 0xf) << 1;
+		if (imm & (1 << 12)) imm |= 0xfffff000;
+		break;
+	case FMT_U:
+		imm = cmd & 0xfffff000;
+		break;
+	case FMT_J:
+		imm = ((cmd >> 21) & 0x3ff) << 1;
+		imm |= (cmd & (1 << 31)) ? (1 << 20) : 0;
+		imm |= (cmd & (1 << 20)) ? (1 << 11) : 0;
+		imm |= ((cmd >> 12) & 0xff) << 12;
+		if (imm & (1 << 20)) imm |= 0xfff00000;
+		break;
+	}
+	in->imm = imm;
+}
+
+/*
+	decode the instruction at pc into its icache entry. other harts
+	may be running from the same entry, so the fields are filled in
+	first and op is published last
+*/
+void decode_insn(struct insn *in, uint32_t pc, struct cpu_state *cs)
+{
+	uint16_t *p = (uint16_t*)(cs->ram + (pc - cs->ram_base));
+	struct insn d;
+	uint32_t cmd;
+
+	memset(&d, 0, sizeof(d));
+	cmd = le16(p[0]);
+	if (is_compressed(cmd)) {
+		decode_compressed_cmd(cmd, &d);
+	}
+	else if (pc - cs->ram_base + 4 > cs->ram_size) {
+		d.op = OP_INVALID;
+		d.len = 4;
+	}
+	else {
+		cmd |= le16(p[1]) << 16;
+		decode_cmd(cmd, &d);
+	}
+	in->rd = d.rd;
+	in->rs1 = d.rs1;
+	in->rs2 = d.rs2;
+	in->imm = d.imm;
+	in->len = d.len;
+	code_mark(pc - cs->ram_base, cs);
+	__atomic_store_n(&in->op, d.op, __ATOMIC_RELEASE);
+}
+
+/* fuse the freshly decoded in at pc with the instruction after it */
+void fuse_insn(struct insn *in, uint32_t pc, struct cpu_state *cs)
+{
+	struct insn *nx = in + (in->len >> 1);
+	uint32_t i;
+
+	if (!in->rd || pc - cs->ram_base + in->len >= cs->ram_size)
+		return;
+	for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++)
+		if (fusions[i].first == in->op)
+			break;
+	if (i == sizeof(fusions) / sizeof(fusions[0]))
+		return;
+	/* nx won't come through do_NONE, it may start a loop */
+	if (nx->op == OP_NONE) {
+		decode_insn(nx, pc + in->len, cs);
+		idiom_find(nx, pc + in->len, cs);
+	}
+	for (; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+		if (fusions[i].first == in->op && fusions[i].second == nx->op) {
+			in->op = fusions[i].op;
+			return;
+		}
+	}
+}
+
+/* only what is implemented so far, -1 for anything else */
+int csr_read(struct cpu_state *cs, uint32_t csr, uint32_t *v)
+{
+	switch (csr) {
+	case CSR_MSTATUS:
+		*v = cs->csr.mstatus | MSTATUS_MPP;
+		return 0;
+	case CSR_MIE:
+		*v = cs->csr.mie;
+		return 0;
+	case CSR_MTVEC:
+		*v = cs->csr.mtvec;
+		return 0;
+	case CSR_MSCRATCH:
+		*v = cs->csr.mscratch;
+		return 0;
+	case CSR_MEPC:
+		*v = cs->csr.mepc;
+		return 0;
+	case CSR_MCAUSE:
+		*v = cs->csr.mcause;
+		return 0;
+	case CSR_MTVAL:
+		*v = cs->csr.mtval;
+		return 0;
+	case CSR_MIP:
+		*v = cpu_mip(cs);
+		return 0;
+	case CSR_CYCLE:
+	case CSR_INSTRET:
+		*v = cs->icount;
+		return 0;
+	case CSR_CYCLEH:
+	case CSR_INSTRETH:
+		*v = cs->icount >> 32;
+		return 0;
+	case CSR_TIME:
+		*v = clint_mtime(cs->clint);
+		return 0;
+	case CSR_TIMEH:
+		*v = clint_mtime(cs->clint) >> 32;
+		return 0;
+	case CSR_MHARTID:
+		*v = cs->hartid;
+		return 0;
+	}
+	return -1;
+}
+
+/* the counters, mip and mhartid are read only */
+int csr_write(struct cpu_state *cs, uint32_t csr, uint32_t v)
+{
+	switch (csr) {
+	case CSR_MSTATUS:
+		cs->csr.mstatus = v & (MSTATUS_MIE | MSTATUS_MPIE);
+		cpu_irq_update(cs);
+		return 0;
+	case CSR_MIE:
+		cs->csr.mie = v & (MIP_MSIP | MIP_MTIP);
+		cpu_irq_update(cs);
+		return 0;
+	case CSR_MTVEC:
+		/* direct or vectored */
+		cs->csr.mtvec = v & ~2;
+		return 0;
+	case CSR_MSCRATCH:
+		cs->csr.mscratch = v;
+		return 0;
+	case CSR_MEPC:
+		cs->csr.mepc = v & ~1;
+		return 0;
+	case CSR_MCAUSE:
+		cs->csr.mcause = v;
+		return 0;
+	case CSR_MTVAL:
+		cs->csr.mtval = v;
+		return 0;
+	case CSR_MIP:
+		return 0;
+	}
+	return -1;
+}
+
+void csr_reset(struct cpu_state *cs)
+{
+	memset(&cs->csr, 0, sizeof(cs->csr));
+	cs->csr.mtimecmp = UINT64_MAX;
+	__atomic_store_n(&cs->irq_at, UINT64_MAX, __ATOMIC_RELAXED);
+}
+
+uint32_t cpu_mip(struct cpu_state *cs)
+{
+	uint32_t mip = cs->csr.msip ? MIP_MSIP : 0;
+
+	if (clint_mtime(cs->clint) >= cs->csr.mtimecmp)
+		mip |= MIP_MTIP;
+	return mip;
+}
+
+/*
+	interrupts are only taken between runs of the loops, see run_hart.
+	irq_at is where the loops stop to look: now when one is pending and
+	enabled, at mtimecmp when the timer is enabled, else never. called
+	whenever one of the inputs changes, so the loops themselves never
+	check anything but icount_limit.
+*/
+void cpu_irq_update(struct cpu_state *cs)
+{
+	uint64_t at = UINT64_MAX;
+
+	if (cs->csr.mstatus & MSTATUS_MIE) {
+		if (cs->csr.mie & cpu_mip(cs))
+			at = cs->icount;
+		else if (cs->csr.mie & MIP_MTIP)
+			at = clint_deadline(cs->clint, cs);
+	}
+	__atomic_store_n(&cs->irq_at, at, __ATOMIC_RELAXED);
+	cpu_set_limit(cs);
+}
+
+/* takes the pending interrupt with the highest priority, pc is the
+   next instruction to run. 1 if there was one */
+int cpu_interrupt(struct cpu_state *cs)
+{
+	uint32_t pending, cause;
+
+	if (!(cs->csr.mstatus & MSTATUS_MIE))
+		return 0;
+	pending = cs->csr.mie & cpu_mip(cs);
+	if (!pending)
+		return 0;
+	cause = pending & MIP_MSIP ? IRQ_MSI : IRQ_MTI;
+	cs->csr.mepc = cs->pc;
+	cs->csr.mcause = MCAUSE_INTERRUPT | cause;
+	cs->csr.mtval = 0;
+	cs->csr.mstatus = MSTATUS_MPIE;
+	cs->pc = cs->csr.mtvec & ~3;
+	if (cs->csr.mtvec & 1)
+		cs->pc += 4 * cause;
+	return 1;
+}
+
+/*
+	an exception at pc goes to the handler at mtvec, never vectored.
+	0 when there is nobody to take it: mtvec unset or outside of ram,
+	or the handler faulting on its own first instruction. the caller
+	then stops the run, so a guest without a trap handler ends at its
+	first exception instead of jumping to 0.
+*/
+int cpu_trap(struct cpu_state *cs, uint32_t cause, uint32_t tval)
+{
+	uint32_t base = cs->csr.mtvec & ~3;
+
+	if (!base || base - cs->ram_base >= cs->ram_size || base == cs->pc)
+		return 0;
+	cs->csr.mepc = cs->pc;
+	cs->csr.mcause = cause;
+	cs->csr.mtval = tval;
+	cs->csr.mstatus = cs->csr.mstatus & MSTATUS_MIE ? MSTATUS_MPIE : 0;
+	cs->pc = base;
+	cpu_irq_update(cs);
+	return 1;
+}
+
+/* illegal instruction at pc, mtval holds its bits */
+int cpu_illegal(struct cpu_state *cs)
+{
+	uint32_t off = cs->pc - cs->ram_base, bits;
+
+	bits = le16(*(uint16_t*)(cs->ram + off));
+	if (!is_compressed(bits) && off + 4 <= cs->ram_size)
+		bits |= le16(*(uint16_t*)(cs->ram + off + 2)) << 16;
+	return cpu_trap(cs, CAUSE_ILLEGAL_INSN, bits);
+}
+
+/* the caller jumps to mepc */
+void cpu_mret(struct cpu_state *cs)
+{
+	cs->csr.mstatus = (cs->csr.mstatus & MSTATUS_MPIE ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+	cpu_irq_update(cs);
+}
+
+/* wfi returns right away when something is pending, even with MIE
+   clear, else mtime skips to the timer. nothing to wait for makes it
+   a nop */
+void cpu_wfi(struct cpu_state *cs)
+{
+	if (cs->csr.mie & cpu_mip(cs))
+		return;
+	if (cs->csr.mie & MIP_MTIP) {
+		clint_skip(cs->clint, cs);
+		cpu_irq_update(cs);
+	}
+}
+
+void print_insn(uint32_t pc, uint32_t cmd, struct insn *in, uint32_t addr)
+{
+	const char *name = op_names[in->op];
+
+	if (in->len == 4)
+		printf("0x%04x: %08x    ", pc, cmd);
+	else
+		printf("0x%04x: %04x        ", pc, cmd);
+
+	switch (op_fmt[in->op]) {
+	case FMT_U:
+		printf("%s x%d, %d\n", name, in->rd, in->imm);
+		break;
+	case FMT_J:
+		printf("%s x%d, 0x%x\n", name, in->rd, pc + in->imm);
+		break;
+	case FMT_B:
+		printf("%s x%d, x%d, 0x%x\n", name, in->rs1, in->rs2, pc + in->imm);
+		break;
+	case FMT_L:
+		printf("%s x%d, %d(x%d) (addr = 0x%x)\n", name, in->rd, in->imm,
+			in->rs1, addr);
+		break;
+	case FMT_S:
+		printf("%s x%d, %d(x%d) (addr = 0x%x)\n", name, in->rs2, in->imm,
+			in->rs1, addr);
+		break;
+	case FMT_I:
+	case FMT_SH:
+		printf("%s x%d, x%d, %d\n", name, in->rd, in->rs1, in->imm);
+		break;
+	case FMT_R:
+		printf("%s x%d, x%d, x%d\n", name, in->rd, in->rs1, in->rs2);
+		break;
+	default:
+		printf("%s\n", name);
+		break;
+	}
+}
+
+#define LOOP_NAME decode_loop_plain
+#define LOOP_TRACE 0
+#define LOOP_GUARD 0
+#define LOOP_PROFILE 0
+#define LOOP_COVER 0
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_trace
+#define LOOP_TRACE 1
+#define LOOP_GUARD 0
+#define LOOP_PROFILE 0
+#define LOOP_COVER 0
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_guard
+#define LOOP_TRACE 0
+#define LOOP_GUARD 1
+#define LOOP_PROFILE 0
+#define LOOP_COVER 0
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_profile
+#define LOOP_TRACE 0
+#define LOOP_GUARD 0
+#define LOOP_PROFILE 1
+#define LOOP_COVER 0
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_profile_guard
+#define LOOP_TRACE 0
+#define LOOP_GUARD 1
+#define LOOP_PROFILE 1
+#define LOOP_COVER 0
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_cover
+#define LOOP_TRACE 0
+#define LOOP_GUARD 0
+#define LOOP_PROFILE 0
+#define LOOP_COVER 1
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_cover_guard
+#define LOOP_TRACE 0
+#define LOOP_GUARD 1
+#define LOOP_PROFILE 0
+#define LOOP_COVER 1
+#define LOOP_TIMING 0
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_timing
+#define LOOP_TRACE 0
+#define LOOP_GUARD 0
+#define LOOP_PROFILE 0
+#define LOOP_COVER 0
+#define LOOP_TIMING 1
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+#define LOOP_NAME decode_loop_timing_guard
+#define LOOP_TRACE 0
+#define LOOP_GUARD 1
+#define LOOP_PROFILE 0
+#define LOOP_COVER 0
+#define LOOP_TIMING 1
+#include "decode_loop.h"
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_GUARD
+#undef LOOP_PROFILE
+#undef LOOP_COVER
+#undef LOOP_TIMING
+
+/* returns 0 when the instruction budget is used up, -1 on a bad pc,
+   -2 on an invalid instruction, -3 on ecall and -4 on ebreak. with a
+   trap handler set up those go to the guest instead */
+int decode_loop(struct cpu_state *cs)
+{
+	if (cs->trace)
+		return decode_loop_trace(cs);
+	if (cs->prof)
+		return cs->guard_base ? decode_loop_profile_guard(cs) : decode_loop_profile(cs);
+	if (cs->timing)
+		return cs->guard_base ? decode_loop_timing_guard(cs) : decode_loop_timing(cs);
+	if (cs->cover)
+		return cs->guard_base ? decode_loop_cover_guard(cs) : decode_loop_cover(cs);
+	if (cs->guard_base)
+		return decode_loop_guard(cs);
+	return decode_loop_plain(cs);
+}
@@ -0,0 +1,280 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <setjmp.h>
+
+/*
+	risc-v registers
+
+	- 32 general purpose registers x0 - x31
+
+	#    | compressed enc. |  ABI name | saved by calle_ | desc. 
+	-----|-----------------|-----------|-----------------|--------------------
+	x0   |     -           |   "zero"  |   -             |   hardwired zero
+	x1   |     -           |   "ra  "  |   R             |   return address
+	x2   |     -           |   "sp"    |   E             |   stack pointer
+	x3   |     -           |   "gp"    |   -             |   global pointer
+	x4   |     -           |   "tp"    |   -             |   thread pointer
+	x5   |     -           |   "t0"    |   R             |   temp register 0
+	x6   |     -           |   "t1"    |   R             |   temp register 1
+	x7   |     -           |   "t2"    |   R             |   temp register 2
+	x8   |     0           |   "s0/fp" |   E             |   saved reg 0 / frame pointer
+	x9   |     1           |   "s1"    |   E             |   saved reg 1
+	x10  |     2           |   "a0"    |   R             |   argument 0 / ret value 0
+	x11  |     3           |   "a1"    |   R             |   argument 1 / ret value 1
+	x12  |     4           |   "a2"    |   R             |   argument 2
+	x13  |     5           |   "a3"    |   R             |   argument 3 
+	x14  |     6           |   "a4"    |   R             |   argument 4 
+	x15  |     7           |   "a5"    |   R             |   argument 5 
+	x16  |     -           |   "a6"    |   R             |   argument 6 
+	x17  |     -           |   "a7"    |   R             |   argument 7 
+	x18  |     -           |   "s2"    |   E             |   saved reg 2 
+	x19  |     -           |   "s3"    |   E             |   saved reg 3 
+	x20  |     -           |   "s4"    |   E             |   saved reg 4 
+	x21  |     -           |   "s5"    |   E             |   saved reg 5 
+	x22  |     -           |   "s6"    |   E             |   saved reg 6 
+	x23  |     -           |   "s7"    |   E             |   saved reg 7 
+	x24  |     -           |   "s8"    |   E             |   saved reg 8 
+	x25  |     -           |   "s9"    |   E             |   saved reg 9 
+	x26  |     -           |   "s10"   |   E             |   saved reg 10 
+	x27  |     -           |   "s11"   |   E             |   saved reg 11 
+	x28  |     -           |   "t3"    |   R             |   temp register 3 
+	x29  |     -           |   "t4"    |   R             |   temp register 4 
+	x30  |     -           |   "t5"    |   R             |   temp register 5 
+	x31  |     -           |   "t6"    |   R             |   temp register 6 
+	
+*/
+
+#define RAM_SIZE 65536		/* default, see --ram-size */
+#define UART_BASE 0xc0000000
+#define UART_SIZE 0x1000
+#define EXIT_BASE 0xc0001000	/* see emu_exit_code */
+#define EXIT_SIZE 0x1000
+
+/*
+	predecoded instruction
+
+	compressed instructions are expanded to their 32-bit equivalents,
+	so the executor only knows about the base instruction set. one
+	record per halfword of ram, indexed by pc / 2. the first entry of
+	a pair listed with FUSE in insns.def carries the fused op, its
+	fields stay those of the first instruction. the same goes for the
+	head of a loop that gets an IDIOM op.
+*/
+
+enum {
+	OP_NONE = 0,	/* not decoded yet */
+	OP_INVALID,
+#define INSN(name, mnemonic, match, mask, fmt) OP_##name,
+#include "insns.def"
+#define FUSE(name, first, second) OP_##name,
+#include "insns.def"
+#define IDIOM(name, first) OP_##name,
+#include "insns.def"
+	OP_MAX
+};
+
+/* operand layouts, see insns.def */
+enum {
+	FMT_NONE = 0,
+	FMT_R,
+	FMT_I,
+	FMT_L,
+	FMT_SH,
+	FMT_S,
+	FMT_B,
+	FMT_U,
+	FMT_J,
+	FMT_CIW,
+	FMT_CL,
+	FMT_CS,
+	FMT_CI,
+	FMT_CJAL,
+	FMT_CLI,
+	FMT_CI16,
+	FMT_CLUI,
+	FMT_CBSH,
+	FMT_CBI,
+	FMT_CA,
+	FMT_CJ,
+	FMT_CB,
+	FMT_CSH,
+	FMT_CLWSP,
+	FMT_CJR,
+	FMT_CMV,
+	FMT_CJALR,
+	FMT_CR,
+	FMT_CSWSP,
+};
+
+struct insn {
+	uint8_t op;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	int32_t imm;
+	uint8_t len;
+};
+
+/* machine mode, the only privilege level. mtimecmp and msip are the
+   hart's registers in the clint */
+struct csr_state {
+	uint32_t mstatus;	/* MIE and MPIE, MPP always reads as machine */
+	uint32_t mie;
+	uint32_t mtvec;
+	uint32_t mscratch;
+	uint32_t mepc;
+	uint32_t mcause;
+	uint32_t mtval;
+	uint32_t msip;
+	uint64_t mtimecmp;
+};
+
+struct cpu_state{
+	uint32_t regs[32];
+	uint32_t pc;
+	struct mem *mem;	/* memory map */
+	uint8_t *ram;		/* the ram region of mem */
+	uint32_t ram_base;
+	uint32_t ram_size;
+	uint8_t *guard_base;	/* guest address 0 in guard mode, else NULL */
+	struct insn *icache;	/* one entry per halfword of ram */
+	jmp_buf *fault;		/* where access faults return to */
+	uint64_t icount;	/* retired instructions */
+	uint64_t icount_limit;	/* stop at the first jump or branch after this */
+	uint64_t icount_end;	/* end of the budget, see cpu_set_limit */
+	uint64_t irq_at;	/* look for interrupts from here on */
+	struct trace *trace;	/* record every instruction, NULL when off */
+	struct profile *prof;	/* execution counters, NULL when off */
+	struct timing *timing;	/* cache and branch predictor model, NULL when off */
+	struct sys *sys;	/* user mode syscalls on ecall, NULL when off */
+	uint8_t *cover;		/* edge counts, COVER_SIZE bytes, NULL when off */
+	uint32_t cover_prev;	/* cover_id of the last block >> 1 */
+	struct jit *jit;
+	uint8_t *jit_pages;	/* translated code per JIT_PAGE_SIZE of ram */
+	uint8_t jit_flush;	/* a store hit translated code */
+	struct aot *aot;	/* ahead of time translated blocks, see aot.h */
+	uint64_t *dirty;	/* ram pages stored to, one bit per page */
+	uint64_t *dirty_kept;	/* ... before the last snapshot or delta, emu_reset
+				   reads these back too */
+	uint64_t *code;		/* ram pages decoded from, same layout */
+	uint64_t *rom;		/* ram pages in rom regions, same layout */
+	uint32_t hartid;	/* mhartid */
+	uint32_t lr_addr;	/* reservation of the last lr.w */
+	uint32_t lr_val;	/* the word lr.w read, sc.w compares against it */
+	uint8_t lr_valid;
+	struct csr_state csr;
+	struct clint *clint;	/* mtime, shared by the harts */
+	uint32_t idiom_pc;	/* a loop idiom_run gave up on ... */
+	uint64_t idiom_until;	/* ... runs as is until this icount */
+};
+
+/* harts of one guest share memory and the icache, see emu_run */
+#define MAX_HARTS 32
+
+#define CSR_MSTATUS 0x300
+#define CSR_MIE 0x304
+#define CSR_MTVEC 0x305
+#define CSR_MSCRATCH 0x340
+#define CSR_MEPC 0x341
+#define CSR_MCAUSE 0x342
+#define CSR_MTVAL 0x343
+#define CSR_MIP 0x344
+#define CSR_CYCLE 0xc00
+#define CSR_TIME 0xc01
+#define CSR_INSTRET 0xc02
+#define CSR_CYCLEH 0xc80
+#define CSR_TIMEH 0xc81
+#define CSR_INSTRETH 0xc82
+#define CSR_MHARTID 0xf14
+
+#define MSTATUS_MIE (1 << 3)
+#define MSTATUS_MPIE (1 << 7)
+#define MSTATUS_MPP (3 << 11)
+
+/* mie and mip */
+#define IRQ_MSI 3
+#define IRQ_MTI 7
+#define MIP_MSIP (1 << IRQ_MSI)
+#define MIP_MTIP (1 << IRQ_MTI)
+
+#define MCAUSE_INTERRUPT 0x80000000
+
+/* mcause of the exceptions */
+#define CAUSE_FETCH_MISALIGNED 0
+#define CAUSE_FETCH_FAULT 1
+#define CAUSE_ILLEGAL_INSN 2
+#define CAUSE_BREAKPOINT 3
+#define CAUSE_LOAD_FAULT 5
+#define CAUSE_STORE_FAULT 7
+#define CAUSE_ECALL_M 11
+
+/*
+	edge coverage the way afl records it: each block gets an id from
+	its pc, the edge from block a to block b counts at id(b) ^ id(a) >> 1
+	in a COVER_SIZE byte map, emu.h has it as EMU_COVER_SIZE
+*/
+#define COVER_SIZE 65536
+
+static inline uint32_t cover_id(uint32_t pc)
+{
+	return (pc * 0x9e3779b1u) >> 16;
+}
+
+/* pages of the dirty bitmap, see emu_delta and emu_reset */
+#define DIRTY_PAGE_SHIFT 12
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_SHIFT)
+
+/* granularity of the translated code map, small so data next to code
+   does not keep flushing the translation cache */
+#define JIT_PAGE_SHIFT 8
+#define JIT_PAGE_SIZE (1 << JIT_PAGE_SHIFT)
+
+int32_t is_compressed(uint16_t c);
+void decode_cmd(uint32_t cmd, struct insn *in);
+void decode_compressed_cmd(uint16_t cmd, struct insn *in);
+void decode_insn(struct insn *in, uint32_t pc, struct cpu_state *cs);
+void print_insn(uint32_t pc, uint32_t cmd, struct insn *in, uint32_t addr);
+void fuse_insn(struct insn *in, uint32_t pc, struct cpu_state *cs);
+int idiom_find(struct insn *in, uint32_t pc, struct cpu_state *cs);
+int idiom_run(struct cpu_state *cs, struct insn *in);
+int decode_loop(struct cpu_state *cs);
+int csr_read(struct cpu_state *cs, uint32_t csr, uint32_t *v);
+int csr_write(struct cpu_state *cs, uint32_t csr, uint32_t v);
+void csr_reset(struct cpu_state *cs);
+uint32_t cpu_mip(struct cpu_state *cs);
+void cpu_irq_update(struct cpu_state *cs);
+int cpu_interrupt(struct cpu_state *cs);
+int cpu_trap(struct cpu_state *cs, uint32_t cause, uint32_t tval);
+int cpu_illegal(struct cpu_state *cs);
+void cpu_mret(struct cpu_state *cs);
+void cpu_wfi(struct cpu_state *cs);
+
+/* the loops stop at the end of the budget or where an interrupt may
+   be due, whichever comes first. other threads move all three, the
+   guest's exit and clint writes to another hart's registers, so they
+   are relaxed atomics */
+static inline void cpu_set_limit(struct cpu_state *cs)
+{
+	uint64_t at = __atomic_load_n(&cs->irq_at, __ATOMIC_RELAXED);
+	uint64_t end = __atomic_load_n(&cs->icount_end, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&cs->icount_limit, at < end ? at : end, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t cpu_limit(struct cpu_state *cs)
+{
+	return __atomic_load_n(&cs->icount_limit, __ATOMIC_RELAXED);
+}
+
+/* first instruction of a fused or idiom op, plain ops map to
+   themselves */
+extern const uint8_t op_base[OP_MAX];
+
+int jit_init(struct cpu_state *cs);
+int jit_loop(struct cpu_state *cs);
+void jit_flush(struct cpu_state *cs);
+void jit_free(struct cpu_state *cs);
+
+#endif
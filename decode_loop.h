@@ -0,0 +1,622 @@
+/*
+	interpreter loop, included by cpu.c once per variant:
+
+	LOOP_NAME	name of the function
+	LOOP_TRACE	1 to record every instruction into cs->trace
+	LOOP_GUARD	1 for guard mode memory, loads and stores are a
+			single host access without bounds checks
+	LOOP_PROFILE	1 to count block entries, branches, calls and
+			memory accesses into cs->prof, see profile.h
+	LOOP_COVER	1 to count edges between blocks into cs->cover,
+			see cover_id
+	LOOP_TIMING	1 to run fetches, loads, stores and branches
+			through the cache and predictor model in
+			cs->timing, see timing.h
+
+	threaded dispatch: every handler ends by jumping straight to the
+	handler of the next instruction. entries that are not decoded yet
+	land in do_NONE, which decodes them in place. the instruction
+	budget is only checked on jumps and branches, so the loop always
+	returns at the end of a basic block.
+*/
+
+#if LOOP_TRACE
+/* the record is completed with the rd value when the next one starts,
+   t is the ram offset of pc from DISPATCH */
+#define TRACE_BEGIN() \
+	do { \
+		tr.pc = cs->pc; \
+		tr.insn = le16(((uint16_t*)cs->ram)[t / 2]); \
+		if (in->len == 4) \
+			tr.insn |= le16(((uint16_t*)cs->ram)[t / 2 + 1]) << 16; \
+		tr.addr = 0; \
+		if (op_fmt[op_base[in->op]] == FMT_L || op_fmt[op_base[in->op]] == FMT_S) \
+			tr.addr = X(in->rs1) + in->imm; \
+		tr_valid = 1; \
+	} while (0)
+#define TRACE_END() \
+	do { \
+		if (tr_valid) { \
+			tr.rd = X(in->rd); \
+			trace_put(cs->trace, &tr); \
+			tr_valid = 0; \
+		} \
+	} while (0)
+#define TRACE_STEP() \
+	do { \
+		t = cs->pc - cs->ram_base; \
+		TRACE_BEGIN(); \
+	} while (0)
+#define TRACE_DROP() tr_valid = 0
+#else
+#define TRACE_BEGIN()
+#define TRACE_END()
+#define TRACE_STEP()
+#define TRACE_DROP()
+#endif
+
+#if LOOP_GUARD
+#define MEM_READ(size, addr) guard_read_##size(addr, cs)
+#define MEM_WRITE(size, addr, v) guard_write_##size(addr, v, cs)
+#else
+#define MEM_READ(size, addr) read_##size(addr, cs)
+#define MEM_WRITE(size, addr, v) write_##size(addr, v, cs)
+#endif
+
+#if LOOP_PROFILE
+#define READ(size, addr) \
+	(cs->prof->loads[prof_page(cs->prof, addr)]++, MEM_READ(size, addr))
+#define WRITE(size, addr, v) \
+	(cs->prof->stores[prof_page(cs->prof, addr)]++, MEM_WRITE(size, addr, v))
+/* a block starts at cs->pc */
+#define PROF_ENTRY() \
+	do { \
+		t = cs->pc - cs->ram_base; \
+		if (t < cs->ram_size) \
+			cs->prof->entries[t >> 1]++; \
+	} while (0)
+#define PROF_BRANCH(dir) cs->prof->dir[(cs->pc - cs->ram_base) >> 1]++
+/* linking ra or t0 is a call, jumping through them to x0 a return */
+#define PROF_CALL(target) \
+	do { \
+		if (in->rd == 1 || in->rd == 5) \
+			prof_call(cs->prof, target, cs->icount); \
+		else if (!in->rd && op_base[in->op] == OP_JALR && (in->rs1 == 1 || in->rs1 == 5)) \
+			prof_ret(cs->prof, cs->icount); \
+	} while (0)
+#else
+#define READ(size, addr) MEM_READ(size, addr)
+#define WRITE(size, addr, v) MEM_WRITE(size, addr, v)
+#define PROF_ENTRY()
+#define PROF_BRANCH(dir)
+#define PROF_CALL(target)
+#endif
+
+#if LOOP_TIMING
+#undef READ
+#undef WRITE
+#define READ(size, addr) \
+	(tm_data(cs->timing, addr, 0, cs->pc), MEM_READ(size, addr))
+#define WRITE(size, addr, v) \
+	(tm_data(cs->timing, addr, 1, cs->pc), MEM_WRITE(size, addr, v))
+#define TIMING_FETCH() tm_fetch(cs->timing, cs->pc)
+#define TIMING_BRANCH(taken) tm_branch(cs->timing, cs->pc, taken)
+#else
+#define TIMING_FETCH()
+#define TIMING_BRANCH(taken)
+#endif
+
+#if LOOP_COVER
+/* a block starts at cs->pc, count the edge from the one before. like
+   afl++'s NeverZero a count wraps to 1, not 0 */
+#define COVER_ENTRY() \
+	do { \
+		t = cover_id(cs->pc) ^ cs->cover_prev; \
+		cs->cover[t] += 1 + (cs->cover[t] == 255); \
+		cs->cover_prev = cover_id(cs->pc) >> 1; \
+	} while (0)
+#else
+#define COVER_ENTRY()
+#endif
+
+#define X(r) cs->regs[r]
+#define DISPATCH() \
+	do { \
+		cs->regs[0] = 0; \
+		TRACE_END(); \
+		t = cs->pc - cs->ram_base; \
+		if (t >= cs->ram_size || (t & 0x1)) goto bad_pc; \
+		TIMING_FETCH(); \
+		in = &cs->icache[t >> 1]; \
+		if (LOOP_TRACE && in->op != OP_NONE) TRACE_BEGIN(); \
+		goto *labels[in->op]; \
+	} while (0)
+#define NEXT() \
+	do { \
+		cs->icount++; \
+		cs->pc += in->len; \
+		DISPATCH(); \
+	} while (0)
+#define JUMP(target) \
+	do { \
+		cs->icount++; \
+		cs->pc = (target); \
+		if (cs->icount >= cpu_limit(cs)) goto out; \
+		PROF_ENTRY(); \
+		COVER_ENTRY(); \
+		DISPATCH(); \
+	} while (0)
+/* cpu_trap has moved pc to the handler. the trapping instruction
+   doesn't retire and leaves no trace record */
+#define TRAP() \
+	do { \
+		TRACE_DROP(); \
+		if (cs->icount >= cpu_limit(cs)) goto out; \
+		PROF_ENTRY(); \
+		COVER_ENTRY(); \
+		DISPATCH(); \
+	} while (0)
+#define BRANCH(cond) \
+	do { \
+		if (cond) { \
+			PROF_BRANCH(taken); \
+			TIMING_BRANCH(1); \
+			JUMP(cs->pc + in->imm); \
+		} \
+		PROF_BRANCH(not_taken); \
+		TIMING_BRANCH(0); \
+		JUMP(cs->pc + in->len); \
+	} while (0)
+
+/*
+	fused pairs: in is the first instruction, nx the second. only the
+	op of nx is checked, its fields are read as they are, so stores
+	rewriting the second instruction fall back to the plain handler
+	of the first. STEP retires the first one like NEXT without the
+	dispatch.
+*/
+#define FUSED(first, second) \
+	do { \
+		nx = in + (in->len >> 1); \
+		if (nx->op != OP_##second) goto do_##first; \
+	} while (0)
+#define STEP() \
+	do { \
+		cs->icount++; \
+		cs->pc += in->len; \
+		TIMING_FETCH(); \
+		TRACE_END(); \
+		in = nx; \
+		TRACE_STEP(); \
+	} while (0)
+
+/* loop heads, see idiom.c. traced, profiled, covered and timed runs
+   see every iteration */
+#if LOOP_TRACE || LOOP_PROFILE || LOOP_COVER || LOOP_TIMING
+#define IDIOM_RUN(first) goto do_##first
+#else
+#define IDIOM_RUN(first) \
+	do { \
+		if (!idiom_run(cs, in)) goto do_##first; \
+		if (cs->icount >= cpu_limit(cs)) goto out; \
+		DISPATCH(); \
+	} while (0)
+#endif
+
+int LOOP_NAME(struct cpu_state *cs)
+{
+	static void *labels[OP_MAX] = {
+		[OP_NONE] = &&do_NONE,
+		[OP_INVALID] = &&do_INVALID,
+#define INSN(name, mnemonic, match, mask, fmt) [OP_##name] = &&do_##name,
+#include "insns.def"
+#define FUSE(name, first, second) [OP_##name] = &&do_##name,
+#include "insns.def"
+#define IDIOM(name, first) [OP_##name] = &&do_##name,
+#include "insns.def"
+	};
+	struct insn *in = NULL, *nx;
+	uint32_t t;
+#if LOOP_TRACE
+	struct trace_rec tr;
+	int tr_valid = 0;
+#endif
+
+	PROF_ENTRY();
+	COVER_ENTRY();
+	DISPATCH();
+
+do_NONE:
+	decode_insn(in, cs->pc, cs);
+	fuse_insn(in, cs->pc, cs);
+	idiom_find(in, cs->pc, cs);
+	TRACE_BEGIN();
+	goto *labels[in->op];
+do_LUI:
+	X(in->rd) = in->imm;
+	NEXT();
+do_AUIPC:
+	X(in->rd) = cs->pc + in->imm;
+	NEXT();
+do_JAL:
+	PROF_CALL(cs->pc + in->imm);
+	X(in->rd) = cs->pc + in->len;
+	JUMP(cs->pc + in->imm);
+do_JALR:
+	t = (X(in->rs1) + in->imm) & 0xfffffffe;
+	PROF_CALL(t);
+	X(in->rd) = cs->pc + in->len;
+	JUMP(t);
+do_BEQ:
+	BRANCH(X(in->rs1) == X(in->rs2));
+do_BNE:
+	BRANCH(X(in->rs1) != X(in->rs2));
+do_BLT:
+	BRANCH((int32_t)X(in->rs1) < (int32_t)X(in->rs2));
+do_BGE:
+	BRANCH((int32_t)X(in->rs1) >= (int32_t)X(in->rs2));
+do_BLTU:
+	BRANCH(X(in->rs1) < X(in->rs2));
+do_BGEU:
+	BRANCH(X(in->rs1) >= X(in->rs2));
+do_LB:
+	X(in->rd) = (int8_t)READ(byte, X(in->rs1) + in->imm);
+	NEXT();
+do_LH:
+	X(in->rd) = (int16_t)READ(half, X(in->rs1) + in->imm);
+	NEXT();
+do_LW:
+	X(in->rd) = READ(word, X(in->rs1) + in->imm);
+	NEXT();
+do_LBU:
+	X(in->rd) = READ(byte, X(in->rs1) + in->imm);
+	NEXT();
+do_LHU:
+	X(in->rd) = READ(half, X(in->rs1) + in->imm);
+	NEXT();
+do_SB:
+	WRITE(byte, X(in->rs1) + in->imm, X(in->rs2));
+	NEXT();
+do_SH:
+	WRITE(half, X(in->rs1) + in->imm, X(in->rs2));
+	NEXT();
+do_SW:
+	WRITE(word, X(in->rs1) + in->imm, X(in->rs2));
+	NEXT();
+do_ADDI:
+	X(in->rd) = X(in->rs1) + in->imm;
+	NEXT();
+do_SLTI:
+	X(in->rd) = (int32_t)X(in->rs1) < in->imm;
+	NEXT();
+do_SLTIU:
+	X(in->rd) = X(in->rs1) < (uint32_t)in->imm;
+	NEXT();
+do_XORI:
+	X(in->rd) = X(in->rs1) ^ in->imm;
+	NEXT();
+do_ORI:
+	X(in->rd) = X(in->rs1) | in->imm;
+	NEXT();
+do_ANDI:
+	X(in->rd) = X(in->rs1) & in->imm;
+	NEXT();
+do_SLLI:
+	X(in->rd) = X(in->rs1) << in->imm;
+	NEXT();
+do_SRLI:
+	X(in->rd) = X(in->rs1) >> in->imm;
+	NEXT();
+do_SRAI:
+	X(in->rd) = (int32_t)X(in->rs1) >> in->imm;
+	NEXT();
+do_ADD:
+	X(in->rd) = X(in->rs1) + X(in->rs2);
+	NEXT();
+do_SUB:
+	X(in->rd) = X(in->rs1) - X(in->rs2);
+	NEXT();
+do_SLL:
+	X(in->rd) = X(in->rs1) << (X(in->rs2) & 0x1f);
+	NEXT();
+do_SLT:
+	X(in->rd) = (int32_t)X(in->rs1) < (int32_t)X(in->rs2);
+	NEXT();
+do_SLTU:
+	X(in->rd) = X(in->rs1) < X(in->rs2);
+	NEXT();
+do_XOR:
+	X(in->rd) = X(in->rs1) ^ X(in->rs2);
+	NEXT();
+do_SRL:
+	X(in->rd) = X(in->rs1) >> (X(in->rs2) & 0x1f);
+	NEXT();
+do_SRA:
+	X(in->rd) = (int32_t)X(in->rs1) >> (X(in->rs2) & 0x1f);
+	NEXT();
+do_OR:
+	X(in->rd) = X(in->rs1) | X(in->rs2);
+	NEXT();
+do_AND:
+	X(in->rd) = X(in->rs1) & X(in->rs2);
+	NEXT();
+do_MUL:
+	X(in->rd) = X(in->rs1) * X(in->rs2);
+	NEXT();
+do_MULH:
+	X(in->rd) = ((int64_t)(int32_t)X(in->rs1) * (int32_t)X(in->rs2)) >> 32;
+	NEXT();
+do_MULHSU:
+	X(in->rd) = ((int64_t)(int32_t)X(in->rs1) * (int64_t)X(in->rs2)) >> 32;
+	NEXT();
+do_MULHU:
+	X(in->rd) = ((uint64_t)X(in->rs1) * X(in->rs2)) >> 32;
+	NEXT();
+/* division by zero and overflow don't trap, results are from the spec */
+do_DIV:
+	if (X(in->rs2) == 0)
+		X(in->rd) = -1;
+	else if (X(in->rs2) == -1)
+		X(in->rd) = -X(in->rs1);
+	else
+		X(in->rd) = (int32_t)X(in->rs1) / (int32_t)X(in->rs2);
+	NEXT();
+do_DIVU:
+	if (X(in->rs2) == 0)
+		X(in->rd) = -1;
+	else
+		X(in->rd) = X(in->rs1) / X(in->rs2);
+	NEXT();
+do_REM:
+	if (X(in->rs2) == 0)
+		X(in->rd) = X(in->rs1);
+	else if (X(in->rs2) == -1)
+		X(in->rd) = 0;
+	else
+		X(in->rd) = (int32_t)X(in->rs1) % (int32_t)X(in->rs2);
+	NEXT();
+do_REMU:
+	if (X(in->rs2) == 0)
+		X(in->rd) = X(in->rs1);
+	else
+		X(in->rd) = X(in->rs1) % X(in->rs2);
+	NEXT();
+/* the reservation is the address and the word lr.w read, see mem_sc */
+do_LR_W:
+	t = X(in->rs1);
+	if (t & 3)
+		mem_fault(t, 0, cs);
+	cs->lr_val = READ(word, t);
+	cs->lr_addr = t;
+	cs->lr_valid = 1;
+	X(in->rd) = cs->lr_val;
+	NEXT();
+do_SC_W:
+	t = X(in->rs1);
+	if (t & 3)
+		mem_fault(t, 1, cs);
+	t = cs->lr_valid && cs->lr_addr == t && mem_sc(t, cs->lr_val, X(in->rs2), cs);
+	cs->lr_valid = 0;
+	X(in->rd) = !t;
+	NEXT();
+do_AMOSWAP_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOSWAP_W, cs);
+	NEXT();
+do_AMOADD_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOADD_W, cs);
+	NEXT();
+do_AMOXOR_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOXOR_W, cs);
+	NEXT();
+do_AMOAND_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOAND_W, cs);
+	NEXT();
+do_AMOOR_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOOR_W, cs);
+	NEXT();
+do_AMOMIN_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOMIN_W, cs);
+	NEXT();
+do_AMOMAX_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOMAX_W, cs);
+	NEXT();
+do_AMOMINU_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOMINU_W, cs);
+	NEXT();
+do_AMOMAXU_W:
+	X(in->rd) = mem_amo(X(in->rs1), X(in->rs2), OP_AMOMAXU_W, cs);
+	NEXT();
+/*
+	loads and stores are plain host accesses in program order. x86
+	only lets a later load pass an earlier store, so there a fence
+	needs a host fence only when it orders stores (pred w) before
+	loads (succ r), the rest just keeps the compiler from moving
+	accesses across. io is ordered by io_lock.
+*/
+do_FENCE:
+#if defined(__x86_64__) || defined(__i386__)
+	if (!(in->imm & 0x10) || !(in->imm & 0x02)) {
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		NEXT();
+	}
+#endif
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	NEXT();
+/* stores drop the predecoded entries they hit right away */
+do_FENCE_I:
+	NEXT();
+/* csr writes, mret and wfi can make an interrupt due, they end the
+   block so that the loop stops right after them, see cpu_irq_update */
+do_CSRRW:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    csr_write(cs, in->imm & 0xfff, X(in->rs1)) < 0)
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+do_CSRRS:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    (in->rs1 && csr_write(cs, in->imm & 0xfff, t | X(in->rs1)) < 0))
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+do_CSRRC:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    (in->rs1 && csr_write(cs, in->imm & 0xfff, t & ~X(in->rs1)) < 0))
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+do_CSRRWI:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    csr_write(cs, in->imm & 0xfff, in->rs1) < 0)
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+do_CSRRSI:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    (in->rs1 && csr_write(cs, in->imm & 0xfff, t | in->rs1) < 0))
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+do_CSRRCI:
+	if (csr_read(cs, in->imm & 0xfff, &t) < 0 ||
+	    (in->rs1 && csr_write(cs, in->imm & 0xfff, t & ~in->rs1) < 0))
+		goto do_INVALID;
+	X(in->rd) = t;
+	JUMP(cs->pc + in->len);
+/* without a handler the caller decides, pc stays at the instruction.
+   syscalls go to the host instead, see syscalls.h */
+do_ECALL:
+	if (cs->sys) {
+		sys_ecall(cs->sys, cs);
+		JUMP(cs->pc + 4);
+	}
+	if (cpu_trap(cs, CAUSE_ECALL_M, 0))
+		TRAP();
+	return -3;
+do_EBREAK:
+	if (cpu_trap(cs, CAUSE_BREAKPOINT, cs->pc))
+		TRAP();
+	return -4;
+do_MRET:
+	cpu_mret(cs);
+	JUMP(cs->csr.mepc);
+do_WFI:
+	cpu_wfi(cs);
+	JUMP(cs->pc + in->len);
+
+do_LUI_ADDI:
+	FUSED(LUI, ADDI);
+	X(in->rd) = in->imm;
+	STEP();
+	X(in->rd) = X(in->rs1) + in->imm;
+	NEXT();
+do_AUIPC_ADDI:
+	FUSED(AUIPC, ADDI);
+	X(in->rd) = cs->pc + in->imm;
+	STEP();
+	X(in->rd) = X(in->rs1) + in->imm;
+	NEXT();
+do_AUIPC_JALR:
+	FUSED(AUIPC, JALR);
+	X(in->rd) = cs->pc + in->imm;
+	STEP();
+	t = (X(in->rs1) + in->imm) & 0xfffffffe;
+	PROF_CALL(t);
+	X(in->rd) = cs->pc + in->len;
+	JUMP(t);
+do_AUIPC_LW:
+	FUSED(AUIPC, LW);
+	X(in->rd) = cs->pc + in->imm;
+	STEP();
+	X(in->rd) = READ(word, X(in->rs1) + in->imm);
+	NEXT();
+do_SLT_BNE:
+	FUSED(SLT, BNE);
+	X(in->rd) = (int32_t)X(in->rs1) < (int32_t)X(in->rs2);
+	STEP();
+	BRANCH(X(in->rs1) != X(in->rs2));
+do_SLT_BEQ:
+	FUSED(SLT, BEQ);
+	X(in->rd) = (int32_t)X(in->rs1) < (int32_t)X(in->rs2);
+	STEP();
+	BRANCH(X(in->rs1) == X(in->rs2));
+do_SLTU_BNE:
+	FUSED(SLTU, BNE);
+	X(in->rd) = X(in->rs1) < X(in->rs2);
+	STEP();
+	BRANCH(X(in->rs1) != X(in->rs2));
+do_SLTU_BEQ:
+	FUSED(SLTU, BEQ);
+	X(in->rd) = X(in->rs1) < X(in->rs2);
+	STEP();
+	BRANCH(X(in->rs1) == X(in->rs2));
+do_ADDI_BNE:
+	FUSED(ADDI, BNE);
+	X(in->rd) = X(in->rs1) + in->imm;
+	STEP();
+	BRANCH(X(in->rs1) != X(in->rs2));
+do_ADDI_ADDI:
+	FUSED(ADDI, ADDI);
+	X(in->rd) = X(in->rs1) + in->imm;
+	STEP();
+	X(in->rd) = X(in->rs1) + in->imm;
+	NEXT();
+
+do_IDIOM_LB:
+	IDIOM_RUN(LB);
+do_IDIOM_LH:
+	IDIOM_RUN(LH);
+do_IDIOM_LW:
+	IDIOM_RUN(LW);
+do_IDIOM_LBU:
+	IDIOM_RUN(LBU);
+do_IDIOM_LHU:
+	IDIOM_RUN(LHU);
+do_IDIOM_SB:
+	IDIOM_RUN(SB);
+do_IDIOM_SH:
+	IDIOM_RUN(SH);
+do_IDIOM_SW:
+	IDIOM_RUN(SW);
+
+do_INVALID:
+	if (cpu_illegal(cs))
+		TRAP();
+	fprintf(stderr, "invalid instruction at pc 0x%x\n", cs->pc);
+	return -2;
+
+bad_pc:
+	if (cpu_trap(cs, t & 1 ? CAUSE_FETCH_MISALIGNED : CAUSE_FETCH_FAULT, cs->pc))
+		TRAP();
+	fprintf(stderr, "invalid PC value 0x%x\n", cs->pc);
+	return -1;
+
+out:
+	cs->regs[0] = 0;
+	TRACE_END();
+	return 0;
+}
+
+#undef MEM_READ
+#undef MEM_WRITE
+#undef READ
+#undef WRITE
+#undef PROF_ENTRY
+#undef PROF_BRANCH
+#undef PROF_CALL
+#undef COVER_ENTRY
+#undef TIMING_FETCH
+#undef TIMING_BRANCH
+#undef X
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef TRAP
+#undef BRANCH
+#undef FUSED
+#undef STEP
+#undef IDIOM_RUN
+#undef TRACE_STEP
+#undef TRACE_BEGIN
+#undef TRACE_END
+#undef TRACE_DROP
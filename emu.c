@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "profile.h"
+#include "timing.h"
+#include "syscalls.h"
+#include "clint.h"
+#include "aot.h"
+#include "emu.h"
+
+struct emu {
+	struct cpu_state harts[MAX_HARTS];
+	int nharts;
+	int cur;		/* hart the register accessors work on */
+	int stop;		/* a hart stopped early, the others follow */
+	struct mem mem;
+	struct clint clint;
+	struct emu_config cfg;
+	struct elf elf;		/* kept open for emu_reset */
+	char *path;		/* raw binary, when it isn't an elf */
+	uint32_t load_addr;
+	uint32_t entry;
+	uint32_t image_end;	/* the break starts here, see syscalls.h */
+	int snap_fd;		/* emu_reset goes back to this snapshot */
+	struct snap_header snap;
+	uint32_t tohost;	/* htif words of the elf image, 0 if none */
+	uint32_t fromhost;
+	int exited;		/* the guest asked to exit, see finish */
+	int exit_code;
+};
+
+struct emu *emu_create(const struct emu_config *cfg)
+{
+	struct emu *e;
+
+	e = (struct emu*)calloc(1, sizeof(struct emu));
+	if (!e)
+		return NULL;
+	e->cfg = *cfg;
+	if (!e->cfg.ram_size)
+		e->cfg.ram_size = RAM_SIZE;
+	if (e->cfg.ram_size & 0xfff) {
+		fprintf(stderr, "ram size must be a multiple of 4K\n");
+		free(e);
+		return NULL;
+	}
+	e->nharts = e->cfg.harts ? e->cfg.harts : 1;
+	if (e->nharts < 0 || e->nharts > MAX_HARTS) {
+		fprintf(stderr, "at most %d harts\n", MAX_HARTS);
+		free(e);
+		return NULL;
+	}
+	/* the trace, the profile and the timing model are fed by the
+	   interpreter, in different loops */
+	if (e->cfg.trace)
+		e->cfg.profile = 0;
+	if (e->cfg.trace || e->cfg.profile)
+		e->cfg.timing = NULL;
+	if (e->cfg.trace || e->cfg.profile || e->cfg.timing) {
+		e->cfg.jit = 0;
+		e->cfg.aot = NULL;
+	}
+	if (e->cfg.aot && e->cfg.jit) {
+		fprintf(stderr, "the translated code replaces the jit\n");
+		e->cfg.jit = 0;
+	}
+	/* translations and jit_pages belong to one hart, stores from the
+	   others would not flush them */
+	if (e->cfg.jit && e->nharts > 1) {
+		fprintf(stderr, "the jit runs a single hart, using the interpreter\n");
+		e->cfg.jit = 0;
+	}
+	if (e->cfg.aot && e->nharts > 1) {
+		fprintf(stderr, "translated code runs a single hart, using the interpreter\n");
+		e->cfg.aot = NULL;
+	}
+	if (e->cfg.syscalls && e->nharts > 1) {
+		fprintf(stderr, "syscalls need a single hart\n");
+		free(e);
+		return NULL;
+	}
+	mem_init(&e->mem);
+	e->elf.fd = -1;
+	e->snap_fd = -1;
+	clint_init(&e->clint, e->harts, e->nharts, e->cfg.tick);
+	e->harts[0].clint = &e->clint;
+	csr_reset(&e->harts[0]);
+	return e;
+}
+
+void emu_destroy(struct emu *e)
+{
+	if (e->harts[0].trace)
+		trace_close(e->harts[0].trace);
+	prof_close(e->harts[0].prof);
+	tm_close(e->harts[0].timing);
+	sys_close(e->harts[0].sys);
+	jit_free(&e->harts[0]);
+	aot_free(&e->harts[0]);
+	mem_detach(&e->harts[0]);
+	mem_free(&e->mem);
+	elf_close(&e->elf);
+	if (e->snap_fd >= 0)
+		close(e->snap_fd);
+	free(e->path);
+	free(e);
+}
+
+/* io region at base, devices can be added before or after emu_load */
+int emu_add_device(struct emu *e, const char *name, uint32_t base, uint32_t size,
+	emu_read_fn read, emu_write_fn write, void *dev)
+{
+	struct mem_region *r;
+
+	r = mem_add(&e->mem, name, base, size, MEM_IO);
+	if (!r) {
+		fprintf(stderr, "can't add %s at 0x%x\n", name, base);
+		return -1;
+	}
+	r->read = read;
+	r->write = write;
+	r->dev = dev;
+	return 0;
+}
+
+/*
+	the guest is done with exit code code. every hart stops at its next
+	jump, the one that wrote the exit register right away, the others
+	within HART_SLICE instructions
+*/
+static void finish(struct emu *e, int code)
+{
+	int i;
+
+	e->exit_code = code;
+	__atomic_store_n(&e->exited, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < e->nharts; i++) {
+		__atomic_store_n(&e->harts[i].icount_end, 0, __ATOMIC_RELAXED);
+		cpu_set_limit(&e->harts[i]);
+	}
+}
+
+#define EXIT_PASS 0x5555
+#define EXIT_FAIL 0x3333
+
+static uint32_t exit_read(void *dev, uint32_t off, int size)
+{
+	return 0;
+}
+
+/* sifive test finisher: 0x5555 passes, 0x3333 | code << 16 fails */
+static void exit_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+	if (off || size != 4)
+		return;
+	if ((data & 0xffff) == EXIT_PASS)
+		finish((struct emu*)dev, 0);
+	else if ((data & 0xffff) == EXIT_FAIL)
+		finish((struct emu*)dev, data >> 16);
+}
+
+static void guest_exit(void *dev, int code)
+{
+	finish((struct emu*)dev, code);
+}
+
+/* the clint and the exit register, each where ram leaves room for it */
+static void add_board(struct emu *e)
+{
+	struct mem_region *r;
+
+	r = mem_add(&e->mem, "clint", CLINT_BASE, CLINT_SIZE, MEM_IO);
+	if (r) {
+		r->read = clint_read;
+		r->write = clint_write;
+		r->dev = &e->clint;
+	}
+	r = mem_add(&e->mem, "exit", EXIT_BASE, EXIT_SIZE, MEM_IO);
+	if (r) {
+		r->read = exit_read;
+		r->write = exit_write;
+		r->dev = e;
+	}
+}
+
+/* the other harts share hart 0's memory, icache and dirty bits. they
+   start at the entry with their hartid in a0, like hart 0 does */
+static void reset_harts(struct emu *e)
+{
+	struct cpu_state *first = &e->harts[0], *cs;
+	int i;
+
+	for (i = 1; i < e->nharts; i++) {
+		cs = &e->harts[i];
+		memset(cs, 0, sizeof(*cs));
+		cs->mem = first->mem;
+		cs->ram = first->ram;
+		cs->ram_base = first->ram_base;
+		cs->ram_size = first->ram_size;
+		cs->guard_base = first->guard_base;
+		cs->icache = first->icache;
+		cs->dirty = first->dirty;
+		cs->dirty_kept = first->dirty_kept;
+		cs->code = first->code;
+		cs->rom = first->rom;
+		cs->clint = first->clint;
+		csr_reset(cs);
+		cs->hartid = i;
+		cs->regs[10] = i;
+		cs->pc = e->entry;
+	}
+}
+
+/* attach the loaded memory and protect its rom, then tracing, profiling, the timing model
+   and the jit or the translated code. only hart 0 is traced, profiled
+   and timed */
+static int start(struct emu *e)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (mem_attach(cs, &e->mem) < 0 || mem_protect(&e->mem, cs) < 0)
+		return -1;
+	reset_harts(e);
+	if (e->cfg.trace && !cs->trace) {
+		cs->trace = trace_open(e->cfg.trace);
+		if (!cs->trace) {
+			fprintf(stderr, "can't open trace file %s\n", e->cfg.trace);
+			return -1;
+		}
+	}
+	if (e->cfg.profile && !cs->prof) {
+		cs->prof = prof_open(cs);
+		if (!cs->prof) {
+			fprintf(stderr, "can't set up the profile\n");
+			return -1;
+		}
+	}
+	if (e->cfg.timing && !cs->timing) {
+		cs->timing = tm_open(cs, e->cfg.timing);
+		if (!cs->timing)
+			return -1;
+	}
+	if (e->cfg.jit && jit_init(cs) < 0) {
+		fprintf(stderr, "jit not available, using the interpreter\n");
+		e->cfg.jit = 0;
+	}
+	/* checked against the code just loaded */
+	if (e->cfg.aot && aot_load(cs, e->cfg.aot) < 0)
+		return -1;
+	return 0;
+}
+
+/* pk's stack with argv and the break after the image. a snapshot
+   only gets its files closed */
+static int start_syscalls(struct emu *e, int restored)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (!e->cfg.syscalls)
+		return 0;
+	if (!cs->sys) {
+		cs->sys = sys_open(guest_exit, e);
+		if (!cs->sys)
+			return -1;
+	}
+	if (restored) {
+		sys_reset(cs->sys, cs);
+		return 0;
+	}
+	return sys_start(cs->sys, cs, e->image_end, e->cfg.argc, e->cfg.argv);
+}
+
+static int load_image(struct emu *e)
+{
+	if (e->elf.fd >= 0)
+		return elf_map(&e->elf, &e->mem);
+	return bin_load(e->path, &e->mem, e->load_addr);
+}
+
+/* emu_load or emu_restore has been called since emu_create or
+   emu_unload */
+static int loaded(struct emu *e)
+{
+	return e->elf.fd >= 0 || e->path || e->snap_fd >= 0;
+}
+
+static struct mem_region *ram_region(struct emu *e)
+{
+	int i;
+
+	for (i = 0; i < e->mem.nregions; i++)
+		if (e->mem.regions[i].type == MEM_RAM)
+			return &e->mem.regions[i];
+	return NULL;
+}
+
+/* ram, rom, the icache and translations go, devices stay. the board's
+   own are placed again with the next ram */
+static void drop_memory(struct emu *e)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	jit_free(cs);
+	aot_free(cs);
+	prof_close(cs->prof);
+	cs->prof = NULL;
+	tm_close(cs->timing);
+	cs->timing = NULL;
+	mem_detach(cs);
+	mem_drop(&e->mem);
+	mem_remove(&e->mem, &e->clint);
+	mem_remove(&e->mem, e);
+}
+
+/* riscv-tests and spike style guests report through tohost */
+static void find_htif(struct emu *e)
+{
+	const struct sym *s;
+	struct symtab st;
+
+	if (elf_symbols(&e->elf, &st) < 0)
+		return;
+	s = sym_find(&st, "tohost");
+	if (s)
+		e->tohost = s->addr;
+	s = sym_find(&st, "fromhost");
+	if (s)
+		e->fromhost = s->addr;
+	free(st.syms);
+	free(st.strtab);
+}
+
+/* a failed emu_load leaves the emu unloaded. memory it has set up
+   goes, the next emu_load places it again */
+static int load_failed(struct emu *e, int placed)
+{
+	if (placed)
+		drop_memory(e);
+	emu_unload(e);
+	return -1;
+}
+
+/* an elf or a raw binary at load_addr, ram is placed around the image */
+int emu_load(struct emu *e, const char *path, uint32_t load_addr)
+{
+	struct cpu_state *cs = &e->harts[0];
+	struct mem_region *r;
+	uint32_t size, ram_base = 0;
+	uint64_t lo, hi;
+
+	if (loaded(e)) {
+		fprintf(stderr, "%s: an image is loaded already\n", path);
+		return -1;
+	}
+
+	/* ram starts at 0 unless the image lives above it */
+	if (is_elf(path)) {
+		if (elf_open(&e->elf, path) < 0)
+			return -1;
+		lo = e->elf.lo;
+		hi = e->elf.hi;
+		e->entry = e->elf.eh.e_entry;
+		find_htif(e);
+	}
+	else {
+		if (bin_size(path, &size) < 0) {
+			fprintf(stderr, "can't open %s\n", path);
+			return -1;
+		}
+		e->path = strdup(path);
+		if (!e->path)
+			return -1;
+		lo = load_addr;
+		hi = (uint64_t)load_addr + size;
+		e->load_addr = load_addr;
+		e->entry = load_addr;
+	}
+	if (hi > e->cfg.ram_size)
+		ram_base = lo & ~0xfff;
+	if (hi - ram_base > e->cfg.ram_size) {
+		fprintf(stderr, "%s needs %llu bytes of ram, see --ram-size\n", path,
+			(unsigned long long)(hi - ram_base));
+		return load_failed(e, 0);
+	}
+	e->image_end = hi;
+
+	/* left over from before emu_unload, emptied already */
+	r = ram_region(e);
+	if (r && r->base == ram_base) {
+		if (load_image(e) < 0 || mem_protect(&e->mem, cs) < 0)
+			return load_failed(e, 1);
+		cs->pc = e->entry;
+		reset_harts(e);
+		if (e->cfg.aot && aot_load(cs, e->cfg.aot) < 0)
+			return load_failed(e, 1);
+		if (start_syscalls(e, 0) < 0)
+			return load_failed(e, 1);
+		return 0;
+	}
+	if (r)
+		drop_memory(e);
+
+	if (!mem_add(&e->mem, "ram", ram_base, e->cfg.ram_size, MEM_RAM)) {
+		fprintf(stderr, "can't place %u bytes of ram at 0x%x\n", e->cfg.ram_size, ram_base);
+		return load_failed(e, 1);
+	}
+	add_board(e);
+	if (e->cfg.guard && mem_guard(&e->mem) < 0) {
+		fprintf(stderr, "guard mode not available, using bounds checks\n");
+		e->cfg.guard = 0;
+	}
+	if (load_image(e) < 0)
+		return load_failed(e, 1);
+	cs->pc = e->entry;
+	if (start(e) < 0 || start_syscalls(e, 0) < 0)
+		return load_failed(e, 1);
+	return 0;
+}
+
+static int run_hart(struct cpu_state *cs, int jit, uint64_t budget)
+{
+	jmp_buf fault;
+	int ret;
+
+	__atomic_store_n(&cs->icount_end, budget > UINT64_MAX - cs->icount ?
+		UINT64_MAX : cs->icount + budget, __ATOMIC_RELAXED);
+	mem_bind(cs);
+
+	/* access faults come back here, 2 when the guest's handler takes
+	   them and the loops go on from there */
+	cs->fault = &fault;
+	if (setjmp(fault) == 1) {
+		cs->fault = NULL;
+		return EMU_FAULT;
+	}
+	/* the loops stop early where an interrupt may be due, take it and
+	   carry on */
+	for (;;) {
+		cpu_interrupt(cs);
+		cpu_irq_update(cs);
+		if (cs->aot)
+			ret = aot_loop(cs);
+		else if (jit)
+			ret = jit_loop(cs);
+		else
+			ret = decode_loop(cs);
+		if (ret < 0 || cs->icount >= __atomic_load_n(&cs->icount_end, __ATOMIC_RELAXED))
+			break;
+	}
+	cs->fault = NULL;
+	switch (ret) {
+	case -1:
+		return EMU_BAD_PC;
+	case -2:
+		return EMU_INVALID;
+	case -3:
+		return EMU_ECALL;
+	case -4:
+		return EMU_EBREAK;
+	}
+	return EMU_BUDGET;
+}
+
+/* instructions a hart runs before it looks whether another one stopped */
+#define HART_SLICE 1000000
+/* and before hart 0 looks at tohost, a test spinning on it after it is
+   done wastes no more */
+#define TOHOST_SLICE 10000
+
+struct hart_run {
+	struct emu *e;
+	struct cpu_state *cs;
+	uint64_t budget;
+	int ret;
+	pthread_t thread;
+};
+
+/* the htif convention of spike and riscv-tests: an odd value ends the
+   guest with value >> 1, anything else is a request for the host.
+   none are served, they are acknowledged through fromhost so the guest
+   doesn't wait forever */
+static void poll_tohost(struct emu *e)
+{
+	uint32_t v;
+
+	if (emu_read_mem(e, e->tohost, &v, 4) < 0 || !v)
+		return;
+	v = le32(v);
+	if (v & 1) {
+		finish(e, v >> 1);
+		return;
+	}
+	v = 0;
+	emu_write_mem(e, e->tohost, &v, 4);
+	v = le32(1);
+	if (e->fromhost)
+		emu_write_mem(e, e->fromhost, &v, 4);
+}
+
+/* the harts never wait for each other here, they only meet in
+   io_lock and the host atomics of the A extension */
+static int run_slices(struct emu *e, struct cpu_state *cs, uint64_t budget)
+{
+	uint64_t end = cs->icount + budget, slice = HART_SLICE;
+	int ret = EMU_BUDGET, poll = e->tohost && cs == &e->harts[0];
+
+	if (budget > UINT64_MAX - cs->icount)
+		end = UINT64_MAX;
+	if (poll)
+		slice = TOHOST_SLICE;
+	while (cs->icount < end && !__atomic_load_n(&e->stop, __ATOMIC_RELAXED)) {
+		ret = run_hart(cs, e->cfg.jit, end - cs->icount < slice ? end - cs->icount : slice);
+		if (ret != EMU_BUDGET) {
+			__atomic_store_n(&e->stop, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (poll)
+			poll_tohost(e);
+	}
+	return ret;
+}
+
+static void *hart_thread(void *arg)
+{
+	struct hart_run *h = (struct hart_run*)arg;
+
+	h->ret = run_slices(h->e, h->cs, h->budget);
+	return NULL;
+}
+
+/*
+	like the cli's --max-insns, the run ends at the first jump or
+	branch after budget instructions. emu_icount tells how far it got,
+	after a fault, an invalid instruction, ecall or ebreak the pc is
+	the instruction that caused it. those only end the run when the
+	guest has no trap handler.
+
+	with more than one hart each one runs on its own thread with the
+	whole budget, hart 0 on the caller's. once a hart stops for any
+	other reason the rest stop within HART_SLICE instructions and the
+	first reason found, counting from hart 0, is returned. a guest
+	exit wins over all of them.
+*/
+int emu_run(struct emu *e, uint64_t budget)
+{
+	struct hart_run h[MAX_HARTS];
+	int i, n, ret;
+
+	if (!e->harts[0].icache)
+		return EMU_ERROR;
+	e->stop = 0;
+	e->exited = 0;
+	if (e->nharts == 1 && !e->tohost) {
+		ret = run_hart(&e->harts[0], e->cfg.jit, budget);
+		return e->exited ? EMU_EXIT : ret;
+	}
+
+	for (n = 1; n < e->nharts; n++) {
+		h[n].e = e;
+		h[n].cs = &e->harts[n];
+		h[n].budget = budget;
+		if (pthread_create(&h[n].thread, NULL, hart_thread, &h[n]))
+			break;
+	}
+	if (n < e->nharts) {
+		fprintf(stderr, "can't start hart %d\n", n);
+		e->stop = 1;
+		ret = EMU_ERROR;
+	}
+	else {
+		ret = run_slices(e, &e->harts[0], budget);
+	}
+	for (i = 1; i < n; i++) {
+		pthread_join(h[i].thread, NULL);
+		if (ret == EMU_BUDGET)
+			ret = h[i].ret;
+	}
+	return e->exited ? EMU_EXIT : ret;
+}
+
+/* 0 to 65535 from the exit register, the tohost value >> 1 */
+int emu_exit_code(struct emu *e)
+{
+	return e->exit_code;
+}
+
+/* runs a block at a time, so pc is only caught at the start of a
+   basic block: a function entry, a loop head or a branch target */
+int emu_run_to(struct emu *e, uint32_t pc, uint64_t budget)
+{
+	uint64_t limit = e->harts[0].icount + budget;
+	int ret;
+
+	if (budget > UINT64_MAX - e->harts[0].icount)
+		limit = UINT64_MAX;
+	while (e->harts[0].pc != pc) {
+		if (e->harts[0].icount >= limit)
+			return EMU_BUDGET;
+		ret = emu_run(e, 1);
+		if (ret != EMU_BUDGET)
+			return ret;
+	}
+	return EMU_AT_PC;
+}
+
+static void set_state(struct emu *e, struct snap_header *h)
+{
+	memcpy(e->harts[0].regs, h->regs, sizeof(e->harts[0].regs));
+	e->harts[0].regs[0] = 0;
+	e->harts[0].pc = h->pc;
+	e->harts[0].icount = h->icount;
+	e->harts[0].csr = h->csr;
+	e->harts[0].lr_valid = 0;
+	e->harts[0].idiom_pc = 0;
+	e->harts[0].idiom_until = 0;
+	clint_set_mtime(&e->clint, h->mtime);
+}
+
+/*
+	back to the last emu_checkpoint, the snapshot emu_restore started
+	from or else the state right after emu_load. from a snapshot only
+	the pages the guest dirtied since are read back.
+*/
+void emu_reset(struct emu *e)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (!cs->icache)
+		return;
+	cs->cover_prev = 0;
+	if (e->snap_fd >= 0) {
+		/* only the pages the guest stored to, the icache and the
+		   translations of everything else stay valid */
+		if (snap_restore_dirty(e->snap_fd, &e->snap, cs) < 0) {
+			mem_clear(&e->mem, cs);
+			snap_map(e->snap_fd, &e->snap, &e->mem);
+			mem_protect(&e->mem, cs);
+			if (cs->jit)
+				jit_flush(cs);
+		}
+		if (cs->aot)
+			cs->jit_flush = 1;
+		set_state(e, &e->snap);
+		start_syscalls(e, 1);
+		return;
+	}
+	mem_clear(&e->mem, cs);
+	load_image(e);
+	mem_protect(&e->mem, cs);
+	memset(cs->regs, 0, sizeof(cs->regs));
+	cs->pc = e->entry;
+	cs->icount = 0;
+	cs->lr_valid = 0;
+	cs->idiom_pc = 0;
+	cs->idiom_until = 0;
+	csr_reset(cs);
+	e->clint.offset = 0;
+	if (cs->jit)
+		jit_flush(cs);
+	/* blocks dropped after stores match again */
+	if (cs->aot)
+		cs->jit_flush = 1;
+	start_syscalls(e, 0);
+	reset_harts(e);
+}
+
+/* snapshots and deltas hold the state of one hart */
+static int one_hart(struct emu *e)
+{
+	if (e->nharts == 1)
+		return 1;
+	fprintf(stderr, "snapshots need a single hart\n");
+	return 0;
+}
+
+/*
+	forget the image or snapshot. memory is zero again, and the next
+	emu_load keeps ram, the icache, translation buffers and devices
+	when its image lands in the same ram, so one emu can run any
+	number of small guests one after the other.
+*/
+void emu_unload(struct emu *e)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (e->snap_fd >= 0 || (cs->icache && mem_zero(&e->mem, cs) < 0)) {
+		/* snapshots may bring their own regions */
+		drop_memory(e);
+	}
+	else if (cs->jit) {
+		jit_flush(cs);
+	}
+	/* the next image needs its own */
+	aot_free(cs);
+	sys_close(cs->sys);
+	cs->sys = NULL;
+	elf_close(&e->elf);
+	free(e->path);
+	e->path = NULL;
+	if (e->snap_fd >= 0)
+		close(e->snap_fd);
+	e->snap_fd = -1;
+	memset(cs->regs, 0, sizeof(cs->regs));
+	cs->pc = 0;
+	cs->icount = 0;
+	cs->lr_valid = 0;
+	cs->idiom_pc = 0;
+	cs->idiom_until = 0;
+	csr_reset(cs);
+	e->clint.offset = 0;
+	e->entry = 0;
+	e->tohost = 0;
+	e->fromhost = 0;
+	reset_harts(e);
+}
+
+/* the current state becomes the one emu_reset returns to */
+int emu_checkpoint(struct emu *e)
+{
+	struct snap_header h;
+	int fd;
+
+	if (!e->harts[0].icache || !one_hart(e))
+		return -1;
+	fd = memfd_create("rv32-checkpoint", 0);
+	if (fd < 0)
+		return -1;
+	if (snap_write(fd, &e->harts[0], &e->mem, &h) < 0) {
+		close(fd);
+		return -1;
+	}
+	mem_dirty_checkpoint(&e->harts[0]);
+	if (e->snap_fd >= 0)
+		close(e->snap_fd);
+	e->snap_fd = fd;
+	e->snap = h;
+	return 0;
+}
+
+int emu_snapshot(struct emu *e, const char *path)
+{
+	struct snap_header h;
+	int fd, ret;
+
+	if (!e->harts[0].icache || !one_hart(e))
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "can't create %s\n", path);
+		return -1;
+	}
+	ret = snap_write(fd, &e->harts[0], &e->mem, &h);
+	if (close(fd) < 0 || ret < 0) {
+		fprintf(stderr, "can't write snapshot %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* the pages dirtied since the last snapshot, checkpoint or delta */
+int emu_delta(struct emu *e, const char *path)
+{
+	int fd, ret;
+
+	if (!e->harts[0].icache || !one_hart(e))
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "can't create %s\n", path);
+		return -1;
+	}
+	ret = delta_write(fd, &e->harts[0]);
+	if (close(fd) < 0 || ret < 0) {
+		fprintf(stderr, "can't write delta %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* on top of the snapshot emu_restore loaded and the deltas before */
+int emu_apply_delta(struct emu *e, const char *path)
+{
+	int fd, ret;
+
+	if (!e->harts[0].icache || !one_hart(e))
+		return -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "can't open %s\n", path);
+		return -1;
+	}
+	ret = delta_apply(fd, &e->harts[0]);
+	close(fd);
+	if (ret < 0)
+		fprintf(stderr, "%s is not a delta for this snapshot\n", path);
+	return ret;
+}
+
+/* instead of emu_load, memory comes from the snapshot and ram_size
+   is ignored. emu_reset comes back here */
+int emu_restore(struct emu *e, const char *path)
+{
+	struct snap_region *s;
+	int i;
+
+	if (loaded(e)) {
+		fprintf(stderr, "%s: an image is loaded already\n", path);
+		return -1;
+	}
+	if (!one_hart(e))
+		return -1;
+	if (ram_region(e))
+		drop_memory(e);
+	e->snap_fd = open(path, O_RDONLY);
+	if (e->snap_fd < 0 || snap_read(e->snap_fd, &e->snap) < 0) {
+		fprintf(stderr, "%s is not a snapshot\n", path);
+		return -1;
+	}
+	/* rom comes with snap_map */
+	for (i = 0; i < e->snap.nregions; i++) {
+		s = &e->snap.regions[i];
+		if (s->type == MEM_RAM && !mem_add(&e->mem, "ram", s->base, s->size, MEM_RAM)) {
+			fprintf(stderr, "can't place %u bytes of memory at 0x%x\n", s->size, s->base);
+			return -1;
+		}
+	}
+	add_board(e);
+	if (e->cfg.guard && mem_guard(&e->mem) < 0) {
+		fprintf(stderr, "guard mode not available, using bounds checks\n");
+		e->cfg.guard = 0;
+	}
+	if (snap_map(e->snap_fd, &e->snap, &e->mem) < 0) {
+		fprintf(stderr, "can't map snapshot %s\n", path);
+		return -1;
+	}
+	set_state(e, &e->snap);
+	if (start(e) < 0)
+		return -1;
+	return start_syscalls(e, 1);
+}
+
+/* the report goes to path, the folded stacks to path.folded.
+   symbols come from the elf image when there is one */
+int emu_profile(struct emu *e, const char *path)
+{
+	struct cpu_state *cs = &e->harts[0];
+	struct symtab st;
+	char folded[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	if (!cs->prof)
+		return -1;
+	memset(&st, 0, sizeof(st));
+	if (e->elf.fd >= 0)
+		elf_symbols(&e->elf, &st);
+	snprintf(folded, sizeof(folded), "%s.folded", path);
+
+	ret = -1;
+	f = fopen(path, "w");
+	if (f) {
+		ret = prof_report(cs->prof, cs, &st, f);
+		if (fclose(f) < 0)
+			ret = -1;
+	}
+	if (ret == 0) {
+		f = fopen(folded, "w");
+		ret = f ? prof_folded(cs->prof, cs, &st, f) : -1;
+		if (f && fclose(f) < 0)
+			ret = -1;
+	}
+	if (ret < 0)
+		fprintf(stderr, "can't write profile %s\n", path);
+	free(st.syms);
+	free(st.strtab);
+	return ret;
+}
+
+/* the timing report to path, functions named from the elf symbols */
+int emu_timing(struct emu *e, const char *path)
+{
+	struct cpu_state *cs = &e->harts[0];
+	struct symtab st;
+	FILE *f;
+	int ret = -1;
+
+	if (!cs->timing)
+		return -1;
+	memset(&st, 0, sizeof(st));
+	if (e->elf.fd >= 0)
+		elf_symbols(&e->elf, &st);
+	f = fopen(path, "w");
+	if (f) {
+		ret = tm_report(cs->timing, cs, &st, f);
+		if (fclose(f) < 0)
+			ret = -1;
+	}
+	if (ret < 0)
+		fprintf(stderr, "can't write timing report %s\n", path);
+	free(st.syms);
+	free(st.strtab);
+	return ret;
+}
+
+int emu_timing_stats(struct emu *e, struct emu_timing_stats *s)
+{
+	struct cpu_state *cs = &e->harts[0];
+	struct timing *t = cs->timing;
+
+	if (!t)
+		return -1;
+	s->insns = cs->icount - t->start;
+	s->cycles = tm_cycles(t, s->insns);
+	s->fetches = t->fetches;
+	s->imisses = t->i.misses;
+	s->daccesses = t->d.accesses;
+	s->dmisses = t->d.misses;
+	s->branches = t->branches;
+	s->mispredicts = t->mispredicts;
+	return 0;
+}
+
+int emu_bbv(struct emu *e, double *v, int dims)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (!cs->prof)
+		return -1;
+	prof_bbv(cs->prof, cs, v, dims);
+	return 0;
+}
+
+/* translated blocks count their edges only when they were made with
+   a map */
+void emu_cover(struct emu *e, uint8_t *map)
+{
+	struct cpu_state *cs = &e->harts[0];
+
+	if (cs->jit && !cs->cover != !map)
+		jit_flush(cs);
+	cs->cover = map;
+	cs->cover_prev = 0;
+}
+
+/* the hart emu_get_reg and friends work on, 0 to start with */
+int emu_set_hart(struct emu *e, int hart)
+{
+	if (hart < 0 || hart >= e->nharts)
+		return -1;
+	e->cur = hart;
+	return 0;
+}
+
+uint32_t emu_get_reg(struct emu *e, int r)
+{
+	return e->harts[e->cur].regs[r & 31];
+}
+
+void emu_set_reg(struct emu *e, int r, uint32_t v)
+{
+	if (r & 31)
+		e->harts[e->cur].regs[r & 31] = v;
+}
+
+uint32_t emu_get_pc(struct emu *e)
+{
+	return e->harts[e->cur].pc;
+}
+
+void emu_set_pc(struct emu *e, uint32_t pc)
+{
+	e->harts[e->cur].pc = pc;
+}
+
+/* all harts together */
+uint64_t emu_icount(struct emu *e)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < e->nharts; i++)
+		n += e->harts[i].icount;
+	return n;
+}
+
+/* ram and rom only, the range has to lie within one region */
+int emu_read_mem(struct emu *e, uint32_t addr, void *buf, uint32_t len)
+{
+	struct mem_region *r = mem_find(&e->mem, addr, len);
+
+	if (!len)
+		return 0;
+	if (!r || r->type == MEM_IO)
+		return -1;
+	memcpy(buf, r->host + (addr - r->base), len);
+	return 0;
+}
+
+/* rom is read-only from here too */
+int emu_write_mem(struct emu *e, uint32_t addr, const void *buf, uint32_t len)
+{
+	struct mem_region *r = mem_find(&e->mem, addr, len);
+
+	if (!len)
+		return 0;
+	if (!r || r->type != MEM_RAM ||
+	    (e->harts[0].rom && mem_in_rom(&e->harts[0], addr - r->base, len)))
+		return -1;
+	memcpy(r->host + (addr - r->base), buf, len);
+	if (r->type == MEM_RAM && e->harts[0].icache) {
+		mem_stored(&e->harts[0], addr - r->base, len);
+	}
+	return 0;
+}
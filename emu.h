@@ -0,0 +1,132 @@
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+
+/*
+	embedding interface, libriscv-emu.a
+
+	one struct emu is one guest: ram, devices and a hart. create it,
+	add devices, load an image and then call emu_run as often as
+	needed, every call runs up to a budget of instructions and returns
+	why it stopped. emu_reset puts the guest back to where emu_load
+	left it, or to the last emu_checkpoint, so a process can run many
+	short guests without reloading or rebooting anything. guests are
+	independent, but an emu must only be run by one thread at a time.
+
+	a guest can have several harts sharing its memory, emu_run runs
+	them on threads of their own. each one starts at the entry point
+	with its mhartid in a0.
+
+	every guest has a clint at 0x02000000 for timer and software
+	interrupts, see clint.h. its mtime counts instructions. both it
+	and the exit register at 0xc0001000 are left out where ram covers
+	them.
+
+	exceptions go to the guest's handler at mtvec. a guest without one
+	stops at its first exception with the reason as the emu_run result.
+	with cfg.syscalls ecall is a call to the host instead, the way
+	newlib programs expect under riscv-pk, see syscalls.h.
+	guests end themselves with the exit register, sifive's test
+	finisher: 0x5555 passes, 0x3333 | code << 16 fails with code. elf
+	images with a tohost symbol can write (code << 1) | 1 there instead,
+	like riscv-tests do under spike.
+
+	the library's own messages, why a guest stopped or couldn't be
+	loaded, go to stderr. stdout is left to the front end.
+*/
+
+struct emu;
+
+struct emu_config {
+	uint32_t ram_size;	/* bytes, a multiple of 4K, 0 for the default */
+	int jit;		/* translate basic blocks to host code */
+	int guard;		/* guard page memory, see --guard-mem */
+	const char *trace;	/* record executed instructions, NULL for none */
+	int harts;		/* 0 for one, snapshots need a single hart */
+	int profile;		/* count blocks, branches, calls and accesses */
+	uint32_t tick;		/* instructions per mtime tick, 0 for 1 */
+	const char *aot;	/* module built from --translate output, see aot.h */
+	const char *timing;	/* cache and predictor model spec, see timing.h.
+				   "" for the defaults, NULL for none */
+	int syscalls;		/* ecall is a newlib syscall, see syscalls.h */
+	int argc;		/* the guest's argv with syscalls */
+	char **argv;
+};
+
+/* emu_run results */
+enum {
+	EMU_BUDGET = 0,		/* the instruction budget is used up */
+	EMU_FAULT,		/* load or store outside of ram and devices, or store to rom */
+	EMU_BAD_PC,		/* jump outside of ram or to an odd address */
+	EMU_INVALID,		/* invalid instruction */
+	EMU_ERROR,		/* nothing loaded */
+	EMU_AT_PC,		/* emu_run_to reached its pc */
+	EMU_ECALL,		/* ecall without a trap handler */
+	EMU_EBREAK,		/* ebreak without a trap handler */
+	EMU_EXIT,		/* the guest exited, see emu_exit_code */
+};
+
+/* device callbacks get the offset into the device and 1, 2 or 4 bytes,
+   sub-word writes have the unused bits cleared */
+typedef uint32_t (*emu_read_fn)(void *dev, uint32_t off, int size);
+typedef void (*emu_write_fn)(void *dev, uint32_t off, uint32_t data, int size);
+
+struct emu *emu_create(const struct emu_config *cfg);
+void emu_destroy(struct emu *e);
+int emu_add_device(struct emu *e, const char *name, uint32_t base, uint32_t size,
+	emu_read_fn read, emu_write_fn write, void *dev);
+int emu_load(struct emu *e, const char *path, uint32_t load_addr);
+int emu_run(struct emu *e, uint64_t budget);
+int emu_run_to(struct emu *e, uint32_t pc, uint64_t budget);
+int emu_exit_code(struct emu *e);
+void emu_reset(struct emu *e);
+void emu_unload(struct emu *e);
+
+/* snapshots and deltas, see snapshot.h. emu_restore takes the place of
+   emu_load */
+int emu_checkpoint(struct emu *e);
+int emu_snapshot(struct emu *e, const char *path);
+int emu_restore(struct emu *e, const char *path);
+int emu_delta(struct emu *e, const char *path);
+int emu_apply_delta(struct emu *e, const char *path);
+
+/* afl style edge coverage of hart 0 into map, EMU_COVER_SIZE bytes
+   the caller clears between runs. NULL turns it off. not recorded
+   with a trace or a profile */
+#define EMU_COVER_SIZE 65536
+void emu_cover(struct emu *e, uint8_t *map);
+
+int emu_set_hart(struct emu *e, int hart);
+/* see profile.h, only with cfg.profile */
+int emu_profile(struct emu *e, const char *path);
+/* see timing.h, only with cfg.timing */
+int emu_timing(struct emu *e, const char *path);
+
+/* the model's counts since it started, only with cfg.timing */
+struct emu_timing_stats {
+	uint64_t insns;
+	uint64_t cycles;	/* estimated */
+	uint64_t fetches;
+	uint64_t imisses;
+	uint64_t daccesses;
+	uint64_t dmisses;
+	uint64_t branches;
+	uint64_t mispredicts;
+};
+int emu_timing_stats(struct emu *e, struct emu_timing_stats *s);
+
+/* the basic block vector of hart 0 since the last call, projected
+   down to dims, see simpoint.h. only with cfg.profile, the blocks of
+   a later emu_profile start there too */
+int emu_bbv(struct emu *e, double *v, int dims);
+
+uint32_t emu_get_reg(struct emu *e, int r);
+void emu_set_reg(struct emu *e, int r, uint32_t v);
+uint32_t emu_get_pc(struct emu *e);
+void emu_set_pc(struct emu *e, uint32_t pc);
+uint64_t emu_icount(struct emu *e);
+int emu_read_mem(struct emu *e, uint32_t addr, void *buf, uint32_t len);
+int emu_write_mem(struct emu *e, uint32_t addr, const void *buf, uint32_t len);
+
+#endif
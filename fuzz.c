@@ -0,0 +1,323 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "uart.h"
+#include "emu.h"
+#include "fuzz.h"
+
+/* afl's control and status pipes */
+#define FORKSRV_FD 198
+
+/* afl-fuzz looks for this to run the target in persistent mode */
+static const char afl_persistent[] __attribute__((used)) = "##SIG_AFL_PERSISTENT##";
+
+static const char *results[] = {
+	[EMU_BUDGET] = "budget",
+	[EMU_FAULT] = "fault",
+	[EMU_BAD_PC] = "bad-pc",
+	[EMU_INVALID] = "invalid",
+	[EMU_ERROR] = "error",
+	[EMU_AT_PC] = "at-pc",
+	[EMU_ECALL] = "ecall",
+	[EMU_EBREAK] = "ebreak",
+	[EMU_EXIT] = "exit",
+};
+
+/* a console with nobody reading it, always ready to send */
+static uint32_t console_read(void *dev, uint32_t off, int size)
+{
+	return off == UART_LSR ? LSR_THRE | LSR_TEMT : 0;
+}
+
+static void console_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+}
+
+/* <addr>:<size> */
+int fuzz_parse_buf(struct fuzz_config *fc, const char *s)
+{
+	char *end;
+
+	fc->buf = strtoul(s, &end, 0);
+	if (*end != ':')
+		return -1;
+	fc->size = strtoul(end + 1, &end, 0);
+	return *end || !fc->size ? -1 : 0;
+}
+
+/* x<n>, a<n> or an address */
+int fuzz_parse_len(struct fuzz_config *fc, const char *s)
+{
+	char *end;
+	unsigned long v;
+
+	if ((s[0] == 'x' || s[0] == 'a') && s[1] >= '0' && s[1] <= '9') {
+		v = strtoul(s + 1, &end, 10);
+		if (s[0] == 'a')
+			v = v < 8 ? v + 10 : 32;
+		if (*end || !v || v > 31)
+			return -1;
+		fc->len_reg = v;
+		return 0;
+	}
+	fc->len_addr = strtoul(s, &end, 0);
+	return *end || !fc->len_addr ? -1 : 0;
+}
+
+/* pc=<addr>, like --snapshot-at */
+int fuzz_parse_start(struct fuzz_config *fc, const char *s)
+{
+	char *end;
+
+	if (strncmp(s, "pc=", 3))
+		return -1;
+	fc->start = strtoul(s + 3, &end, 0);
+	fc->has_start = 1;
+	return *end ? -1 : 0;
+}
+
+struct emu *fuzz_create(const struct emu_config *cfg, const struct fuzz_config *fc,
+	const char *image, const char *restore, uint32_t load_addr)
+{
+	struct emu *e;
+	int ret;
+
+	e = emu_create(cfg);
+	if (!e)
+		return NULL;
+	if (emu_add_device(e, "uart", UART_BASE, UART_SIZE, console_read, console_write, NULL) < 0 ||
+	    (restore ? emu_restore(e, restore) : emu_load(e, image, load_addr)) < 0)
+		goto fail;
+	if (fc->has_start) {
+		ret = emu_run_to(e, fc->start, UINT64_MAX);
+		if (ret != EMU_AT_PC) {
+			fprintf(stderr, "stopped before pc 0x%x: %s\n", fc->start, results[ret]);
+			goto fail;
+		}
+	}
+	if (emu_checkpoint(e) < 0) {
+		fprintf(stderr, "can't checkpoint the guest\n");
+		goto fail;
+	}
+	return e;
+
+fail:
+	emu_destroy(e);
+	return NULL;
+}
+
+int fuzz_one(struct emu *e, const struct fuzz_config *fc, const uint8_t *data, size_t len)
+{
+	uint32_t v;
+
+	emu_reset(e);
+	if (len > fc->size)
+		len = fc->size;
+	if (emu_write_mem(e, fc->buf, data, len) < 0)
+		return EMU_ERROR;
+	if (fc->len_reg)
+		emu_set_reg(e, fc->len_reg, len);
+	else if (fc->len_addr) {
+		v = le32(len);
+		if (emu_write_mem(e, fc->len_addr, &v, 4) < 0)
+			return EMU_ERROR;
+	}
+	return emu_run(e, fc->budget);
+}
+
+int fuzz_crashed(struct emu *e, int ret)
+{
+	if (ret == EMU_EXIT)
+		return emu_exit_code(e) != 0;
+	return ret != EMU_BUDGET;
+}
+
+/* the whole file, or stdin from the start, cut at size */
+static ssize_t read_input(const char *path, uint8_t *buf, uint32_t size)
+{
+	ssize_t n, len = 0;
+	int fd = 0;
+
+	if (path)
+		fd = open(path, O_RDONLY);
+	else
+		lseek(0, 0, SEEK_SET);
+	if (fd < 0)
+		return -1;
+	while (len < size && (n = read(fd, buf + len, size - len)) > 0)
+		len += n;
+	if (path)
+		close(fd);
+	return len;
+}
+
+/* one forked child, input after input until afl kills it or
+   FUZZ_PERSIST have gone through */
+static void afl_child(struct emu *e, const struct fuzz_config *fc, const char *path,
+	uint8_t *buf)
+{
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < FUZZ_PERSIST; i++) {
+		if (i)
+			raise(SIGSTOP);
+		len = read_input(path, buf, fc->size);
+		if (len < 0)
+			_exit(1);
+		if (fuzz_crashed(e, fuzz_one(e, fc, buf, len)))
+			abort();
+	}
+	_exit(0);
+}
+
+/* afl's forkserver, -1 when afl-fuzz didn't start one */
+static int afl_server(struct emu *e, const struct fuzz_config *fc, const char *path,
+	uint8_t *buf)
+{
+	uint32_t msg = 0;
+	int status, stopped = 0;
+	pid_t child = -1;
+
+	if (write(FORKSRV_FD + 1, &msg, 4) != 4)
+		return -1;
+	for (;;) {
+		if (read(FORKSRV_FD, &msg, 4) != 4)
+			return 0;
+		/* afl killed a stopped child on a timeout */
+		if (stopped && msg) {
+			stopped = 0;
+			waitpid(child, &status, 0);
+		}
+		if (!stopped) {
+			child = fork();
+			if (child < 0)
+				return 1;
+			if (!child) {
+				close(FORKSRV_FD);
+				close(FORKSRV_FD + 1);
+				afl_child(e, fc, path, buf);
+			}
+		}
+		else {
+			kill(child, SIGCONT);
+			stopped = 0;
+		}
+		if (write(FORKSRV_FD + 1, &child, 4) != 4)
+			return 1;
+		if (waitpid(child, &status, WUNTRACED) < 0)
+			return 1;
+		if (WIFSTOPPED(status))
+			stopped = 1;
+		if (write(FORKSRV_FD + 1, &status, 4) != 4)
+			return 1;
+	}
+}
+
+static int run_afl(struct emu *e, const struct fuzz_config *fc, const char *shm_id,
+	const char *path)
+{
+	uint8_t *map, *buf;
+	ssize_t len;
+	int ret;
+
+	map = (uint8_t*)shmat(atoi(shm_id), NULL, 0);
+	buf = (uint8_t*)malloc(fc->size);
+	if (map == (uint8_t*)-1 || !buf) {
+		fprintf(stderr, "can't attach afl's map\n");
+		return 1;
+	}
+	emu_cover(e, map);
+	fflush(stdout);
+	ret = afl_server(e, fc, path, buf);
+	if (ret >= 0)
+		return ret;
+
+	/* run once, afl-showmap and friends without a forkserver */
+	len = read_input(path, buf, fc->size);
+	if (len < 0) {
+		fprintf(stderr, "can't read %s\n", path);
+		return 1;
+	}
+	if (fuzz_crashed(e, fuzz_one(e, fc, buf, len)))
+		abort();
+	return 0;
+}
+
+static int edges(const uint8_t *map)
+{
+	int i, n = 0;
+
+	for (i = 0; i < EMU_COVER_SIZE; i++)
+		n += map[i] != 0;
+	return n;
+}
+
+/* 0 when no input crashed the guest */
+int run_fuzz(struct emu *e, const struct fuzz_config *fc, int n, char **inputs)
+{
+	const char *shm_id = getenv("__AFL_SHM_ID");
+	uint8_t *map, *all, *buf;
+	struct timespec t0, t1;
+	char result[32];
+	ssize_t len;
+	int i, k, ret, crashes = 0;
+	uint64_t start;
+	double secs;
+
+	if (shm_id)
+		return run_afl(e, fc, shm_id, n ? inputs[0] : NULL);
+
+	map = (uint8_t*)malloc(EMU_COVER_SIZE);
+	all = (uint8_t*)calloc(1, EMU_COVER_SIZE);
+	buf = (uint8_t*)malloc(fc->size);
+	if (!map || !all || !buf) {
+		free(map);
+		free(all);
+		free(buf);
+		return 1;
+	}
+	emu_cover(e, map);
+	/* every input starts at the checkpoint's count */
+	emu_reset(e);
+	start = emu_icount(e);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		len = read_input(inputs[i], buf, fc->size);
+		if (len < 0) {
+			fprintf(stderr, "can't read %s\n", inputs[i]);
+			crashes++;
+			continue;
+		}
+		memset(map, 0, EMU_COVER_SIZE);
+		ret = fuzz_one(e, fc, buf, len);
+		crashes += fuzz_crashed(e, ret);
+		for (k = 0; k < EMU_COVER_SIZE; k++)
+			all[k] |= map[k];
+		if (ret == EMU_EXIT)
+			snprintf(result, sizeof(result), "exit=%d", emu_exit_code(e));
+		else
+			snprintf(result, sizeof(result), "%s", results[ret]);
+		printf("%s %llu %d %s\n", result, (unsigned long long)(emu_icount(e) - start),
+			edges(map), inputs[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "%d inputs, %d crashed, %d edges, %.0f execs/s\n", n, crashes,
+		edges(all), secs > 0 ? n / secs : 0.0);
+	emu_cover(e, NULL);
+	free(map);
+	free(all);
+	free(buf);
+	return crashes != 0;
+}
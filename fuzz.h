@@ -0,0 +1,60 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emu.h"
+
+/*
+	--fuzz-buf: coverage guided fuzzing of a guest
+
+	the guest runs once up to --fuzz-start, or starts where it was
+	loaded or restored, and that state is checkpointed. every input
+	starts from there: emu_reset reads back the pages the last input
+	dirtied, the input is copied to the guest buffer, its length goes
+	to the register or word of --fuzz-len and the guest runs up to the
+	budget. edges are counted the way afl does, see emu_cover.
+
+	an input crashes the guest when it faults, jumps to a bad pc, runs
+	an invalid instruction, an ecall or ebreak without a handler, or
+	the guest exits with a nonzero code. using up the budget is a
+	normal end, afl's own timeout catches hangs.
+
+	under afl-fuzz, with __AFL_SHM_ID set, edges go to afl's map and
+	the forkserver runs in persistent mode: a forked child takes input
+	after input from the @@ file or stdin and stops itself in between,
+	it aborts on a crash. otherwise every input file is run once and
+	gets a line on stdout:
+
+		<result> <instructions> <edges> <input>
+
+	libfuzzer.c is the same for libFuzzer.
+*/
+
+#define FUZZ_BUDGET 10000000	/* instructions per input unless -n says */
+#define FUZZ_PERSIST 10000	/* inputs an afl child runs before a new fork */
+
+struct fuzz_config {
+	uint32_t buf;		/* guest address the input is copied to */
+	uint32_t size;		/* bytes there, longer inputs are cut */
+	int len_reg;		/* register taking the length, 0 for none */
+	uint32_t len_addr;	/* else a 32-bit word taking it, 0 for none */
+	uint32_t start;		/* pc to run to before the checkpoint */
+	int has_start;
+	uint64_t budget;
+};
+
+int fuzz_parse_buf(struct fuzz_config *fc, const char *s);
+int fuzz_parse_len(struct fuzz_config *fc, const char *s);
+int fuzz_parse_start(struct fuzz_config *fc, const char *s);
+/* image or restore, a console that drops its output, checkpointed at
+   the start */
+struct emu *fuzz_create(const struct emu_config *cfg, const struct fuzz_config *fc,
+	const char *image, const char *restore, uint32_t load_addr);
+/* the emu_run result of one input */
+int fuzz_one(struct emu *e, const struct fuzz_config *fc, const uint8_t *data, size_t len);
+int fuzz_crashed(struct emu *e, int ret);
+int run_fuzz(struct emu *e, const struct fuzz_config *fc, int n, char **inputs);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+	generates decode_tab.h from insns.def
+
+	dec32_idx[opcode[6:2] << 3 | funct3] is the first candidate in
+	dec32_list, candidates are checked with match/mask in table order
+	and each run ends with an entry that always matches (OP_INVALID).
+
+	dec16_tab[halfword] is 1 + index into the CINSN table, 0 for
+	illegal encodings and 32-bit opcodes.
+*/
+
+struct desc {
+	const char *name;
+	const char *fmt;
+	const char *op;
+	uint32_t match;
+	uint32_t mask;
+};
+
+struct desc insns[] = {
+#define INSN(name, mnemonic, match, mask, fmt) { #name, #fmt, #name, match, mask },
+#include "insns.def"
+};
+
+struct desc cinsns[] = {
+#define CINSN(name, match, mask, fmt, op) { #name, #fmt, #op, match, mask },
+#include "insns.def"
+};
+
+#define N_INSNS (sizeof(insns) / sizeof(insns[0]))
+#define N_CINSNS (sizeof(cinsns) / sizeof(cinsns[0]))
+
+int main(void)
+{
+	uint32_t idx[256];
+	uint32_t i, k, t, m, n = 0;
+
+	printf("/* generated by gen_decode from insns.def, do not edit */\n\n");
+
+	printf("static const struct dec32 dec32_list[] = {\n");
+	for (k = 0; k < 256; k++) {
+		idx[k] = n;
+		/* opcode[6:2] and funct3 of this slot */
+		t = ((k >> 3) << 2) | 0x3 | ((k & 0x7) << 12);
+		for (i = 0; i < N_INSNS; i++) {
+			m = insns[i].mask & 0x707f;
+			if ((t & m) != (insns[i].match & m)) continue;
+			printf("\t{ 0x%08x, 0x%08x, OP_%s, FMT_%s },\n",
+				insns[i].match, insns[i].mask, insns[i].op, insns[i].fmt);
+			n++;
+		}
+		printf("\t{ 0x00000000, 0x00000000, OP_INVALID, FMT_NONE },\n");
+		n++;
+	}
+	printf("};\n\n");
+
+	printf("static const uint16_t dec32_idx[256] = {");
+	for (k = 0; k < 256; k++)
+		printf("%s%u,", (k % 16) ? " " : "\n\t", idx[k]);
+	printf("\n};\n\n");
+
+	printf("static const uint8_t dec16_tab[65536] = {");
+	for (k = 0; k < 65536; k++) {
+		n = 0;
+		if ((k & 0x3) != 0x3) {
+			for (i = 0; i < N_CINSNS; i++) {
+				if ((k & cinsns[i].mask) == cinsns[i].match) {
+					n = i + 1;
+					break;
+				}
+			}
+		}
+		printf("%s%u,", (k % 32) ? "" : "\n\t", n);
+	}
+	printf("\n};\n");
+
+	return 0;
+}
@@ -0,0 +1,428 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+/*
+	loop idioms
+
+	the loops that clear bss, copy buffers and look for the end of a
+	string: at most IDIOM_MAX_INSNS instructions from a load or store
+	at the head to a bne or bltu back to it, with addi rd, rd, imm
+	updating pointers and counters in between.
+
+		fill	sb/sh/sw v, imm(d), unrolled up to IDIOM_MAX_UNROLL
+			times
+		copy	the same number of lb/lh/lw/lbu/lhu t, imm(s), then
+			the stores of what they loaded to imm(d)
+		scan	lb/lbu t, imm(p), the branch is bne t, c
+
+	the accesses of an iteration cover one block without gaps, base
+	registers step by its size, addi touches each register once, and
+	v, c and the end the branch compares against stay fixed. fill and
+	copy loops end on an updated register reaching the fixed one, a
+	scan on the byte it looks for.
+
+	predecode marks the head with the IDIOM op of its load or store.
+	idiom_run looks at the registers each time the loop is entered and
+	does its iterations, or as many as the instruction budget allows,
+	as one memset, memmove or memchr over ram. registers, icount and pc
+	end up where running the loop would have left them. loops that
+	would leave ram, store into their own code or copy upwards into
+	their source run as written.
+*/
+
+#define IDIOM_MAX_INSNS 24
+#define IDIOM_MAX_UNROLL 8	/* loads or stores per iteration */
+
+static const uint8_t idiom_op[OP_MAX] = {
+#define IDIOM(name, first) [OP_##first] = OP_##name,
+#include "insns.def"
+};
+
+static const uint8_t is_idiom[OP_MAX] = {
+#define IDIOM(name, first) [OP_##name] = 1,
+#include "insns.def"
+};
+
+/* offsets are from the base register's value at the head */
+struct access {
+	struct insn *in;
+	int at;			/* position in the loop */
+	int32_t off;
+};
+
+struct loop {
+	int n;			/* instructions, the branch included */
+	uint32_t end;		/* pc after the branch */
+	struct insn *br;
+	int nloads, nstores;
+	struct access loads[IDIOM_MAX_UNROLL];
+	struct access stores[IDIOM_MAX_UNROLL];
+	int size;		/* bytes per access */
+	int32_t load_min, store_min;	/* lowest offsets */
+	int nsteps;
+	struct {
+		uint8_t reg;
+		uint8_t at;
+		int32_t imm;
+	} steps[IDIOM_MAX_INSNS];
+};
+
+static int access_size(int op)
+{
+	switch (op) {
+	case OP_LB: case OP_LBU: case OP_SB:
+		return 1;
+	case OP_LH: case OP_LHU: case OP_SH:
+		return 2;
+	}
+	return 4;
+}
+
+static int is_load(int op)
+{
+	return op == OP_LB || op == OP_LH || op == OP_LW || op == OP_LBU || op == OP_LHU;
+}
+
+/* what addi adds to r per iteration, 0 for fixed registers */
+static int32_t step(struct loop *l, int r)
+{
+	int i;
+
+	for (i = 0; i < l->nsteps; i++)
+		if (l->steps[i].reg == r)
+			return l->steps[i].imm;
+	return 0;
+}
+
+static int loaded(struct loop *l, int r)
+{
+	int i;
+
+	for (i = 0; i < l->nloads; i++)
+		if (l->loads[i].in->rd == r)
+			return 1;
+	return 0;
+}
+
+/* k accesses of the same size off one base register that step over
+   k * size bytes without gaps. sets the offsets and min */
+static int contiguous(struct loop *l, struct access *a, int k, int32_t *min)
+{
+	uint32_t seen = 0, j;
+	int i, s, r = a[0].in->rs1;
+
+	for (i = 0; i < k; i++) {
+		if (a[i].in->rs1 != r || access_size(op_base[a[i].in->op]) != l->size)
+			return 0;
+		/* the addi may come before the access */
+		a[i].off = a[i].in->imm;
+		for (s = 0; s < l->nsteps; s++)
+			if (l->steps[s].reg == r && l->steps[s].at < a[i].at)
+				a[i].off += l->steps[s].imm;
+	}
+	*min = a[0].off;
+	for (i = 1; i < k; i++)
+		if (a[i].off < *min)
+			*min = a[i].off;
+	for (i = 0; i < k; i++) {
+		j = a[i].off - *min;
+		if (j % l->size || j / l->size >= (uint32_t)k || seen & (1u << j / l->size))
+			return 0;
+		seen |= 1u << j / l->size;
+	}
+	return step(l, r) == k * l->size;
+}
+
+/* the register rules from the top */
+static int check(struct loop *l)
+{
+	struct insn *br = l->br;
+	int i, j, fixed;
+
+	if (!l->nstores) {
+		/* scan, one byte per iteration */
+		struct insn *ld = l->loads[0].in;
+
+		l->size = 1;
+		if (l->nloads != 1 || !contiguous(l, l->loads, 1, &l->load_min) ||
+		    step(l, ld->rd) || ld->rd == ld->rs1 || op_base[br->op] != OP_BNE)
+			return 0;
+		fixed = br->rs1 == ld->rd ? br->rs2 : br->rs1;
+		return (br->rs1 == ld->rd || br->rs2 == ld->rd) &&
+			fixed != ld->rd && !step(l, fixed);
+	}
+	l->size = access_size(op_base[l->stores[0].in->op]);
+	if (!contiguous(l, l->stores, l->nstores, &l->store_min))
+		return 0;
+	if (l->nloads) {
+		/* copy: the loads first, every store writes what one of them
+		   read at the same place in the block */
+		if (l->nloads != l->nstores || l->loads[l->nloads - 1].at > l->stores[0].at ||
+		    !contiguous(l, l->loads, l->nloads, &l->load_min) ||
+		    loaded(l, l->stores[0].in->rs1))
+			return 0;
+		for (i = 0; i < l->nloads; i++) {
+			if (step(l, l->loads[i].in->rd) || l->loads[i].in->rd == l->loads[i].in->rs1)
+				return 0;
+			for (j = 0; j < i; j++)
+				if (l->loads[j].in->rd == l->loads[i].in->rd)
+					return 0;
+		}
+		for (i = 0; i < l->nstores; i++) {
+			for (j = 0; j < l->nloads; j++)
+				if (l->loads[j].in->rd == l->stores[i].in->rs2)
+					break;
+			if (j == l->nloads ||
+			    l->loads[j].off - l->load_min != l->stores[i].off - l->store_min)
+				return 0;
+		}
+	}
+	else {
+		/* fill */
+		for (i = 0; i < l->nstores; i++)
+			if (l->stores[i].in->rs2 != l->stores[0].in->rs2)
+				return 0;
+		if (step(l, l->stores[0].in->rs2))
+			return 0;
+	}
+	/* an updated register against a fixed one */
+	if (op_base[br->op] == OP_BLTU)
+		return step(l, br->rs1) > 0 && !step(l, br->rs2) && !loaded(l, br->rs2);
+	if (step(l, br->rs1) && step(l, br->rs2))
+		return 0;
+	fixed = step(l, br->rs1) ? br->rs2 : br->rs1;
+	return (step(l, br->rs1) || step(l, br->rs2)) && !loaded(l, fixed);
+}
+
+/* 1 when the loop at pc has one of the shapes, -1 when part of it
+   isn't decoded and decode is 0 */
+static int parse(struct cpu_state *cs, uint32_t pc, struct loop *l, int decode)
+{
+	struct insn *e;
+	uint32_t p = pc;
+	int i, op;
+
+	l->nloads = l->nstores = l->nsteps = 0;
+	for (i = 0; i < IDIOM_MAX_INSNS; i++) {
+		if (p - cs->ram_base >= cs->ram_size)
+			return 0;
+		e = &cs->icache[(p - cs->ram_base) >> 1];
+		if (e->op == OP_NONE) {
+			if (!decode)
+				return -1;
+			decode_insn(e, p, cs);
+		}
+		op = op_base[e->op];
+		if (is_load(op)) {
+			if (l->nloads == IDIOM_MAX_UNROLL || !e->rd)
+				return 0;
+			l->loads[l->nloads].in = e;
+			l->loads[l->nloads++].at = i;
+		}
+		else if (op == OP_SB || op == OP_SH || op == OP_SW) {
+			if (l->nstores == IDIOM_MAX_UNROLL)
+				return 0;
+			l->stores[l->nstores].in = e;
+			l->stores[l->nstores++].at = i;
+		}
+		else if (op == OP_ADDI) {
+			if (!e->rd || e->rd != e->rs1 || !e->imm || step(l, e->rd))
+				return 0;
+			l->steps[l->nsteps].reg = e->rd;
+			l->steps[l->nsteps].at = i;
+			l->steps[l->nsteps++].imm = e->imm;
+		}
+		else if ((op == OP_BNE || op == OP_BLTU) && p + e->imm == pc) {
+			if (!l->nloads && !l->nstores)
+				return 0;
+			l->br = e;
+			l->n = i + 1;
+			l->end = p + e->len;
+			return check(l);
+		}
+		else {
+			return 0;
+		}
+		p += e->len;
+	}
+	return 0;
+}
+
+/* iterations of a fill or copy loop until the branch falls through,
+   0 when the register wraps around first */
+static uint64_t count(struct cpu_state *cs, struct loop *l)
+{
+	struct insn *br = l->br;
+	int x = step(l, br->rs1) ? br->rs1 : br->rs2;
+	int y = x == br->rs1 ? br->rs2 : br->rs1;
+	int64_t d = step(l, x);
+	uint64_t n;
+
+	if (op_base[br->op] == OP_BLTU) {
+		n = cs->regs[y] > cs->regs[x] ? (cs->regs[y] - cs->regs[x] + d - 1) / d : 1;
+		return cs->regs[x] + n * d > 0xffffffff ? 0 : n;
+	}
+	if (d > 0)
+		n = (uint32_t)(cs->regs[y] - cs->regs[x]);
+	else
+		n = (uint32_t)(cs->regs[x] - cs->regs[y]);
+	d = d > 0 ? d : -d;
+	return n % d ? 0 : n / d;
+}
+
+/* offset in ram of len bytes at addr, -1 when they aren't all ram */
+static int64_t ram_range(struct cpu_state *cs, uint32_t addr, uint64_t len)
+{
+	uint32_t off = addr - cs->ram_base;
+
+	if (off > cs->ram_size || len > cs->ram_size - off)
+		return -1;
+	return off;
+}
+
+/* the value a load of size bytes at off gives */
+static uint32_t load_value(struct cpu_state *cs, int op, uint32_t off)
+{
+	uint16_t h;
+	uint32_t w;
+
+	switch (op) {
+	case OP_LB:
+		return (int8_t)cs->ram[off];
+	case OP_LBU:
+		return cs->ram[off];
+	case OP_LH:
+		memcpy(&h, cs->ram + off, 2);
+		return (int16_t)le16(h);
+	case OP_LHU:
+		memcpy(&h, cs->ram + off, 2);
+		return le16(h);
+	}
+	memcpy(&w, cs->ram + off, 4);
+	return le32(w);
+}
+
+/* len bytes of size byte stores of v */
+static void fill(struct cpu_state *cs, uint32_t off, uint32_t v, int size, uint64_t len)
+{
+	uint16_t h = le16(v);
+	uint32_t w = le32(v);
+	uint64_t i;
+
+	if (size == 1 || (size == 2 && (v & 0xff) * 0x0101 == (v & 0xffff)) ||
+	    (v & 0xff) * 0x01010101 == v) {
+		memset(cs->ram + off, v & 0xff, len);
+		return;
+	}
+	for (i = 0; i < len; i += size)
+		memcpy(cs->ram + off + i, size == 2 ? (void*)&h : (void*)&w, size);
+}
+
+/* run the rest of the loop at cs->pc as long as idiom_run gave up on
+   it, about as long as it would take */
+static int give_up(struct cpu_state *cs, struct loop *l, uint64_t iters)
+{
+	cs->idiom_pc = cs->pc;
+	cs->idiom_until = iters > (UINT64_MAX - cs->icount) / l->n ? UINT64_MAX : cs->icount + iters * l->n;
+	return 0;
+}
+
+/* mark the freshly decoded in at pc if it is the head of a loop,
+   returns 1 for loop heads */
+int idiom_find(struct insn *in, uint32_t pc, struct cpu_state *cs)
+{
+	struct loop l;
+
+	if (idiom_op[in->op] && parse(cs, pc, &l, 1) > 0)
+		in->op = idiom_op[in->op];
+	return is_idiom[in->op];
+}
+
+/*
+	in is the head of a loop at cs->pc. returns 0 to run the head
+	instruction as usual, 1 when iterations are done. the loop then
+	goes on at cs->pc if the budget ran out, else cs->pc is after the
+	branch.
+*/
+int idiom_run(struct cpu_state *cs, struct insn *in)
+{
+	struct loop l;
+	struct insn *ld;
+	uint64_t n, max, limit, iters, len;
+	uint32_t v, block;
+	int64_t off, src;
+	int i;
+	uint8_t *p;
+
+	if (in->op == op_base[in->op] ||
+	    (cs->pc == cs->idiom_pc && cs->icount < cs->idiom_until))
+		return 0;
+	i = parse(cs, cs->pc, &l, 0);
+	if (i <= 0) {
+		/* rewritten, it isn't a loop anymore */
+		if (i == 0)
+			in->op = op_base[in->op];
+		return 0;
+	}
+
+	/* the budget runs out at the first branch back past icount_limit */
+	limit = cpu_limit(cs);
+	max = cs->icount < limit ? (limit - cs->icount + l.n - 1) / l.n : 1;
+
+	if (!l.nstores) {
+		/* the byte a bne against cs->regs[c] stops at */
+		ld = l.loads[0].in;
+		v = cs->regs[l.br->rs1 == ld->rd ? l.br->rs2 : l.br->rs1];
+		off = ram_range(cs, cs->regs[ld->rs1] + l.load_min, 1);
+		if (off < 0)
+			return give_up(cs, &l, 1);
+		len = cs->ram_size - off < max ? cs->ram_size - off : max;
+		if (op_base[ld->op] == OP_LB ? (uint32_t)(int8_t)v != v : v > 0xff)
+			return give_up(cs, &l, cs->ram_size - off);
+		p = (uint8_t*)memchr(cs->ram + off, v & 0xff, len);
+		if (!p && len < max)
+			return give_up(cs, &l, len);
+		n = p ? p - (cs->ram + off) + 1 : max + 1;
+		iters = p ? n : max;
+		cs->regs[ld->rd] = load_value(cs, op_base[ld->op], off + iters - 1);
+	}
+	else {
+		n = count(cs, &l);
+		if (!n)
+			return give_up(cs, &l, UINT32_MAX);
+		iters = n < max ? n : max;
+		block = l.nstores * l.size;
+		len = iters * block;
+		off = ram_range(cs, cs->regs[l.stores[0].in->rs1] + l.store_min, len);
+		if (off < 0 || mem_in_rom(cs, off, len) ||
+		    (off < l.end - cs->ram_base && off + len > cs->pc - cs->ram_base))
+			return give_up(cs, &l, n);
+		if (l.nloads) {
+			src = ram_range(cs, cs->regs[l.loads[0].in->rs1] + l.load_min, len);
+			if (src < 0 || (off > src && off < src + (int64_t)len))
+				return give_up(cs, &l, n);
+			/* what the last iteration loaded, the stores before it
+			   are all below that with dst <= src */
+			for (i = 0; i < l.nloads; i++) {
+				ld = l.loads[i].in;
+				cs->regs[ld->rd] = load_value(cs, op_base[ld->op],
+					src + len - block + l.loads[i].off - l.load_min);
+			}
+			memmove(cs->ram + off, cs->ram + src, len);
+		}
+		else {
+			fill(cs, off, cs->regs[l.stores[0].in->rs2], l.size, len);
+		}
+		mem_stored(cs, off, len);
+	}
+
+	for (i = 0; i < l.nsteps; i++)
+		cs->regs[l.steps[i].reg] += (uint32_t)iters * l.steps[i].imm;
+	cs->icount += iters * l.n;
+	if (iters == n)
+		cs->pc = l.end;
+	return 1;
+}
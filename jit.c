@@ -0,0 +1,836 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+/*
+	basic block translator to x86-64
+
+	guest registers stay in struct cpu_state. rbx points to it while
+	translated code runs, eax/ecx/edx/esi/edi are scratch. a block ends
+	at the first jump or branch, or before an instruction the
+	translator does not handle, which the interpreter then runs. every
+	block exit stores the next pc and adds the retired instructions to
+	icount, so cpu_state is exact whenever control is back in C. calls
+	to mem_read and mem_write, and guard mode accesses that may fault
+	into io, first set pc and add the instructions retired before them,
+	so faults, traps, the exit register and mtime see the same icount
+	as in the interpreter.
+
+	exits to a static target load the address of their final jmp into
+	rax before jumping to the common exit. jit_loop patches that jmp to
+	go straight into the target block once it is translated, so hot
+	loops never leave translated code.
+*/
+
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_HASH_SIZE 4096
+#define JIT_MAX_BLOCKS 65536
+#define JIT_MAX_INSNS 64
+#define JIT_MAX_CODE 128	/* bytes of host code per guest instruction, worst case */
+
+#define REG(r) (offsetof(struct cpu_state, regs) + 4 * (r))
+#define PC offsetof(struct cpu_state, pc)
+#define ICOUNT offsetof(struct cpu_state, icount)
+#define ICOUNT_LIMIT offsetof(struct cpu_state, icount_limit)
+#define RAM offsetof(struct cpu_state, ram)
+#define GUARD_BASE offsetof(struct cpu_state, guard_base)
+#define FLUSH offsetof(struct cpu_state, jit_flush)
+#define COVER offsetof(struct cpu_state, cover)
+#define COVER_PREV offsetof(struct cpu_state, cover_prev)
+
+/* x86 registers */
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define EBX 3
+#define ESI 6
+#define EDI 7
+
+/* group 1 alu ops, /digit of 0x81 and 0x83 */
+#define ALU_ADD 0
+#define ALU_OR  1
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_XOR 6
+#define ALU_CMP 7
+
+/* group 2 shifts, /digit of 0xc1 and 0xd3 */
+#define SH_SHL 4
+#define SH_SHR 5
+#define SH_SAR 7
+
+/* condition codes */
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xc
+#define CC_GE 0xd
+
+struct jit_block {
+	uint32_t pc;
+	uint8_t *code;
+	struct jit_block *next;
+};
+
+struct jit {
+	uint8_t *code;		/* code cache */
+	uint8_t *p;		/* emit position */
+	uint8_t *start;		/* first block, after the entry and exit stubs */
+	uint8_t *exit;		/* common exit stub */
+	uint64_t (*enter)(struct cpu_state *cs, uint8_t *code);
+	struct cpu_state *cs;
+	int counted;		/* of the block's instructions, added to icount */
+	uint32_t flushes;
+	int nblocks;
+	struct jit_block *hash[JIT_HASH_SIZE];
+	struct jit_block blocks[JIT_MAX_BLOCKS];
+};
+
+static void emit8(struct jit *j, uint8_t b)
+{
+	*j->p++ = b;
+}
+
+static void emit32(struct jit *j, uint32_t v)
+{
+	memcpy(j->p, &v, 4);
+	j->p += 4;
+}
+
+static void emit64(struct jit *j, uint64_t v)
+{
+	memcpy(j->p, &v, 8);
+	j->p += 8;
+}
+
+/* op reg, [rbx + disp] */
+static void emit_mem(struct jit *j, uint8_t op, int reg, int32_t disp)
+{
+	emit8(j, op);
+	if (disp >= -128 && disp < 128) {
+		emit8(j, 0x43 | (reg << 3));
+		emit8(j, disp);
+	}
+	else {
+		emit8(j, 0x83 | (reg << 3));
+		emit32(j, disp);
+	}
+}
+
+static void emit_load(struct jit *j, int reg, int r)
+{
+	emit_mem(j, 0x8b, reg, REG(r));
+}
+
+static void emit_store(struct jit *j, int reg, int r)
+{
+	emit_mem(j, 0x89, reg, REG(r));
+}
+
+/* mov dword [rbx + disp], imm */
+static void emit_store_imm(struct jit *j, int32_t disp, uint32_t imm)
+{
+	emit_mem(j, 0xc7, 0, disp);
+	emit32(j, imm);
+}
+
+/* op reg, imm */
+static void emit_alu_imm(struct jit *j, int alu, int reg, int32_t imm)
+{
+	if (imm >= -128 && imm < 128) {
+		emit8(j, 0x83);
+		emit8(j, 0xc0 | (alu << 3) | reg);
+		emit8(j, imm);
+	}
+	else {
+		emit8(j, 0x81);
+		emit8(j, 0xc0 | (alu << 3) | reg);
+		emit32(j, imm);
+	}
+}
+
+/* setcc al; movzx eax, al */
+static void emit_setcc(struct jit *j, int cc)
+{
+	emit8(j, 0x0f);
+	emit8(j, 0x90 | cc);
+	emit8(j, 0xc0);
+	emit8(j, 0x0f);
+	emit8(j, 0xb6);
+	emit8(j, 0xc0);
+}
+
+static void emit_jmp(struct jit *j, uint8_t *target)
+{
+	emit8(j, 0xe9);
+	emit32(j, target - (j->p + 4));
+}
+
+/* mov rax, fn; call rax */
+static void emit_call(struct jit *j, void *fn)
+{
+	emit8(j, 0x48);
+	emit8(j, 0xb8);
+	emit64(j, (uint64_t)fn);
+	emit8(j, 0xff);
+	emit8(j, 0xd0);
+}
+
+/* add qword [rbx + icount], n */
+static void emit_add_icount(struct jit *j, int n)
+{
+	emit8(j, 0x48);
+	emit_mem(j, 0x83, 0, ICOUNT);
+	emit8(j, n);
+}
+
+/* the block's first n instructions retired, leaving it */
+static void emit_icount(struct jit *j, int n)
+{
+	emit_add_icount(j, n - j->counted);
+}
+
+/* the ones before the n-th retired, for a call on the block's main
+   path. exits after it add only the rest */
+static void emit_sync(struct jit *j, int n)
+{
+	if (n - 1 > j->counted) {
+		emit_add_icount(j, n - 1 - j->counted);
+		j->counted = n - 1;
+	}
+}
+
+/* leave translated code, cs->pc must be set already */
+static void emit_exit_dynamic(struct jit *j, int n)
+{
+	emit_icount(j, n);
+	emit8(j, 0x31);		/* xor eax, eax */
+	emit8(j, 0xc0);
+	emit_jmp(j, j->exit);
+}
+
+/* leave translated code towards a static target, patchable */
+static void emit_exit(struct jit *j, uint32_t pc, int n)
+{
+	emit_icount(j, n);
+	emit_store_imm(j, PC, pc);
+	emit8(j, 0x48);		/* lea rax, [rip] */
+	emit8(j, 0x8d);
+	emit8(j, 0x05);
+	emit32(j, 0);
+	emit_jmp(j, j->exit);
+}
+
+/* count the edge into the block at pc, see COVER_ENTRY */
+static void emit_cover(struct jit *j, uint32_t pc)
+{
+	uint32_t id = cover_id(pc);
+
+	emit_mem(j, 0x8b, EAX, COVER_PREV);	/* mov eax, [rbx + cover_prev] */
+	emit8(j, 0x35);		/* xor eax, id */
+	emit32(j, id);
+	emit8(j, 0x48);		/* mov rcx, [rbx + cover] */
+	emit_mem(j, 0x8b, ECX, COVER);
+	emit8(j, 0x80);		/* add byte [rcx + rax], 1 */
+	emit8(j, 0x04);
+	emit8(j, 0x01);
+	emit8(j, 0x01);
+	emit8(j, 0x80);		/* adc byte [rcx + rax], 0 */
+	emit8(j, 0x14);
+	emit8(j, 0x01);
+	emit8(j, 0x00);
+	emit_store_imm(j, COVER_PREV, id >> 1);
+}
+
+/* a loop head tries idiom_run first. when that ran the loop, pc and
+   icount are set and the block is left */
+static void emit_idiom(struct jit *j, struct insn *in, uint32_t pc)
+{
+	uint8_t *p;
+
+	emit_store_imm(j, PC, pc);
+	emit8(j, 0x48);		/* mov rdi, rbx */
+	emit8(j, 0x89);
+	emit8(j, 0xdf);
+	emit8(j, 0x48);		/* mov rsi, in */
+	emit8(j, 0xbe);
+	emit64(j, (uint64_t)in);
+	emit_call(j, idiom_run);
+	emit8(j, 0x85);		/* test eax, eax */
+	emit8(j, 0xc0);
+	emit8(j, 0x74);		/* je body */
+	p = j->p;
+	emit8(j, 0);
+	emit8(j, 0x31);		/* xor eax, eax */
+	emit8(j, 0xc0);
+	emit_jmp(j, j->exit);
+	*p = j->p - (p + 1);
+}
+
+/* mov, movsx or movzx eax, [rcx + index] */
+static void emit_load_host(struct jit *j, int op, int index)
+{
+	switch (op) {
+	case OP_LW:
+		emit8(j, 0x8b);
+		break;
+	case OP_LB:
+		emit8(j, 0x0f);
+		emit8(j, 0xbe);
+		break;
+	case OP_LH:
+		emit8(j, 0x0f);
+		emit8(j, 0xbf);
+		break;
+	case OP_LBU:
+		emit8(j, 0x0f);
+		emit8(j, 0xb6);
+		break;
+	case OP_LHU:
+		emit8(j, 0x0f);
+		emit8(j, 0xb7);
+		break;
+	}
+	emit8(j, 0x04);
+	emit8(j, (index << 3) | ECX);
+}
+
+/*
+	load with the ram access inline, anything outside ram goes through
+	mem_read with cs->pc and icount synced, icount is taken back after
+	it so both paths leave it the same. in guard mode the load is a
+	single host access, the fault handler takes care of the rest.
+*/
+static void emit_load_mem(struct jit *j, struct insn *in, uint32_t pc, int n)
+{
+	struct cpu_state *cs = j->cs;
+	uint8_t *slow, *done;
+	int size = (in->op == OP_LW) ? 4 : (in->op == OP_LH || in->op == OP_LHU) ? 2 : 1;
+
+	emit_load(j, EDI, in->rs1);
+	if (in->imm)
+		emit_alu_imm(j, ALU_ADD, EDI, in->imm);
+	if (cs->guard_base) {
+		emit_sync(j, n);
+		emit_store_imm(j, PC, pc);
+		emit8(j, 0x48);		/* mov rcx, [rbx + guard_base] */
+		emit_mem(j, 0x8b, ECX, GUARD_BASE);
+		emit_load_host(j, in->op, EDI);
+		if (in->rd)
+			emit_store(j, EAX, in->rd);
+		return;
+	}
+	emit8(j, 0x89);		/* mov eax, edi */
+	emit8(j, 0xf8);
+	if (cs->ram_base)
+		emit_alu_imm(j, ALU_SUB, EAX, cs->ram_base);
+	emit_alu_imm(j, ALU_CMP, EAX, cs->ram_size - size);
+	emit8(j, 0x77);		/* ja slow */
+	slow = j->p;
+	emit8(j, 0);
+	emit8(j, 0x48);		/* mov rcx, [rbx + ram] */
+	emit_mem(j, 0x8b, ECX, RAM);
+	emit_load_host(j, in->op, EAX);
+	emit8(j, 0xeb);		/* jmp done */
+	done = j->p;
+	emit8(j, 0);
+	*slow = j->p - (slow + 1);
+
+	emit_store_imm(j, PC, pc);
+	if (n - 1 > j->counted)
+		emit_add_icount(j, n - 1 - j->counted);
+	emit8(j, 0xbe);		/* mov esi, size */
+	emit32(j, size);
+	emit8(j, 0x48);		/* mov rdx, rbx */
+	emit8(j, 0x89);
+	emit8(j, 0xda);
+	emit_call(j, mem_read);
+	if (n - 1 > j->counted)
+		emit_add_icount(j, j->counted - (n - 1));
+	if (in->op == OP_LB || in->op == OP_LH) {
+		emit8(j, 0x0f);	/* movsx eax, al / ax */
+		emit8(j, in->op == OP_LB ? 0xbe : 0xbf);
+		emit8(j, 0xc0);
+	}
+	*done = j->p - (done + 1);
+	if (in->rd)
+		emit_store(j, EAX, in->rd);
+}
+
+/* div, divu, rem and remu with the results the spec gives for
+   division by zero and overflow, x86 would raise #DE for those */
+static void emit_div(struct jit *j, struct insn *in)
+{
+	int sign = in->op == OP_DIV || in->op == OP_REM;
+	int rem = in->op == OP_REM || in->op == OP_REMU;
+	uint8_t *zero, *minus1 = NULL, *done, *done2 = NULL;
+
+	emit_load(j, EAX, in->rs1);
+	emit_load(j, ECX, in->rs2);
+	emit8(j, 0x85);		/* test ecx, ecx */
+	emit8(j, 0xc9);
+	emit8(j, 0x74);		/* je zero */
+	zero = j->p;
+	emit8(j, 0);
+	if (sign) {
+		emit_alu_imm(j, ALU_CMP, ECX, -1);
+		emit8(j, 0x74);	/* je minus1 */
+		minus1 = j->p;
+		emit8(j, 0);
+		emit8(j, 0x99);	/* cdq */
+		emit8(j, 0xf7);	/* idiv ecx */
+		emit8(j, 0xf9);
+	}
+	else {
+		emit8(j, 0x31);	/* xor edx, edx */
+		emit8(j, 0xd2);
+		emit8(j, 0xf7);	/* div ecx */
+		emit8(j, 0xf1);
+	}
+	if (rem) {
+		emit8(j, 0x89);	/* mov eax, edx */
+		emit8(j, 0xd0);
+	}
+	emit8(j, 0xeb);		/* jmp done */
+	done = j->p;
+	emit8(j, 0);
+
+	/* x / 0 = -1, x % 0 = x */
+	*zero = j->p - (zero + 1);
+	if (!rem) {
+		emit8(j, 0xb8);	/* mov eax, -1 */
+		emit32(j, -1);
+	}
+	if (sign) {
+		emit8(j, 0xeb);	/* jmp done */
+		done2 = j->p;
+		emit8(j, 0);
+		/* x / -1 = -x, wraps for INT_MIN, x % -1 = 0 */
+		*minus1 = j->p - (minus1 + 1);
+		emit8(j, rem ? 0x31 : 0xf7);	/* xor eax, eax or neg eax */
+		emit8(j, rem ? 0xc0 : 0xd8);
+		*done2 = j->p - (done2 + 1);
+	}
+	*done = j->p - (done + 1);
+	emit_store(j, EAX, in->rd);
+}
+
+/*
+	translate one instruction, n is its position in the block counting
+	from 1. returns 0 if the instruction is not handled, 1 if the block
+	goes on and 2 if the instruction ended the block.
+*/
+static int emit_insn(struct jit *j, struct insn *in, uint32_t pc, int n)
+{
+	uint8_t *p;
+	int alu = 0, cc = 0, sh = 0;
+
+	switch (in->op) {
+	case OP_LUI:
+	case OP_AUIPC:
+		if (in->rd)
+			emit_store_imm(j, REG(in->rd),
+				in->imm + (in->op == OP_AUIPC ? pc : 0));
+		return 1;
+
+	case OP_ADDI:
+	case OP_XORI:
+	case OP_ORI:
+	case OP_ANDI:
+		if (!in->rd)
+			return 1;
+		alu = in->op == OP_ADDI ? ALU_ADD : in->op == OP_XORI ? ALU_XOR :
+			in->op == OP_ORI ? ALU_OR : ALU_AND;
+		emit_load(j, EAX, in->rs1);
+		if (in->imm || alu == ALU_AND)
+			emit_alu_imm(j, alu, EAX, in->imm);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_SLTI:
+	case OP_SLTIU:
+		if (!in->rd)
+			return 1;
+		emit_load(j, EAX, in->rs1);
+		emit_alu_imm(j, ALU_CMP, EAX, in->imm);
+		emit_setcc(j, in->op == OP_SLTI ? CC_L : CC_B);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_SLLI:
+	case OP_SRLI:
+	case OP_SRAI:
+		if (!in->rd)
+			return 1;
+		sh = in->op == OP_SLLI ? SH_SHL : in->op == OP_SRLI ? SH_SHR : SH_SAR;
+		emit_load(j, EAX, in->rs1);
+		emit8(j, 0xc1);
+		emit8(j, 0xc0 | (sh << 3) | EAX);
+		emit8(j, in->imm);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_ADD:
+	case OP_SUB:
+	case OP_XOR:
+	case OP_OR:
+	case OP_AND:
+		if (!in->rd)
+			return 1;
+		alu = in->op == OP_ADD ? 0x03 : in->op == OP_SUB ? 0x2b :
+			in->op == OP_XOR ? 0x33 : in->op == OP_OR ? 0x0b : 0x23;
+		emit_load(j, EAX, in->rs1);
+		emit_mem(j, alu, EAX, REG(in->rs2));
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_SLT:
+	case OP_SLTU:
+		if (!in->rd)
+			return 1;
+		emit_load(j, EAX, in->rs1);
+		emit_mem(j, 0x3b, EAX, REG(in->rs2));
+		emit_setcc(j, in->op == OP_SLT ? CC_L : CC_B);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_SLL:
+	case OP_SRL:
+	case OP_SRA:
+		if (!in->rd)
+			return 1;
+		sh = in->op == OP_SLL ? SH_SHL : in->op == OP_SRL ? SH_SHR : SH_SAR;
+		emit_load(j, ECX, in->rs2);
+		emit_load(j, EAX, in->rs1);
+		emit8(j, 0xd3);
+		emit8(j, 0xc0 | (sh << 3) | EAX);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_LB:
+	case OP_LH:
+	case OP_LW:
+	case OP_LBU:
+	case OP_LHU:
+		emit_load_mem(j, in, pc, n);
+		return 1;
+
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		emit_load(j, EDI, in->rs1);
+		if (in->imm)
+			emit_alu_imm(j, ALU_ADD, EDI, in->imm);
+		emit_load(j, ESI, in->rs2);
+		emit8(j, 0xba);		/* mov edx, size */
+		emit32(j, in->op == OP_SB ? 1 : in->op == OP_SH ? 2 : 4);
+		emit8(j, 0x48);		/* mov rcx, rbx */
+		emit8(j, 0x89);
+		emit8(j, 0xd9);
+		emit_store_imm(j, PC, pc);
+		emit_sync(j, n);
+		emit_call(j, mem_write);
+		/* the store hit translated code, leave before running it */
+		emit_mem(j, 0x80, 7, FLUSH);	/* cmp byte [rbx + flush], 0 */
+		emit8(j, 0);
+		emit8(j, 0x74);		/* je skip */
+		p = j->p;
+		emit8(j, 0);
+		emit_store_imm(j, PC, pc + in->len);
+		emit_exit_dynamic(j, n);
+		*p = j->p - (p + 1);
+		return 1;
+
+	case OP_MUL:
+		if (!in->rd)
+			return 1;
+		emit_load(j, EAX, in->rs1);
+		emit8(j, 0x0f);		/* imul eax, [rbx + rs2] */
+		emit_mem(j, 0xaf, EAX, REG(in->rs2));
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_MULH:
+	case OP_MULHSU:
+	case OP_MULHU:
+		if (!in->rd)
+			return 1;
+		/* 64-bit product of the sign or zero extended operands */
+		if (in->op != OP_MULHU)
+			emit8(j, 0x48);	/* movsxd rax, [rbx + rs1] */
+		emit_mem(j, in->op != OP_MULHU ? 0x63 : 0x8b, EAX, REG(in->rs1));
+		if (in->op == OP_MULH)
+			emit8(j, 0x48);	/* movsxd rcx, [rbx + rs2] */
+		emit_mem(j, in->op == OP_MULH ? 0x63 : 0x8b, ECX, REG(in->rs2));
+		emit8(j, 0x48);		/* imul rax, rcx */
+		emit8(j, 0x0f);
+		emit8(j, 0xaf);
+		emit8(j, 0xc1);
+		emit8(j, 0x48);		/* shr rax, 32 */
+		emit8(j, 0xc1);
+		emit8(j, 0xe8);
+		emit8(j, 32);
+		emit_store(j, EAX, in->rd);
+		return 1;
+
+	case OP_DIV:
+	case OP_DIVU:
+	case OP_REM:
+	case OP_REMU:
+		if (!in->rd)
+			return 1;
+		emit_div(j, in);
+		return 1;
+
+	case OP_BEQ:
+	case OP_BNE:
+	case OP_BLT:
+	case OP_BGE:
+	case OP_BLTU:
+	case OP_BGEU:
+		cc = in->op == OP_BEQ ? CC_E : in->op == OP_BNE ? CC_NE :
+			in->op == OP_BLT ? CC_L : in->op == OP_BGE ? CC_GE :
+			in->op == OP_BLTU ? CC_B : CC_AE;
+		emit_load(j, EAX, in->rs1);
+		emit_mem(j, 0x3b, EAX, REG(in->rs2));
+		emit8(j, 0x0f);		/* jcc taken */
+		emit8(j, 0x80 | cc);
+		p = j->p;
+		emit32(j, 0);
+		emit_exit(j, pc + in->len, n);
+		sh = j->p - (p + 4);
+		memcpy(p, &sh, 4);
+		emit_exit(j, pc + in->imm, n);
+		return 2;
+
+	case OP_JAL:
+		if (in->rd)
+			emit_store_imm(j, REG(in->rd), pc + in->len);
+		emit_exit(j, pc + in->imm, n);
+		return 2;
+
+	case OP_JALR:
+		emit_load(j, EAX, in->rs1);
+		if (in->imm)
+			emit_alu_imm(j, ALU_ADD, EAX, in->imm);
+		emit_alu_imm(j, ALU_AND, EAX, -2);
+		if (in->rd)
+			emit_store_imm(j, REG(in->rd), pc + in->len);
+		emit_mem(j, 0x89, EAX, PC);
+		emit_exit_dynamic(j, n);
+		return 2;
+	}
+	return 0;
+}
+
+void jit_flush(struct cpu_state *cs)
+{
+	struct jit *j = cs->jit;
+
+	j->p = j->start;
+	j->nblocks = 0;
+	j->flushes++;
+	memset(j->hash, 0, sizeof(j->hash));
+	memset(cs->jit_pages, 0, cs->ram_size >> JIT_PAGE_SHIFT);
+	cs->jit_flush = 0;
+}
+
+static struct jit_block *jit_lookup(struct jit *j, uint32_t pc)
+{
+	struct jit_block *b;
+
+	for (b = j->hash[(pc >> 1) & (JIT_HASH_SIZE - 1)]; b; b = b->next)
+		if (b->pc == pc)
+			return b;
+	return NULL;
+}
+
+static struct jit_block *jit_translate(struct cpu_state *cs, uint32_t pc)
+{
+	struct jit *j = cs->jit;
+	struct jit_block *b;
+	struct insn *in, tmp;
+	uint8_t *code, *p;
+	uint32_t start = pc, a;
+	int n, ret = 1;
+
+	if (j->nblocks == JIT_MAX_BLOCKS ||
+	    j->p + (JIT_MAX_INSNS + 1) * JIT_MAX_CODE > j->code + JIT_CODE_SIZE)
+		jit_flush(cs);
+
+	code = j->p;
+	j->counted = 0;
+
+	/* stop here once the instruction budget is used up */
+	emit8(j, 0x48);		/* mov rax, [rbx + icount] */
+	emit_mem(j, 0x8b, EAX, ICOUNT);
+	emit8(j, 0x48);		/* cmp rax, [rbx + icount_limit] */
+	emit_mem(j, 0x3b, EAX, ICOUNT_LIMIT);
+	emit8(j, 0x72);		/* jb body */
+	p = j->p;
+	emit8(j, 0);
+	emit_store_imm(j, PC, pc);
+	emit8(j, 0x31);		/* xor eax, eax */
+	emit8(j, 0xc0);
+	emit_jmp(j, j->exit);
+	*p = j->p - (p + 1);
+	if (cs->cover)
+		emit_cover(j, pc);
+
+	for (n = 0; n < JIT_MAX_INSNS && ret == 1; n++) {
+		if (pc - cs->ram_base >= cs->ram_size || (pc & 0x1))
+			break;
+		in = &cs->icache[(pc - cs->ram_base) >> 1];
+		if (in->op == OP_NONE)
+			decode_insn(in, pc, cs);
+		/* with coverage every iteration counts, like in the
+		   interpreter */
+		if (n == 0 && idiom_find(in, pc, cs) && !cs->cover)
+			emit_idiom(j, in, pc);
+		/* translated code doesn't need the interpreter's fused ops */
+		tmp = *in;
+		tmp.op = op_base[in->op];
+		ret = emit_insn(j, &tmp, pc, n + 1);
+		if (!ret)
+			break;
+		pc += in->len;
+	}
+	if (n == 0) {
+		j->p = code;
+		return NULL;
+	}
+	if (ret != 2)
+		emit_exit(j, pc, n);
+
+	for (a = start - cs->ram_base; a < pc - cs->ram_base; a += JIT_PAGE_SIZE)
+		cs->jit_pages[a >> JIT_PAGE_SHIFT] = 1;
+	cs->jit_pages[(pc - 1 - cs->ram_base) >> JIT_PAGE_SHIFT] = 1;
+
+	b = &j->blocks[j->nblocks++];
+	b->pc = start;
+	b->code = code;
+	b->next = j->hash[(start >> 1) & (JIT_HASH_SIZE - 1)];
+	j->hash[(start >> 1) & (JIT_HASH_SIZE - 1)] = b;
+	return b;
+}
+
+int jit_init(struct cpu_state *cs)
+{
+	struct jit *j;
+
+	j = (struct jit*)calloc(1, sizeof(struct jit));
+	if (!j) return -1;
+	j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->code == MAP_FAILED) {
+		free(j);
+		return -1;
+	}
+	cs->jit_pages = (uint8_t*)calloc((cs->ram_size >> JIT_PAGE_SHIFT) + 1, 1);
+	if (!cs->jit_pages) {
+		munmap(j->code, JIT_CODE_SIZE);
+		free(j);
+		return -1;
+	}
+	j->p = j->code;
+
+	/* enter(cs, code): keep rbx = cs and jump into the block */
+	j->enter = (uint64_t (*)(struct cpu_state*, uint8_t*))j->p;
+	emit8(j, 0x53);		/* push rbx */
+	emit8(j, 0x48);		/* mov rbx, rdi */
+	emit8(j, 0x89);
+	emit8(j, 0xfb);
+	emit8(j, 0xff);		/* jmp rsi */
+	emit8(j, 0xe6);
+
+	j->exit = j->p;
+	emit8(j, 0x5b);		/* pop rbx */
+	emit8(j, 0xc3);		/* ret */
+
+	j->start = j->p;
+	j->cs = cs;
+	cs->jit = j;
+	return 0;
+}
+
+void jit_free(struct cpu_state *cs)
+{
+	struct jit *j = cs->jit;
+
+	if (!j)
+		return;
+	munmap(j->code, JIT_CODE_SIZE);
+	free(j);
+	free(cs->jit_pages);
+	cs->jit = NULL;
+	cs->jit_pages = NULL;
+}
+
+/* returns 0 when the instruction budget is used up, < 0 like decode_loop */
+int jit_loop(struct cpu_state *cs)
+{
+	struct jit *j = cs->jit;
+	struct jit_block *b;
+	uint8_t *patch = NULL;
+	uint32_t gen = 0;
+	int32_t rel;
+	int ret;
+
+	while (cs->icount < cpu_limit(cs)) {
+		if (cs->jit_flush)
+			jit_flush(cs);
+		b = jit_lookup(j, cs->pc);
+		if (!b)
+			b = jit_translate(cs, cs->pc);
+		if (!b) {
+			/* let the interpreter run this block, it may change
+			   irq_at */
+			__atomic_store_n(&cs->icount_limit, cs->icount + 1, __ATOMIC_RELAXED);
+			ret = decode_loop(cs);
+			cpu_set_limit(cs);
+			if (ret < 0)
+				return ret;
+			patch = NULL;
+			continue;
+		}
+		/* chain the previous exit to this block */
+		if (patch && gen == j->flushes) {
+			rel = b->code - (patch + 5);
+			memcpy(patch + 1, &rel, 4);
+		}
+		patch = (uint8_t*)j->enter(cs, b->code);
+		gen = j->flushes;
+	}
+	return 0;
+}
+
+#else
+
+int jit_init(struct cpu_state *cs)
+{
+	return -1;
+}
+
+int jit_loop(struct cpu_state *cs)
+{
+	return decode_loop(cs);
+}
+
+void jit_flush(struct cpu_state *cs)
+{
+}
+
+void jit_free(struct cpu_state *cs)
+{
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "emu.h"
+#include "fuzz.h"
+
+/*
+	libFuzzer front end, make rv32_fuzz. the guest's options follow
+	libFuzzer's own, libFuzzer leaves flags starting with -- alone:
+
+		./rv32_fuzz corpus/ --image=parser.elf --fuzz-buf=0x8000:4096
+			--fuzz-len=a0 --fuzz-start=pc=0x1234 [--restore=<file>]
+			[--jit] [--guard-mem] [--ram-size=<n>] [--max-insns=<n>]
+
+	edges are counted straight into libFuzzer's extra counters, a guest
+	crash aborts like any other target's would.
+*/
+
+static uint8_t counters[EMU_COVER_SIZE]
+	__attribute__((used, section("__libfuzzer_extra_counters")));
+
+static struct emu *e;
+static struct fuzz_config fc;
+
+static const char *option(const char *arg, const char *name)
+{
+	size_t n = strlen(name);
+
+	if (strncmp(arg, name, n) || arg[n] != '=')
+		return NULL;
+	return arg + n + 1;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	const char *image = NULL, *restore = NULL, *a, *v;
+	struct emu_config cfg;
+	int i, bad = 0;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ram_size = RAM_SIZE;
+	fc.budget = FUZZ_BUDGET;
+	for (i = 1; i < *argc; i++) {
+		a = (*argv)[i];
+		if ((v = option(a, "--image")))
+			image = v;
+		else if ((v = option(a, "--restore")))
+			restore = v;
+		else if ((v = option(a, "--fuzz-buf")))
+			bad |= fuzz_parse_buf(&fc, v);
+		else if ((v = option(a, "--fuzz-len")))
+			bad |= fuzz_parse_len(&fc, v);
+		else if ((v = option(a, "--fuzz-start")))
+			bad |= fuzz_parse_start(&fc, v);
+		else if ((v = option(a, "--ram-size")))
+			cfg.ram_size = strtoul(v, NULL, 0);
+		else if ((v = option(a, "--max-insns")))
+			fc.budget = strtoull(v, NULL, 0);
+		else if (!strcmp(a, "--jit"))
+			cfg.jit = 1;
+		else if (!strcmp(a, "--guard-mem"))
+			cfg.guard = 1;
+	}
+	if (bad || !fc.size || (!image && !restore)) {
+		printf("rv32_fuzz needs --image=<file> or --restore=<file> and "
+			"--fuzz-buf=<addr>:<size>, see libfuzzer.c\n");
+		exit(1);
+	}
+	e = fuzz_create(&cfg, &fc, image, restore, 0);
+	if (!e)
+		exit(1);
+	emu_cover(e, counters);
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (fuzz_crashed(e, fuzz_one(e, &fc, data, size)))
+		abort();
+	return 0;
+}
@@ -0,0 +1,317 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "loader.h"
+
+int is_elf(const char *path)
+{
+	unsigned char magic[SELFMAG];
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (read(fd, magic, SELFMAG) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG))
+		ret = 1;
+	close(fd);
+	return ret;
+}
+
+/* segments holding nothing but the elf and program headers */
+static int headers_only(struct elf *e, Elf32_Phdr *ph)
+{
+	return ph->p_offset == 0 && !(ph->p_flags & (PF_X | PF_W)) &&
+		ph->p_filesz <= e->eh.e_phoff + e->eh.e_phnum * sizeof(Elf32_Phdr) &&
+		ph->p_memsz == ph->p_filesz;
+}
+
+static int loadable(struct elf *e, Elf32_Phdr *ph)
+{
+	return ph->p_type == PT_LOAD && ph->p_memsz && !headers_only(e, ph);
+}
+
+int elf_open(struct elf *e, const char *path)
+{
+	Elf32_Phdr *ph;
+	size_t len;
+	int i;
+
+	memset(e, 0, sizeof(*e));
+	e->fd = open(path, O_RDONLY);
+	if (e->fd < 0) {
+		fprintf(stderr, "can't open %s\n", path);
+		return -1;
+	}
+	if (pread(e->fd, &e->eh, sizeof(e->eh), 0) != sizeof(e->eh) ||
+	    memcmp(e->eh.e_ident, ELFMAG, SELFMAG) ||
+	    e->eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+	    e->eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+	    e->eh.e_machine != EM_RISCV || e->eh.e_type != ET_EXEC ||
+	    e->eh.e_phentsize != sizeof(Elf32_Phdr)) {
+		fprintf(stderr, "%s is not a 32-bit risc-v executable\n", path);
+		goto fail;
+	}
+
+	len = e->eh.e_phnum * sizeof(Elf32_Phdr);
+	e->ph = (Elf32_Phdr*)malloc(len);
+	if (!e->ph || pread(e->fd, e->ph, len, e->eh.e_phoff) != len) {
+		fprintf(stderr, "%s: can't read program headers\n", path);
+		goto fail;
+	}
+
+	e->lo = UINT32_MAX;
+	for (i = 0; i < e->eh.e_phnum; i++) {
+		ph = &e->ph[i];
+		if (!loadable(e, ph))
+			continue;
+		if (ph->p_vaddr + ph->p_memsz < ph->p_vaddr ||
+		    ph->p_filesz > ph->p_memsz) {
+			fprintf(stderr, "%s: bad segment at 0x%x\n", path, ph->p_vaddr);
+			goto fail;
+		}
+		if (ph->p_vaddr < e->lo)
+			e->lo = ph->p_vaddr;
+		if (ph->p_vaddr + ph->p_memsz > e->hi)
+			e->hi = ph->p_vaddr + ph->p_memsz;
+	}
+	if (e->lo > e->hi) {
+		fprintf(stderr, "%s has nothing to load\n", path);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	elf_close(e);
+	return -1;
+}
+
+/* does another segment use any page of segment i */
+static int shares_page(struct elf *e, int i, uint32_t pg)
+{
+	Elf32_Phdr *a = &e->ph[i], *b;
+	int k;
+
+	for (k = 0; k < e->eh.e_phnum; k++) {
+		b = &e->ph[k];
+		if (k == i || !loadable(e, b))
+			continue;
+		if ((b->p_vaddr & ~(pg - 1)) < ((a->p_vaddr + a->p_memsz + (pg - 1)) & ~(pg - 1)) &&
+		    (a->p_vaddr & ~(pg - 1)) < ((b->p_vaddr + b->p_memsz + (pg - 1)) & ~(pg - 1)))
+			return 1;
+	}
+	return 0;
+}
+
+/* ram has to be untouched, bss relies on it being zero. mem_protect
+   makes the rom read-only once the rest of the image is in */
+int elf_map(struct elf *e, struct mem *m)
+{
+	struct mem_region *r;
+	Elf32_Phdr *ph;
+	uint32_t pg = sysconf(_SC_PAGESIZE), delta, tail;
+	uint64_t lo, hi;
+	uint8_t *host;
+	int i;
+
+	for (i = 0; i < e->eh.e_phnum; i++) {
+		ph = &e->ph[i];
+		if (!loadable(e, ph))
+			continue;
+		r = mem_find(m, ph->p_vaddr, ph->p_memsz);
+		if (!r || r->type == MEM_IO) {
+			fprintf(stderr, "segment at 0x%x doesn't fit into ram\n", ph->p_vaddr);
+			return -1;
+		}
+		if (!ph->p_filesz)
+			continue;
+		host = r->host + (ph->p_vaddr - r->base);
+		delta = ph->p_offset & (pg - 1);
+		if (((uintptr_t)host & (pg - 1)) == delta && !shares_page(e, i, pg)) {
+			/* private file mapping, pages come in on first use */
+			if (mmap(host - delta, ph->p_filesz + delta, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_FIXED, e->fd, ph->p_offset - delta) == MAP_FAILED) {
+				fprintf(stderr, "can't map segment at 0x%x\n", ph->p_vaddr);
+				return -1;
+			}
+			/* the rest of the last page is file contents, not bss */
+			tail = (ph->p_filesz + delta) & (pg - 1);
+			if (tail)
+				memset(host + ph->p_filesz, 0, pg - tail);
+		}
+		else if (pread(e->fd, host, ph->p_filesz, ph->p_offset) != ph->p_filesz) {
+			fprintf(stderr, "can't read segment at 0x%x\n", ph->p_vaddr);
+			return -1;
+		}
+	}
+
+	/* segments without PF_W are rom in the whole pages they cover.
+	   when the region table is full they stay ram */
+	for (i = 0; i < e->eh.e_phnum; i++) {
+		ph = &e->ph[i];
+		if (!loadable(e, ph) || (ph->p_flags & PF_W))
+			continue;
+		lo = ((uint64_t)ph->p_vaddr + pg - 1) & ~(uint64_t)(pg - 1);
+		hi = ((uint64_t)ph->p_vaddr + ph->p_memsz) & ~(uint64_t)(pg - 1);
+		if (hi > lo)
+			mem_add(m, "rom", lo, hi - lo, MEM_ROM);
+	}
+	return 0;
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* keeps defined function, object and plain labels, returns the count */
+int elf_symbols(struct elf *e, struct symtab *st)
+{
+	Elf32_Shdr *sh = NULL, *s, *str;
+	Elf32_Sym *syms = NULL, *y;
+	size_t len;
+	int i, n, ret = -1;
+
+	memset(st, 0, sizeof(*st));
+	if (!e->eh.e_shoff || e->eh.e_shentsize != sizeof(Elf32_Shdr))
+		return 0;
+	len = e->eh.e_shnum * sizeof(Elf32_Shdr);
+	sh = (Elf32_Shdr*)malloc(len);
+	if (!sh || pread(e->fd, sh, len, e->eh.e_shoff) != len)
+		goto out;
+	for (s = sh; s < sh + e->eh.e_shnum; s++)
+		if (s->sh_type == SHT_SYMTAB && s->sh_link < e->eh.e_shnum)
+			break;
+	if (s == sh + e->eh.e_shnum) {
+		ret = 0;
+		goto out;
+	}
+	str = &sh[s->sh_link];
+
+	n = s->sh_size / sizeof(Elf32_Sym);
+	syms = (Elf32_Sym*)malloc(s->sh_size);
+	st->strtab = (char*)malloc(str->sh_size + 1);
+	st->syms = (struct sym*)malloc(n * sizeof(struct sym));
+	if (!syms || !st->strtab || !st->syms ||
+	    pread(e->fd, syms, s->sh_size, s->sh_offset) != s->sh_size ||
+	    pread(e->fd, st->strtab, str->sh_size, str->sh_offset) != str->sh_size)
+		goto out;
+	st->strtab[str->sh_size] = 0;
+
+	for (i = 0; i < n; i++) {
+		y = &syms[i];
+		if (y->st_shndx == SHN_UNDEF || y->st_shndx >= SHN_LORESERVE ||
+		    y->st_name >= str->sh_size)
+			continue;
+		switch (ELF32_ST_TYPE(y->st_info)) {
+		case STT_FUNC:
+		case STT_OBJECT:
+		case STT_NOTYPE:
+			break;
+		default:
+			continue;
+		}
+		/* skip empty names, mapping symbols and local labels */
+		if (!st->strtab[y->st_name] || st->strtab[y->st_name] == '$' ||
+		    st->strtab[y->st_name] == '.')
+			continue;
+		st->syms[st->n].addr = y->st_value;
+		st->syms[st->n].size = y->st_size;
+		st->syms[st->n].name = st->strtab + y->st_name;
+		st->n++;
+	}
+	qsort(st->syms, st->n, sizeof(struct sym), sym_cmp);
+	ret = st->n;
+
+out:
+	free(sh);
+	free(syms);
+	if (ret < 0) {
+		free(st->syms);
+		free(st->strtab);
+		memset(st, 0, sizeof(*st));
+	}
+	return ret;
+}
+
+void elf_close(struct elf *e)
+{
+	if (e->fd >= 0)
+		close(e->fd);
+	free(e->ph);
+	e->fd = -1;
+	e->ph = NULL;
+}
+
+/* by name, NULL if there is none */
+const struct sym *sym_find(const struct symtab *st, const char *name)
+{
+	int i;
+
+	for (i = 0; i < st->n; i++)
+		if (!strcmp(st->syms[i].name, name))
+			return &st->syms[i];
+	return NULL;
+}
+
+/* the symbol at or before addr, NULL if there is none */
+const struct sym *sym_lookup(const struct symtab *st, uint32_t addr)
+{
+	int lo = 0, hi = st->n - 1, mid;
+	const struct sym *s = NULL;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (st->syms[mid].addr <= addr) {
+			s = &st->syms[mid];
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return s;
+}
+
+int bin_size(const char *path, uint32_t *size)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) < 0 || sb.st_size > UINT32_MAX)
+		return -1;
+	*size = sb.st_size;
+	return 0;
+}
+
+/* raw image at addr */
+int bin_load(const char *path, struct mem *m, uint32_t addr)
+{
+	struct mem_region *r;
+	uint32_t size;
+	FILE *h;
+	int ret = 0;
+
+	if (bin_size(path, &size) < 0)
+		return -1;
+	r = mem_find(m, addr, size);
+	if (!r || r->type == MEM_IO) {
+		fprintf(stderr, "%s doesn't fit into ram at 0x%x\n", path, addr);
+		return -1;
+	}
+	h = fopen(path, "rb");
+	if (!h)
+		return -1;
+	if (fread(r->host + (addr - r->base), 1, size, h) != size)
+		ret = -1;
+	fclose(h);
+	return ret;
+}
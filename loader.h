@@ -0,0 +1,50 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdint.h>
+#include <elf.h>
+
+#include "mem.h"
+
+/*
+	guest image loading
+
+	elf_open reads the headers so the caller can size ram around the
+	image, elf_map then maps PT_LOAD segments into it. segments whose
+	file offset and address agree modulo the page size are mmap()ed
+	privately from the file and fault in lazily, bss stays anonymous
+	zero pages. anything else is copied. segments without PF_W become
+	rom regions.
+*/
+
+struct elf {
+	int fd;
+	Elf32_Ehdr eh;
+	Elf32_Phdr *ph;
+	uint32_t lo, hi;	/* address span of the loadable segments */
+};
+
+struct sym {
+	uint32_t addr;
+	uint32_t size;
+	const char *name;
+};
+
+/* function and object symbols sorted by address */
+struct symtab {
+	struct sym *syms;
+	int n;
+	char *strtab;
+};
+
+int is_elf(const char *path);
+int elf_open(struct elf *e, const char *path);
+int elf_map(struct elf *e, struct mem *m);
+int elf_symbols(struct elf *e, struct symtab *st);
+void elf_close(struct elf *e);
+int bin_load(const char *path, struct mem *m, uint32_t addr);
+int bin_size(const char *path, uint32_t *size);
+const struct sym *sym_lookup(const struct symtab *st, uint32_t addr);
+const struct sym *sym_find(const struct symtab *st, const char *name);
+
+#endif
@@ -3,6 +3,20 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "cpu.h"
+#include "loader.h"
+#include "trace.h"
+#include "emu.h"
+#include "batch.h"
+#include "fuzz.h"
+#include "translate.h"
+#include "simpoint.h"
+#include "uart.h"
 
 void hexdump(uint32_t addr, uint8_t *data, uint32_t len)
 {
@@ -25,643 +39,474 @@ void hexdump(uint32_t addr, uint8_t *data, uint32_t len)
 	}
 }
 
-int32_t is_compressed(uint16_t c)
+/* size with an optional K, M or G suffix, 0 if it doesn't parse */
+uint32_t parse_size(const char *s)
 {
-	if ((c & 0x3) == 0x3) return 0;
-	return 1;
-}
-/*
-	risc-v registers
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
 
-	- 32 general purpose registers x0 - x31
+	if (*end == 'k' || *end == 'K')
+		v <<= 10, end++;
+	else if (*end == 'm' || *end == 'M')
+		v <<= 20, end++;
+	else if (*end == 'g' || *end == 'G')
+		v <<= 30, end++;
+	if (*end || v > UINT32_MAX)
+		return 0;
+	return v;
+}
 
-	#    | compressed enc. |  ABI name | saved by calle_ | desc. 
-	-----|-----------------|-----------|-----------------|--------------------
-	x0   |     -           |   "zero"  |   -             |   hardwired zero
-	x1   |     -           |   "ra  "  |   R             |   return address
-	x2   |     -           |   "sp"    |   E             |   stack pointer
-	x3   |     -           |   "gp"    |   -             |   global pointer
-	x4   |     -           |   "tp"    |   -             |   thread pointer
-	x5   |     -           |   "t0"    |   R             |   temp register 0
-	x6   |     -           |   "t1"    |   R             |   temp register 1
-	x7   |     -           |   "t2"    |   R             |   temp register 2
-	x8   |     0           |   "s0/fp" |   E             |   saved reg 0 / frame pointer
-	x9   |     1           |   "s1"    |   E             |   saved reg 1
-	x10  |     2           |   "a0"    |   R             |   argument 0 / ret value 0
-	x11  |     3           |   "a1"    |   R             |   argument 1 / ret value 1
-	x12  |     4           |   "a2"    |   R             |   argument 2
-	x13  |     5           |   "a3"    |   R             |   argument 3 
-	x14  |     6           |   "a4"    |   R             |   argument 4 
-	x15  |     7           |   "a5"    |   R             |   argument 5 
-	x16  |     -           |   "a6"    |   R             |   argument 6 
-	x17  |     -           |   "a7"    |   R             |   argument 7 
-	x18  |     -           |   "s2"    |   E             |   saved reg 2 
-	x19  |     -           |   "s3"    |   E             |   saved reg 3 
-	x20  |     -           |   "s4"    |   E             |   saved reg 4 
-	x21  |     -           |   "s5"    |   E             |   saved reg 5 
-	x22  |     -           |   "s6"    |   E             |   saved reg 6 
-	x23  |     -           |   "s7"    |   E             |   saved reg 7 
-	x24  |     -           |   "s8"    |   E             |   saved reg 8 
-	x25  |     -           |   "s9"    |   E             |   saved reg 9 
-	x26  |     -           |   "s10"   |   E             |   saved reg 10 
-	x27  |     -           |   "s11"   |   E             |   saved reg 11 
-	x28  |     -           |   "t3"    |   R             |   temp register 3 
-	x29  |     -           |   "t4"    |   R             |   temp register 4 
-	x30  |     -           |   "t5"    |   R             |   temp register 5 
-	x31  |     -           |   "t6"    |   R             |   temp register 6 
-	
-*/
+/* run up to at, either an instruction count or pc=<addr>, and save */
+int take_snapshot(struct emu *e, const char *path, const char *at, uint64_t max)
+{
+	uint64_t n;
+	int ret;
 
-struct cpu_state{
-	uint32_t regs[32];
-	uint32_t pc;
-	uint8_t *ram;
-};
+	if (!strncmp(at, "pc=", 3))
+		ret = emu_run_to(e, strtoul(at + 3, NULL, 0), max);
+	else if ((n = strtoull(at, NULL, 0)) == 0)
+		ret = EMU_BUDGET;
+	else if (n < max)
+		ret = emu_run(e, n);
+	else
+		return EMU_BUDGET;	/* never gets there */
+	if (ret == EMU_AT_PC || (ret == EMU_BUDGET && strncmp(at, "pc=", 3))) {
+		if (emu_snapshot(e, path) < 0)
+			return EMU_ERROR;
+		printf("snapshot at pc 0x%x after %llu instructions\n", emu_get_pc(e),
+			(unsigned long long)emu_icount(e));
+		return EMU_BUDGET;
+	}
+	if (ret == EMU_BUDGET)
+		printf("pc %s not reached, no snapshot\n", at + 3);
+	return ret;
+}
 
-uint32_t read_word(uint32_t addr, struct cpu_state *cs)
+/* a delta every n instructions, numbered on from the snapshot path.0 */
+int run_checkpoints(struct emu *e, const char *path, uint64_t every, uint64_t max)
 {
-	uint32_t w;
+	char name[PATH_MAX];
+	uint64_t start = emu_icount(e), done;
+	int k = 1, ret = EMU_BUDGET;
 
-	if (addr & 0xc0000000) { /* UART registers */
-		printf("read from 0x%x\n", addr);
-		return 0;
+	while (ret == EMU_BUDGET && (done = emu_icount(e) - start) < max) {
+		ret = emu_run(e, every < max - done ? every : max - done);
+		snprintf(name, sizeof(name), "%s.%d", path, k++);
+		if (emu_delta(e, name) < 0)
+			return EMU_ERROR;
 	}
-	w = cs->ram[addr & 0xfffffffc];
-	w |= cs->ram[(addr & 0xfffffffc) + 1] << 8;
-	w |= cs->ram[(addr & 0xfffffffc) + 2] << 16;
-	w |= cs->ram[(addr & 0xfffffffc) + 3] << 24;
-
-	return w;
+	return ret;
 }
 
-void write_word(uint32_t addr, uint32_t data, struct cpu_state *cs)
+/* snapshot plus deltas into one snapshot */
+int collapse(const char *out, int n, char **files)
 {
-	if (addr & 0xc0000000) { /* UART registers */
-		printf("write 0x%x to 0x%x\n", data, addr);
-		return;
-	}
-	if (addr > 65532) {
-		printf("addr = 0x%x, data = 0x%x\n", addr, data);
-		while(1);
-	}
-	cs->ram[addr & 0xfffffffc] = (data >> 0) & 0xff;
-	cs->ram[(addr & 0xfffffffc) + 1] = (data >> 8) & 0xff;
-	cs->ram[(addr & 0xfffffffc) + 2] = (data >> 16) & 0xff;
-	cs->ram[(addr & 0xfffffffc) + 3] = (data >> 24) & 0xff;
+	struct emu_config cfg;
+	struct emu *e;
+	int i, ret = 1;
 
+	memset(&cfg, 0, sizeof(cfg));
+	e = emu_create(&cfg);
+	if (!e)
+		return 1;
+	if (n < 1 || emu_restore(e, files[0]) < 0)
+		goto out;
+	for (i = 1; i < n; i++)
+		if (emu_apply_delta(e, files[i]) < 0)
+			goto out;
+	if (emu_snapshot(e, out) < 0)
+		goto out;
+	printf("%s: pc 0x%x after %llu instructions\n", out, emu_get_pc(e),
+		(unsigned long long)emu_icount(e));
+	ret = 0;
+out:
+	emu_destroy(e);
+	return ret;
 }
 
+void usage(FILE *f, char *name)
+{
+	fprintf(f, "usage: %s [options] <.elf or .bin> [guest arguments with --syscalls]\n", name);
+	fprintf(f, "       %s --decode-trace <file> [.elf for symbols]\n", name);
+	fprintf(f, "       %s --collapse <out> <snapshot> <delta>...\n", name);
+	fprintf(f, "       %s --batch <manifest> [--jobs <n>] [options]\n", name);
+	fprintf(f, "       %s --fuzz-buf <a>:<n> [options] <.elf or .bin> [input]...\n", name);
+	fprintf(f, "       %s --translate <.elf or .bin> [-o <file.c>] [options]\n", name);
+	fprintf(f, "       %s --simpoint <n> --snapshot <prefix> [options] <.elf or .bin>\n", name);
+	fprintf(f, "  -h, --help           print this to stdout\n");
+	fprintf(f, "  -j, --jit            translate basic blocks to host code\n");
+	fprintf(f, "  --aot <module.so>    run the image's code built from --translate output\n");
+	fprintf(f, "  -n, --max-insns <n>  stop after about n instructions\n");
+	fprintf(f, "  -m, --ram-size <n>   guest ram in bytes, K/M/G suffixes work\n");
+	fprintf(f, "  -g, --guard-mem      map the whole guest address space, no bounds checks\n");
+	fprintf(f, "  -l, --load-addr <a>  load and start a .bin at a, default 0\n");
+	fprintf(f, "  -t, --trace <file>   record executed instructions\n");
+	fprintf(f, "  --profile <file>     write hot blocks, functions, branches and pages to\n");
+	fprintf(f, "                       file, call stacks to file.folded\n");
+	fprintf(f, "  --timing <file>      simulate l1 caches and a branch predictor, write\n");
+	fprintf(f, "                       miss rates and estimated cycles to file\n");
+	fprintf(f, "  --timing-config <s>  ... their geometry, e.g. i=32K:4:64,d=32K:8:64,bp=gshare:14\n");
+	fprintf(f, "  --syscalls           ecall is a newlib syscall on host files, see syscalls.h\n");
+	fprintf(f, "  --harts <n>          run n harts on threads of their own, hartid in a0\n");
+	fprintf(f, "  --tick <n>           instructions per tick of the clint's mtime, default 1\n");
+	fprintf(f, "  --snapshot <file>    save the guest to file, see --snapshot-at\n");
+	fprintf(f, "  --snapshot-at <n>    ... after about n instructions, or pc=<addr>\n");
+	fprintf(f, "  --restore <file>     start from a snapshot instead of an image\n");
+	fprintf(f, "  --checkpoint-every <n>  snapshot to file.0, then a delta of the\n");
+	fprintf(f, "                       dirtied pages every n instructions to file.1, ...\n");
+	fprintf(f, "  --batch <manifest>   run every image listed in manifest, one result line each\n");
+	fprintf(f, "  --jobs <n>           worker threads for --batch and --simpoint, default one per cpu\n");
+	fprintf(f, "  --fuzz-buf <a>:<n>   copy each input to n bytes at a and run it, see fuzz.h\n");
+	fprintf(f, "  --fuzz-len <r>       ... its length to register r, x<n> or a<n>, or to an address\n");
+	fprintf(f, "  --fuzz-start pc=<a>  ... from a checkpoint taken once the guest gets to a\n");
+	fprintf(f, "  --simpoint <n>       cluster intervals of n instructions and run one of each\n");
+	fprintf(f, "                       kind under the timing model, see simpoint.h\n");
+	fprintf(f, "  --simpoint-k <n>     ... into at most n clusters, default %d\n", SP_MAX_K);
+	fprintf(f, "  --simpoint-warmup <n>  ... after n instructions that warm up the model\n");
+	fprintf(f, "  --translate <image>  write the image's code as C, see translate.h\n");
+	fprintf(f, "  -o, --output <file>  ... to file instead of stdout\n");
+	fprintf(f, "  --decode-trace <file>  print a recorded trace\n");
+}
 
-void decode_compressed_cmd(uint16_t cmd, struct cpu_state *cs)
+int main(int argc, char *argv[])
 {
-	uint32_t rd;
-	uint32_t rs1, rs2;
-	int32_t imm;
+	int c;
+	int ret;
+	char *decode = NULL;
+	char *snapshot = NULL;
+	char *snapshot_at = "0";
+	char *restore = NULL;
+	char *collapse_to = NULL;
+	char *batch = NULL;
+	char *profile = NULL;
+	char *timing = NULL;
+	char *timing_spec = "";
+	char *translate_from = NULL;
+	char *output = NULL;
+	int jobs = 0, status;
+	char base[PATH_MAX];
+	uint64_t every = 0;
+	uint64_t start;
+	uint32_t load_addr = 0;
+	uint64_t max_insns = UINT64_MAX;
+	struct elf elf;
+	struct symtab syms;
+	struct emu_config cfg;
+	struct fuzz_config fuzz;
+	struct simpoint_config simpoint;
+	struct emu *e;
+	struct uart *uart;
+	struct timespec t0, t1;
+	struct rusage ru;
+	double secs;
+	struct option opts[] = {
+		{ "jit", no_argument, NULL, 'j' },
+		{ "max-insns", required_argument, NULL, 'n' },
+		{ "ram-size", required_argument, NULL, 'm' },
+		{ "guard-mem", no_argument, NULL, 'g' },
+		{ "load-addr", required_argument, NULL, 'l' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "decode-trace", required_argument, NULL, 'D' },
+		{ "snapshot", required_argument, NULL, 'S' },
+		{ "snapshot-at", required_argument, NULL, 'A' },
+		{ "restore", required_argument, NULL, 'R' },
+		{ "checkpoint-every", required_argument, NULL, 'C' },
+		{ "collapse", required_argument, NULL, 'O' },
+		{ "harts", required_argument, NULL, 'H' },
+		{ "batch", required_argument, NULL, 'B' },
+		{ "profile", required_argument, NULL, 'P' },
+		{ "jobs", required_argument, NULL, 'J' },
+		{ "tick", required_argument, NULL, 'T' },
+		{ "fuzz-buf", required_argument, NULL, 'F' },
+		{ "fuzz-len", required_argument, NULL, 'L' },
+		{ "fuzz-start", required_argument, NULL, 'Z' },
+		{ "translate", required_argument, NULL, 'X' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "aot", required_argument, NULL, 'a' },
+		{ "timing", required_argument, NULL, 'U' },
+		{ "timing-config", required_argument, NULL, 'V' },
+		{ "syscalls", no_argument, NULL, 'Y' },
+		{ "simpoint", required_argument, NULL, 'I' },
+		{ "simpoint-k", required_argument, NULL, 'K' },
+		{ "simpoint-warmup", required_argument, NULL, 'W' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
 
-	if (cs->regs[0] != 0) {
-		printf("*** zero overwritten\n");
-		cs->regs[0] = 0;
-	}
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ram_size = RAM_SIZE;
+	memset(&fuzz, 0, sizeof(fuzz));
+	memset(&simpoint, 0, sizeof(simpoint));
 
-	/* ADDI */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x0) {
-		rd = (cmd >> 7) & 0x1f;
-		imm = (cmd >> 2) & 0x1f;
-		if (imm & (1 << 4)) imm |= 0xfffffff0;
-		printf("addi x%d, x%d, %d\n", rd, rd, imm);
-		cs->regs[rd] += imm;
-		goto exit1;
-	}
-	/* ANDI */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x4 && ((cmd >> 10) & 0x3) == 2) {
-		rd = 8 + ((cmd >> 7) & 0x7);
-		imm = (cmd >> 2) & 0x1f;
-		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
-		if (imm & (1 << 4)) imm |= 0xfffffff0;
-		printf("andi x%d, x%d, %d\n", rd, rd, imm);
-		cs->regs[rd] = cs->regs[rd] & imm;
-		goto exit1;
-	}
-	/* ADDI16SP */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x3) {
-		rd = ((cmd >> 7) & 0x1f);
-		if (rd == 0 || rd == 2) {
-			imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
-			imm |= (cmd & (1 << 3)) ? (1 << 7) : 0;
-			imm |= (cmd & (1 << 4)) ? (1 << 8) : 0;
-			imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
-			imm |= (cmd & (1 << 6)) ? (1 << 4) : 0;
-			imm |= (cmd & (1 << 12)) ? (1 << 9) : 0;
-			if (imm & (1 << 9)) imm |= 0xfffffc00;
-			printf("addi sp, sp, %d\n", imm);
-			cs->regs[2] += imm;
-			goto exit1;
-		}
-	}
-	/* ADDI14SPN */
-	if ((cmd & 0x03) == 0x00 && ((cmd >> 13) & 0x07) == 0x0) {
-		rd = 8 + ((cmd >> 2) & 0x7);
-		imm = ((cmd >> 7) & 0xf) << 6;
-		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 2) : 0;
-		if (imm & (1 << 9)) imm |= 0xfffffc00;
-		printf("addi x%d, sp, %d\n", rd, imm);
-		cs->regs[rd] += cs->regs[2] + imm;
-		goto exit1;
-	}
-	/* MV */
-	if ((cmd & 0x03) == 0x02 && ((cmd >> 12) & 0x0f) == 0x8) {
-		rd = (cmd >> 7) & 0x1f;
-		rs2 = (cmd >> 2) & 0x1f;
-		if (rd != 0 && rs2 != 0) {
-			printf("mv x%d, x%d\n", rd, rs2);
-			cs->regs[rd] = cs->regs[rs2];
-			goto exit1;
-		}
-	}
-	/* ADD */
-	if ((cmd & 0x03) == 0x02 && ((cmd >> 12) & 0x0f) == 0x9) {
-		rd = (cmd >> 7) & 0x1f;
-		rs2 = (cmd >> 2) & 0x1f;
-		if (rd != 0 && rs2 != 0) {
-			printf("add x%d, x%d\n", rd, rs2);
-			cs->regs[rd] += cs->regs[rs2];
-			goto exit1;
-		}
-	}
-	/* J */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x5) {
-		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
-		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
-		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 6) : 0;
-		imm |= (cmd & (1 << 8)) ? (1 << 10) : 0;
-		imm |= (cmd & (1 << 9)) ? (1 << 8) : 0;
-		imm |= (cmd & (1 << 10)) ? (1 << 9) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 12)) ? (1 << 11) : 0;
-		//imm = (cmd >> 2) & 0x7ff;
-		if (imm & (1 << 11)) imm |= 0xfffff000;
-		printf("J 0x%x (imm = %d)\n", cs->pc + imm, imm);
-		cs->pc += imm;
-		goto exit2;
-	}
-	/* JALR (RET  = jalr x0, x1, 0) */
-	if ((cmd & 0x03) == 0x02 && ((cmd >> 12) & 0x0f) == 0x8) {
-		rs1 = (cmd >> 7) & 0x1f;
-		rs2 = (cmd >> 2) & 0x1f;
-		if (rs2 == 0) {
-			printf("ret  (0x%x)\n", cs->regs[rs1]);
-			cs->pc = cs->regs[rs1];
-			goto exit2;
-		}
-	}
-	/* JAL */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x1) {
-		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
-		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
-		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 6) : 0;
-		imm |= (cmd & (1 << 8)) ? (1 << 10) : 0;
-		imm |= (cmd & (1 << 9)) ? (1 << 8) : 0;
-		imm |= (cmd & (1 << 10)) ? (1 << 9) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 12)) ? (1 << 11) : 0;
-		if (imm & (1 << 11)) imm |= 0xfffff800;
-		cs->regs[1] = cs->pc + 2;		
-		cs->pc += imm;
-		printf("jal, imm = %d\n", imm);
-		goto exit2;
-	}
-	/* BEQZ */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x6) {
-		rs2 = 8 + ((cmd >> 7) & 0x7);
-		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
-		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
-		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
-		imm |= (cmd & (1 << 10)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 12)) ? (1 << 8) : 0;
-		if (imm & (1 << 8)) imm |= 0xfffffe00;
-		printf("beqz x%d (%d), 0x%x (imm = %d)\n", rs2, cs->regs[rs2], cs->pc + imm, imm);
-		if (cs->regs[rs2] == 0) {
-			cs->pc += imm;
-			goto exit2;
-		}
-		goto exit1;
-	}
-	/* BNEZ */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x7) {
-		rs1 = 8 + ((cmd >> 7) & 0x7);
-		imm = (cmd & (1 << 2)) ? (1 << 5) : 0;
-		imm |= (cmd & (1 << 3)) ? (1 << 1) : 0;
-		imm |= (cmd & (1 << 4)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 7) : 0;
-		imm |= (cmd & (1 << 10)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 12)) ? (1 << 8) : 0;
-		if (imm & (1 << 8)) imm |= 0xfffff800;
-		//printf("imm = %d\n", imm);
-		printf("bnez %d, 0x%x (imm = %d)\n", cs->pc + imm, imm);
-		if (cs->regs[rs1] != 0) {
-			cs->pc += imm;
-			goto exit2;
+	while ((c = getopt_long(argc, argv, "hjn:m:gl:t:o:", opts, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			usage(stdout, argv[0]);
+			return 0;
+		case 'j':
+			cfg.jit = 1;
+			break;
+		case 'n':
+			max_insns = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			cfg.ram_size = parse_size(optarg);
+			if (cfg.ram_size < 4096 || cfg.ram_size & 0xfff) {
+				fprintf(stderr, "--ram-size must be a multiple of 4K\n");
+				return 1;
+			}
+			break;
+		case 'g':
+			cfg.guard = 1;
+			break;
+		case 'l':
+			load_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg.trace = optarg;
+			break;
+		case 'D':
+			decode = optarg;
+			break;
+		case 'S':
+			snapshot = optarg;
+			break;
+		case 'A':
+			snapshot_at = optarg;
+			break;
+		case 'R':
+			restore = optarg;
+			break;
+		case 'C':
+			every = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			collapse_to = optarg;
+			break;
+		case 'H':
+			cfg.harts = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			batch = optarg;
+			break;
+		case 'P':
+			profile = optarg;
+			cfg.profile = 1;
+			break;
+		case 'J':
+			jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.tick = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			if (fuzz_parse_buf(&fuzz, optarg) < 0) {
+				fprintf(stderr, "--fuzz-buf takes <addr>:<size>\n");
+				return 1;
+			}
+			break;
+		case 'L':
+			if (fuzz_parse_len(&fuzz, optarg) < 0) {
+				fprintf(stderr, "--fuzz-len takes a register or an address\n");
+				return 1;
+			}
+			break;
+		case 'Z':
+			if (fuzz_parse_start(&fuzz, optarg) < 0) {
+				fprintf(stderr, "--fuzz-start takes pc=<addr>\n");
+				return 1;
+			}
+			break;
+		case 'X':
+			translate_from = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'a':
+			cfg.aot = optarg;
+			break;
+		case 'U':
+			timing = optarg;
+			break;
+		case 'V':
+			timing_spec = optarg;
+			break;
+		case 'Y':
+			cfg.syscalls = 1;
+			break;
+		case 'I':
+			simpoint.interval = strtoull(optarg, NULL, 0);
+			if (!simpoint.interval) {
+				fprintf(stderr, "--simpoint takes a number of instructions\n");
+				return 1;
+			}
+			break;
+		case 'K':
+			simpoint.max_k = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			simpoint.warmup = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			goto error;
 		}
-		goto exit1;
-	}
-	/* LI */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x2) {
-		rd = (cmd >> 7) & 0x1f;
-		imm = (cmd >> 2) & 0x1f;
-		if (imm & (1 << 4)) imm |= 0xfffffff0;
-		cs->regs[rd] = imm;
-		printf("li x%d, %d\n", rd, imm);
-		goto exit1;
-	}
-	/* LUI */
-	if ((cmd & 0x03) == 0x01 && ((cmd >> 13) & 0x07) == 0x3) {
-		rd = (cmd >> 7) & 0x1f;
-		imm = ((cmd >> 2) & 0x1f) << 12;
-		imm |= (cmd & (1 << 12)) ? (1 << 17) : 0;
-		if (imm & (1 << 17)) imm |= 0xfffc0000;
-		cs->regs[rd] = imm;
-		printf("lui x%d, %d\n", rd, imm);
-		goto exit1;
 	}
-	/* LW */
-	if ((cmd & 0x03) == 0x00 && ((cmd >> 13) & 0x07) == 0x2) {
-		rd = 8 + ((cmd >> 2) & 0x7);
-		rs1 = 8 + ((cmd >> 7) & 0x7);
-		imm = (cmd & (1 << 5)) ? (1 << 6) : 0;
-		imm |= (cmd & (1 << 6)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 10)) ? (1 << 3) : 0;
-		imm |= (cmd & (1 << 11)) ? (1 << 4) : 0;
-		imm |= (cmd & (1 << 12)) ? (1 << 5) : 0;
-		if (imm & (1 << 6)) imm |= 0xffffffc0;
-		
-		//printf("rd = %d, rs1 = %d (0x%x), imm = %d\n", rd, rs1, cs->regs[rs1], imm);
-		cs->regs[rd] = read_word(cs->regs[rs1] + imm, cs);
-		printf("lw x%d, %d(x%d) (addr = 0x%x)\n", rd, imm, rs1, cs->regs[rs1] + imm);
-		//printf("read 0x%x from addr 0x%x\n", cs->regs[rd], cs->regs[rs1] + imm);
-		goto exit1;
+	if (timing)
+		cfg.timing = timing_spec;
+	/* the image is the guest's argv[0] */
+	if (cfg.syscalls && optind < argc) {
+		cfg.argc = argc - optind;
+		cfg.argv = argv + optind;
 	}
-	/* SW */
-	if ((cmd & 0x03) == 0x00 && ((cmd >> 13) & 0x07) == 0x6) {
-		rs2 = 8 + ((cmd >> 2) & 0x7);
-		rs1 = 8 + ((cmd >> 7) & 0x7);
-		imm = ((cmd >> 10) & 0x7) << 3;
-		imm |= (cmd & (1 << 6)) ? (1 << 2) : 0;
-		imm |= (cmd & (1 << 5)) ? (1 << 6) : 0;
-		if (imm & (1 << 6)) imm |= 0xffffffc0;
-		//printf("store 0x%x to addr 0x%x\n", cs->regs[rs2], cs->regs[rs1] + imm);
-		printf("sw x%d, %d(x%d) (addr = 0x%x)\n", rs2, imm, rs1, cs->regs[rs1] + imm);
-		write_word(cs->regs[rs1] + imm, cs->regs[rs2], cs);
 
-		goto exit1;
-	}
-	/* SWSP */
-	if ((cmd & 0x03) == 0x02 && ((cmd >> 13) & 0x07) == 0x6) {
-		rs1 = (cmd >> 2) & 0x1f;
-		imm = ((cmd >> 7) & 0x3) << 6;
-		imm |= ((cmd >> 9) & 0xf) << 2;
-		cs->ram[cs->regs[2] + imm + 0] = cs->regs[rs1] & 0xff;
-		cs->ram[cs->regs[2] + imm + 1] = (cs->regs[rs1] >> 8) & 0xff;
-		cs->ram[cs->regs[2] + imm + 2] = (cs->regs[rs1] >> 16) & 0xff;
-		cs->ram[cs->regs[2] + imm + 3] = (cs->regs[rs1] >> 24) & 0xff;
-		printf("sw reg %d, %d(sp)\n", rs1, imm);
-		goto exit1;
+	if (decode) {
+		memset(&syms, 0, sizeof(syms));
+		if (optind < argc) {
+			if (elf_open(&elf, argv[optind]) < 0)
+				return 1;
+			elf_symbols(&elf, &syms);
+			elf_close(&elf);
+		}
+		return trace_decode(decode, &syms) < 0;
 	}
-	printf("invalid compressed instruction\n");
-	printf("PC: 0x%x, opcode: 0x%x\n", cs->pc, cmd);
-	printf(" op: %d\n", (cmd & 0x3));
-	printf(" funct3: %d\n", ((cmd >> 13) & 0x7));
-	printf(" funct4: %d\n", ((cmd >> 12) & 0xf));
-	
-	while(1) sleep(1);
 
-exit1:
-	cs->pc += 2;
-	return;
-exit2:
-	return;
-	
-}
+	if (collapse_to)
+		return collapse(collapse_to, argc - optind, argv + optind);
 
-#define OPCODE_LUI   0x37
-#define OPCODE_AUIPC 0x17
-#define OPCODE_ADDI  0x13
-#define OPCODE_B     0x63
-#define OPCODE_JAL   0x6f
-#define OPCODE_SW    0x23
-#define OPCODE_XOR   0x33
-#define OPCODE_ADD   0x33
-#define OPCODE_L     0x03
- 
-//19a50513          	addi	a0,a0,410 # 0x1e0
-
-void decode_cmd(uint32_t cmd, struct cpu_state *cs)
-{
-	uint32_t rd;
-	uint32_t rs1;
-	uint32_t rs2;
-	int32_t imm;
+	if (translate_from)
+		return translate(translate_from, output, &cfg, load_addr) < 0;
 
-	if (cs->regs[0] != 0) {
-		printf("zero overwritten\n");
-		cs->regs[0] = 0;
-	}
-	/* LUI */
-	if ((cmd & 0x7f) == OPCODE_LUI) {
-		rd = (cmd >> 7) & 0x1f;
-		cs->regs[rd] = cmd & 0xfffff000;
-		printf("lui x%d, %d\n", rd, cs->regs[rd]);
-		goto exit1;
-	}
-	/* LBU */
-	if ((cmd & 0x7f) == OPCODE_L && ((cmd >> 12) & 0x7) == 0x4) {
-		imm = (cmd >> 20) & 0xfff;
-		rs1 = (cmd >> 15) & 0x1f;
-		rd = (cmd >> 7) & 0x1f;
-		printf("lbu x%d, %d(x%d) 0x%x\n", rd, imm, rs1, cs->regs[rs1] + imm);
-		cs->regs[rd] = cs->ram[cs->regs[rs1] + imm];;
-		goto exit1;
-	}
-	/* AUIPC */
-	if ((cmd & 0x7f) == OPCODE_AUIPC) {
-		rd = (cmd >> 7) & 0x1f;
-		cs->regs[rd] = cs->pc + (cmd & 0xfffff000);
-		printf("auipc x%d, %d\n", rd, cmd & 0xfffff000);
-		goto exit1;
-	}
-	/* ADDI */
-	if ((cmd & 0x7f) == OPCODE_ADDI && ((cmd >> 12) & 0x7) == 0) {
-		rd = (cmd >> 7) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		imm = (cmd >> 20) & 0xfff;
-		if (imm & (1 << 11)) imm |= 0xfffff000;
-		printf("addi x%d, x%d, %d\n", rd, rs1, imm);
-		cs->regs[rd] = cs->regs[rs1] + imm;
-		printf("result = 0x%x\n", cs->regs[rd]);
-		goto exit1;
-	}
-	/* ANDI */
-	if ((cmd & 0x7f) == OPCODE_ADDI && ((cmd >> 12) & 0x7) == 7) {
-		rd = (cmd >> 7) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		imm = (cmd >> 20) & 0xfff;
-		if (imm & (1 << 11)) imm |= 0xfffff000;
-		printf("andi x%d, x%d, %d\n", rd, rs1, imm);
-		cs->regs[rd] = cs->regs[rs1] & imm;
-		goto exit1;
-	}
-	/* XOR */
-	if ((cmd & 0x7f) == OPCODE_XOR && ((cmd >> 25) & 0x7f) == 0 && ((cmd >> 12) & 0x7) == 4) {
-		rd = (cmd >> 7) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		printf("xor x%d, x%d, x%d\n", rd, rs1, rs2);
-		cs->regs[rd] = cs->regs[rs1] ^ cs->regs[rs2];
-		goto exit1;
-	}
-	/* ADD */
-	if ((cmd & 0x7f) == OPCODE_ADD && ((cmd >> 25) & 0x7f) == 0 && ((cmd >> 12) & 0x7) == 0) {
-		rd = (cmd >> 7) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		printf("add x%d, x%d, x%d\n", rd, rs1, rs2);
-		cs->regs[rd] = cs->regs[rs1] + cs->regs[rs2];
-		goto exit1;
-	}
-	/* SUB */
-	if ((cmd & 0x7f) == OPCODE_ADD && ((cmd >> 25) & 0x7f) == 0x20 && ((cmd >> 12) & 0x7) == 0) {
-		rd = (cmd >> 7) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		cs->regs[rd] = cs->regs[rs1] - cs->regs[rs2];
-		printf("sub x%d, x%d, x%d (res = %d)\n", rd, rs1, rs2, cs->regs[rd]);
-		goto exit1;
-	}
-	/* SW */
-	if ((cmd & 0x7f) == OPCODE_SW && ((cmd >> 12) & 0x7) == 2) {
-		rs2 = (cmd >> 20) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		imm = (cmd >> 7) & 0x1f;
-		imm |= ((cmd >> 25) & 0x7f) << 5;
-		if (imm & (1 << 11)) imm |= 0xfffff000;
-		printf("sw x%d, %d(x%d) (addr = 0x%x)\n", rs2, imm, rs1, cs->regs[rs1] + imm);	
-		write_word(cs->regs[rs1] + imm, cs->regs[rs2], cs);
-		goto exit1;
-	}
-	/* LW */
-	if ((cmd & 0x7f) == OPCODE_L && ((cmd >> 12) & 0x7) == 2) {
-		//rs2 = (cmd >> 20) & 0x1f;
-		rs1 = (cmd >> 15) & 0x1f;
-		rd = (cmd >> 7) & 0x1f;
-		imm = ((cmd >> 20) & 0xfff);
-		if (imm & (1 << 11)) imm |= 0xfffff000;
-		cs->regs[rd] = read_word(cs->regs[rs1] + imm, cs);
-		printf("lw x%d, %d(x%d) (addr = 0x%x)\n", rd, imm, rs1, cs->regs[rs1] + imm);	
-		goto exit1;
-	}
-	/* BNE */
-	if ((cmd & 0x7f) == OPCODE_B && ((cmd >> 12) & 0x7) == 1) {
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		imm = ((cmd >> 8) & 0xf) << 1;
-		imm |= ((cmd >> 24) & 0x3f) << 5;
-		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
-		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
-		if (imm & (1 << 12)) imm |= 0xfffff000;
-		
-		printf("bge x%d, x%d, 0x%x\n", rs1, rs2, cs->pc + imm);
-		
-		if (cs->regs[rs1] != (int32_t)cs->regs[rs2]) {
-			cs->pc += imm;
-			goto exit2;
-		}
-		goto exit1;
-	}
-	/* BGE */
-	if ((cmd & 0x7f) == OPCODE_B && ((cmd >> 12) & 0x7) == 5) {
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		imm = ((cmd >> 25) & 0x3f) << 5;
-		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
-		imm |= ((cmd >> 8) & 0xf) << 1;
-		if (imm & (1 << 12)) imm |= 0xfffff000;
-		
-		//printf("BGE rs1 = %d, rs2 = %d, imm = 0x%x, new 0x%x\n", rs1, rs2, imm,
-		//	cs->pc + imm);
-		printf("bge x%d, x%d, 0x%x\n", rs1, rs2, cs->pc + imm);
-		if (cs->regs[rs1] >= (int32_t)cs->regs[rs2]) {
-			cs->pc += imm;
-			goto exit2;
+	if (batch) {
+		if (cfg.trace || profile || timing || snapshot || restore) {
+			fprintf(stderr, "--batch doesn't go with --trace, --profile, --timing, --snapshot or --restore\n");
+			return 1;
 		}
-		goto exit1;
+		return run_batch(batch, &cfg, max_insns, load_addr, jobs);
 	}
-	/* BGEU */
-	if ((cmd & 0x7f) == OPCODE_B && ((cmd >> 12) & 0x7) == 7) {
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		imm = ((cmd >> 25) & 0x3f) << 5;
-		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
-		imm |= ((cmd >> 8) & 0xf) << 1;
-		if (imm & (1 << 12)) imm |= 0xfffff000;
-		
-		//printf("BGEU rs1 = %d, rs2 = %d, imm = 0x%x, new 0x%x\n", rs1, rs2, imm,
-		//	cs->pc + imm);
-		printf("bgeu x%d, x%d, 0x%x\n", rs1, rs2, cs->pc + imm);
-		if (cs->regs[rs1] >= cs->regs[rs2]) {
-			cs->pc += imm;
-			goto exit2;
+
+	if (simpoint.interval) {
+		if (cfg.trace || profile || timing || every || fuzz.size || cfg.harts > 1) {
+			fprintf(stderr, "--simpoint doesn't go with --trace, --profile, --timing, "
+				"--checkpoint-every, --fuzz-buf or --harts\n");
+			return 1;
 		}
-		goto exit1;
-	}
-	/* BLT */
-	if ((cmd & 0x7f) == OPCODE_B && ((cmd >> 12) & 0x7) == 4) {
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		imm = ((cmd >> 25) & 0x3f) << 5;
-		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
-		imm |= ((cmd >> 8) & 0xf) << 1;
-		if (imm & (1 << 12)) imm |= 0xfffff000;
-		
-		printf("blt x%d, x%d, 0x%x\n", rs1, rs2, cs->pc + imm);
-//		printf("    rs1 = %d (%d), rs2 = %d (%d), imm = 0x%x, new 0x%x\n", 
-//			rs1, cs->regs[rs1], rs2, cs->regs[rs2], imm,
-//			cs->pc + imm);
-//		printf("    if %d < %d jump\n", cs->regs[rs1], cs->regs[rs2]);
-		if ((int32_t)cs->regs[rs1] < (int32_t)cs->regs[rs2]) {
-			cs->pc += imm;
-			goto exit2;
+		if (!snapshot) {
+			fprintf(stderr, "--simpoint needs --snapshot <prefix>\n");
+			return 1;
 		}
-		goto exit1;
+		if (!restore && optind >= argc)
+			goto error;
+		cfg.timing = timing_spec;
+		simpoint.prefix = snapshot;
+		simpoint.jobs = jobs;
+		simpoint.budget = max_insns;
+		simpoint.load_addr = load_addr;
+		return run_simpoint(&cfg, &simpoint, restore ? NULL : argv[optind], restore);
 	}
-	/* BLTU */
-	if ((cmd & 0x7f) == OPCODE_B && ((cmd >> 12) & 0x7) == 6) {
-		rs1 = (cmd >> 15) & 0x1f;
-		rs2 = (cmd >> 20) & 0x1f;
-		imm = ((cmd >> 25) & 0x3f) << 5;
-		imm |= (cmd & (1 << 31)) ? (1 << 12) : 0;
-		imm |= (cmd & (1 << 7)) ? (1 << 11) : 0;
-		imm |= ((cmd >> 8) & 0xf) << 1;
-		if (imm & (1 << 12)) imm |= 0xfffff000;
-		
-		printf("bltu x%d, x%d, 0x%x\n", rs1, rs2, cs->pc + imm);
-//		printf("    rs1 = %d (%u), rs2 = %d (%u), imm = 0x%x, new 0x%x\n", 
-//			rs1, cs->regs[rs1], rs2, cs->regs[rs2], imm,
-//			cs->pc + imm);
-//		printf("    if %d < %d jump\n", cs->regs[rs1], cs->regs[rs2]);
-		if (cs->regs[rs1] < cs->regs[rs2]) {
-			cs->pc += imm;
-			goto exit2;
-		}
-		goto exit1;
-	}
-	/* JAL */
-	//if ((cmd & 0x7f) == OPCODE_JAL && ((cmd >> 12) & 0x7) == 5) {
-	if ((cmd & 0x7f) == OPCODE_JAL) {
-		rd = (cmd >> 7) & 0x1f;
-		imm = ((cmd >> 21) & 0x3ff) << 1;
-		imm |= (cmd & (1 << 31)) ? (1 << 20) : 0;
-		imm |= (cmd & (1 << 20)) ? (1 << 11) : 0;
-		imm |= ((cmd >> 12) & 0xff) << 12;
-		if (imm & (1 << 20)) imm |= 0xfff00000;
-		//printf("rd = %d, imm = 0x%x, new 0x%x\n", rd, imm,
-		//	cs->pc + imm);
-		printf("jal x%d, 0x%x\n", rd, cs->pc + imm);
-		cs->regs[rd] = cs->pc + 4;
-		cs->pc += imm;	
-		goto exit2;
-	}
-	printf("invalid instruction\n");
-	while(1) sleep(1);
-
-exit1:
-	cs->pc += 4;
-	return;
-exit2:
-	return;
-}
-
-void decode_loop(struct cpu_state *cs)
-{
-	int ret;
-	uint32_t cmd;
-	uint32_t compressed;
-	uint16_t *p = (uint16_t*)cs->ram;
 
-	while(1) {
-		if (cs->regs[0]) {
-			printf("non-zero x0 value 0x%x\n", cs->regs[0]);
-			break;
-		}
-		if (cs->pc & 0x1) {
-			printf("invalid PC value 0x%x\n", cs->pc);
-			break;
+	if (fuzz.size) {
+		if (cfg.trace || profile || timing || snapshot || cfg.harts > 1) {
+			fprintf(stderr, "--fuzz-buf doesn't go with --trace, --profile, --timing, --snapshot or --harts\n");
+			return 1;
 		}
-		cmd = p[cs->pc / 2];			
-		compressed = is_compressed(cmd);
-		if (!compressed) {
-			cmd |= (p[(cs->pc + 2) / 2]) << 16; 
-			printf("0x%04x: %08x    ", cs->pc, cmd);
-			decode_cmd(cmd, cs);
-		}
-		else {
-			printf("0x%04x: %04x        ", cs->pc, cmd);
-			decode_compressed_cmd(cmd, cs);
-		}
-//		printf("x12 = 0x%x\n", cs->regs[12]);
-//		printf("x13 = 0x%x\n", cs->regs[13]);
-//		printf("x14 = 0x%x\n", cs->regs[14]);
-//		printf("x17 = 0x%x\n", cs->regs[17]);
+		if (!restore && optind >= argc)
+			goto error;
+		fuzz.budget = max_insns == UINT64_MAX ? FUZZ_BUDGET : max_insns;
+		e = fuzz_create(&cfg, &fuzz, restore ? NULL : argv[optind], restore, load_addr);
+		if (!e)
+			return 1;
+		if (!restore)
+			optind++;
+		status = run_fuzz(e, &fuzz, argc - optind, argv + optind);
+		emu_destroy(e);
+		return status;
 	}
-}
 
-int main(int argc, char *argv[])
-{
-	int ret;
-	FILE *h;
-	uint32_t size;
-	uint8_t *buf;
-	struct cpu_state cs;
+	fprintf(stderr, "risc-v emulator\n");
 
-	printf("risc-v emulator\n");
+	if (!restore && optind >= argc) goto error;
 
-	if (argc < 2) goto error;
-	h = fopen(argv[1], "r");
-	if (h == NULL) goto error;
-	fseek(h, 0, SEEK_END);
-	size = ftell(h);
-	fseek(h, 0, SEEK_SET);
-	buf = (uint8_t*)malloc(size);
-	if (!buf) goto error;
-	fread(buf, 1, size, h);
-	fclose(h);
-	
-	memset(&cs, 0, sizeof(struct cpu_state));
-	cs.ram = buf;
+	if (every && !snapshot) {
+		fprintf(stderr, "--checkpoint-every needs --snapshot <file>\n");
+		return 1;
+	}
+	if (cfg.trace && profile) {
+		fprintf(stderr, "tracing and profiling don't go together, --profile ignored\n");
+		profile = NULL;
+	}
+	if (cfg.trace && cfg.jit)
+		fprintf(stderr, "tracing runs in the interpreter, --jit ignored\n");
+	if (profile && cfg.jit)
+		fprintf(stderr, "profiling runs in the interpreter, --jit ignored\n");
+	if ((cfg.trace || profile) && timing) {
+		fprintf(stderr, "--timing doesn't go with --trace or --profile, ignored\n");
+		timing = NULL;
+		cfg.timing = NULL;
+	}
+	if (timing && (cfg.jit || cfg.aot))
+		fprintf(stderr, "timing runs in the interpreter, --jit and --aot ignored\n");
+	if ((cfg.trace || profile) && cfg.aot)
+		fprintf(stderr, "tracing and profiling run in the interpreter, --aot ignored\n");
+	e = emu_create(&cfg);
+	if (!e)
+		return 1;
+	/* with syscalls the guest reads stdin itself */
+	uart = uart_open(cfg.syscalls ? -1 : 0, 1);
+	if (!uart)
+		fprintf(stderr, "can't set up the console\n");
+	if (!uart || emu_add_device(e, "uart", UART_BASE, UART_SIZE, uart_read, uart_write, uart) < 0 ||
+	    (restore ? emu_restore(e, restore) : emu_load(e, argv[optind], load_addr)) < 0) {
+		uart_close(uart);
+		emu_destroy(e);
+		return 1;
+	}
+	start = emu_icount(e);
+	/* the console writes to fd 1 directly */
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = EMU_BUDGET;
+	if (snapshot) {
+		snprintf(base, sizeof(base), every ? "%s.0" : "%s", snapshot);
+		ret = take_snapshot(e, base, snapshot_at, max_insns);
+		if (ret == EMU_BUDGET && emu_icount(e) - start < max_insns)
+			max_insns -= emu_icount(e) - start;
+		else
+			max_insns = 0;
+	}
+	if (ret == EMU_BUDGET && max_insns) {
+		if (every)
+			ret = run_checkpoints(e, snapshot, every, max_insns);
+		else
+			ret = emu_run(e, max_insns);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	uart_close(uart);
 
-	decode_loop(&cs);
+	/* the guest's exit code, else 1 for anything but the budget */
+	status = ret != EMU_BUDGET;
+	if (ret == EMU_EXIT)
+		status = emu_exit_code(e) > 255 ? 255 : emu_exit_code(e);
+	else if (ret == EMU_ECALL || ret == EMU_EBREAK)
+		fprintf(stderr, "%s without a trap handler at pc 0x%x\n",
+			ret == EMU_ECALL ? "ecall" : "ebreak", emu_get_pc(e));
 
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stderr, "%llu instructions in %.3f s, %.1f MIPS, %ld KB max rss\n",
+		(unsigned long long)(emu_icount(e) - start), secs,
+		(emu_icount(e) - start) / secs / 1e6, ru.ru_maxrss);
+	if (profile)
+		emu_profile(e, profile);
+	if (timing)
+		emu_timing(e, timing);
+	emu_destroy(e);
 
-	return 0;
+	return status;
 
 error:
-	printf("usage: %s <.bin>\n", argv[0]);
+	usage(stderr, argv[0]);
 	return 1;
 	
 }
-
@@ -0,0 +1,793 @@
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+void mem_init(struct mem *m)
+{
+	memset(m, 0, sizeof(*m));
+	pthread_mutex_init(&m->io_lock, NULL);
+}
+
+/* device callbacks are not reentrant, harts on other threads wait here */
+static uint32_t io_read(struct mem *m, struct mem_region *r, uint32_t addr, int size)
+{
+	uint32_t v;
+
+	pthread_mutex_lock(&m->io_lock);
+	v = r->read(r->dev, addr - r->base, size);
+	pthread_mutex_unlock(&m->io_lock);
+	return v;
+}
+
+static void io_write(struct mem *m, struct mem_region *r, uint32_t addr, uint32_t data, int size)
+{
+	pthread_mutex_lock(&m->io_lock);
+	r->write(r->dev, addr - r->base, data, size);
+	pthread_mutex_unlock(&m->io_lock);
+}
+
+/* returns the new region for the caller to fill in, NULL if it overlaps.
+   rom has to lie within ram in whole host pages, it shares ram's memory */
+struct mem_region *mem_add(struct mem *m, const char *name, uint32_t base,
+	uint32_t size, int type)
+{
+	struct mem_region *r, *ram = NULL;
+	long pg = sysconf(_SC_PAGESIZE);
+	int i;
+
+	if (!size || m->nregions == MEM_MAX_REGIONS || base + (size - 1) < base)
+		return NULL;
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (type == MEM_ROM && r->type == MEM_RAM && base - r->base < r->size &&
+		    size <= r->size - (base - r->base)) {
+			ram = r;
+			continue;
+		}
+		if (base <= r->base + (r->size - 1) && r->base <= base + (size - 1))
+			return NULL;
+	}
+	if (type == MEM_ROM && (!ram ||
+	    ((uintptr_t)(ram->host + (base - ram->base)) | size) & (pg - 1)))
+		return NULL;
+	r = &m->regions[m->nregions++];
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->base = base;
+	r->size = size;
+	r->type = type;
+	if (type == MEM_ROM) {
+		r->host = ram->host + (base - ram->base);
+	}
+	else if (type != MEM_IO) {
+		/* zero pages on first touch, large ram costs nothing up front */
+		r->host = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (r->host == MAP_FAILED) {
+			m->nregions--;
+			return NULL;
+		}
+	}
+	return r;
+}
+
+/* the region holding all of addr .. addr + len - 1. rom comes after
+   the ram it lies in and is found first */
+struct mem_region *mem_find(struct mem *m, uint32_t addr, uint32_t len)
+{
+	struct mem_region *r;
+	int i;
+
+	for (i = m->nregions - 1; i >= 0; i--) {
+		r = &m->regions[i];
+		if (addr - r->base < r->size && len <= r->size - (addr - r->base))
+			return r;
+	}
+	return NULL;
+}
+
+/* cpu running on this thread, for the fault handler */
+static __thread struct cpu_state *fault_cpu;
+
+/* a store to a rom page of ram, from any of the store paths */
+static void rom_fault(siginfo_t *si, struct cpu_state *cs)
+{
+	uintptr_t off;
+
+	if (!cs || !cs->rom)
+		return;
+	off = (uintptr_t)si->si_addr - (uintptr_t)cs->ram;
+	if (off < cs->ram_size && rom_page(off, cs))
+		mem_fault(cs->ram_base + off, 1, cs);
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+/* ucontext register of each x86 register number */
+static const int greg_map[16] = {
+	REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+	REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+struct host_access {
+	uint64_t ea;		/* effective address */
+	int len;		/* instruction length */
+	int size;
+	int write;
+	int sext;
+	int reg;
+	int high;		/* ah, ch, dh or bh */
+};
+
+static int32_t get32(uint8_t *p)
+{
+	int32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+/*
+	decode the faulting instruction, only the forms the guard accessors
+	and the jit use: mov/movzx/movsx loads into a 32-bit register and
+	mov stores from a register
+*/
+static int decode_host(uint8_t *p, greg_t *gr, struct host_access *a)
+{
+	uint8_t *start = p;
+	int rex = 0, opsize = 4, mod, rm, base, index;
+
+	if (*p == 0x66) {
+		opsize = 2;
+		p++;
+	}
+	if ((*p & 0xf0) == 0x40)
+		rex = *p++;
+	if (rex & 0x8)
+		return -1;
+	a->sext = 0;
+	a->write = 0;
+	switch (*p++) {
+	case 0x8b:
+		if (opsize != 4)
+			return -1;
+		a->size = 4;
+		break;
+	case 0x89:
+		a->write = 1;
+		a->size = opsize;
+		break;
+	case 0x88:
+		a->write = 1;
+		a->size = 1;
+		break;
+	case 0x0f:
+		a->size = (*p & 1) ? 2 : 1;
+		a->sext = (*p & 8) ? 1 : 0;
+		if ((*p & 0xf6) != 0xb6)	/* b6, b7, be, bf */
+			return -1;
+		p++;
+		break;
+	default:
+		return -1;
+	}
+
+	mod = *p >> 6;
+	a->reg = ((*p >> 3) & 7) | ((rex & 0x4) ? 8 : 0);
+	rm = *p++ & 7;
+	a->high = a->write && a->size == 1 && !rex && a->reg >= 4;
+	if (a->high)
+		a->reg -= 4;
+	if (mod == 3 || (mod == 0 && rm == 5))
+		return -1;
+	a->ea = 0;
+	if (rm == 4) {
+		index = ((*p >> 3) & 7) | ((rex & 0x2) ? 8 : 0);
+		base = (*p & 7) | ((rex & 0x1) ? 8 : 0);
+		if (index != 4)
+			a->ea = (uint64_t)gr[greg_map[index]] << (*p >> 6);
+		p++;
+		if ((base & 7) == 5 && mod == 0) {
+			a->ea += get32(p);
+			p += 4;
+		}
+		else {
+			a->ea += gr[greg_map[base]];
+		}
+	}
+	else {
+		a->ea = gr[greg_map[rm | ((rex & 0x1) ? 8 : 0)]];
+	}
+	if (mod == 1) {
+		a->ea += (int8_t)*p;
+		p += 1;
+	}
+	else if (mod == 2) {
+		a->ea += get32(p);
+		p += 4;
+	}
+	a->len = p - start;
+	return 0;
+}
+
+/* stores to rom fault, io accesses are emulated, anything else in
+   the guard area is a guest access fault */
+static void mem_segv(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = (ucontext_t*)ctx;
+	greg_t *gr = uc->uc_mcontext.gregs;
+	struct cpu_state *cs = fault_cpu;
+	struct mem_region *r;
+	struct host_access a;
+	uint32_t addr, v;
+
+	rom_fault(si, cs);
+	if (!cs || !cs->guard_base || (uint8_t*)si->si_addr < cs->guard_base ||
+	    (uint8_t*)si->si_addr >= cs->guard_base + GUARD_SPAN ||
+	    decode_host((uint8_t*)gr[REG_RIP], gr, &a) < 0) {
+		/* not a guest access, crash the usual way */
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+	addr = a.ea - (uint64_t)cs->guard_base;
+	r = mem_find(cs->mem, addr, a.size);
+	if (!r || r->type != MEM_IO)
+		mem_fault(addr, a.write, cs);
+
+	if (a.write) {
+		v = gr[greg_map[a.reg]] >> (a.high ? 8 : 0);
+		if (a.size < 4)
+			v &= (1 << (8 * a.size)) - 1;
+		io_write(cs->mem, r, addr, v, a.size);
+	}
+	else {
+		v = io_read(cs->mem, r, addr, a.size);
+		if (a.size == 1)
+			v = a.sext ? (uint32_t)(int8_t)v : (uint8_t)v;
+		else if (a.size == 2)
+			v = a.sext ? (uint32_t)(int16_t)v : (uint16_t)v;
+		gr[greg_map[a.reg]] = v;	/* 32-bit results zero extend */
+	}
+	gr[REG_RIP] += a.len;
+}
+
+#else
+
+static void mem_segv(int sig, siginfo_t *si, void *ctx)
+{
+	rom_fault(si, fault_cpu);
+	signal(SIGSEGV, SIG_DFL);
+}
+
+#endif
+
+/* faults leave the handler with longjmp, keep SIGSEGV unblocked */
+static int catch_segv(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = mem_segv;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	return sigaction(SIGSEGV, &sa, NULL);
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+/*
+	move the host backed regions into a reservation of the whole 32-bit
+	guest address space, everything else stays PROT_NONE. call before
+	anything is loaded, the regions start out empty again.
+*/
+int mem_guard(struct mem *m)
+{
+	struct mem_region *r;
+	long pg = sysconf(_SC_PAGESIZE);
+	uint8_t *base, *p;
+	int i;
+
+	base = mmap(NULL, GUARD_SPAN, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type != MEM_RAM)
+			continue;
+		if ((r->base | r->size) & (pg - 1))
+			goto fail;
+		p = mmap(base + r->base, r->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		if (p == MAP_FAILED)
+			goto fail;
+	}
+
+	if (catch_segv() < 0)
+		goto fail;
+
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type != MEM_RAM)
+			continue;
+		munmap(r->host, r->size);
+		r->host = base + r->base;
+	}
+	m->guard = base;
+	return 0;
+
+fail:
+	munmap(base, GUARD_SPAN);
+	return -1;
+}
+
+#else
+
+int mem_guard(struct mem *m)
+{
+	return -1;
+}
+
+#endif
+
+static size_t icache_len(struct cpu_state *cs)
+{
+	return (cs->ram_size / 2 + 1) * sizeof(struct insn);
+}
+
+static size_t dirty_words(struct cpu_state *cs)
+{
+	return ((cs->ram_size >> DIRTY_PAGE_SHIFT) + 63) / 64;
+}
+
+/* cache the ram region in cs and set up the icache and the dirty
+   bitmap for it */
+int mem_attach(struct cpu_state *cs, struct mem *m)
+{
+	struct mem_region *r = NULL;
+	int i;
+
+	for (i = 0; i < m->nregions; i++)
+		if (m->regions[i].type == MEM_RAM)
+			r = &m->regions[i];
+	if (!r || r->size < 4 || (r->base | r->size) & 0x1)
+		return -1;
+	/* one spare entry in front, see ram_stored. only the pages
+	   holding code get touched */
+	cs->ram_size = r->size;
+	cs->icache = mmap(NULL, icache_len(cs),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (cs->icache == MAP_FAILED) {
+		cs->icache = NULL;
+		return -1;
+	}
+	cs->icache++;
+	cs->dirty = (uint64_t*)calloc(dirty_words(cs), sizeof(uint64_t));
+	cs->dirty_kept = (uint64_t*)calloc(dirty_words(cs), sizeof(uint64_t));
+	cs->code = (uint64_t*)calloc(dirty_words(cs), sizeof(uint64_t));
+	cs->rom = (uint64_t*)calloc(dirty_words(cs), sizeof(uint64_t));
+	if (!cs->dirty || !cs->dirty_kept || !cs->code || !cs->rom) {
+		munmap(cs->icache - 1, icache_len(cs));
+		free(cs->dirty);
+		free(cs->dirty_kept);
+		free(cs->code);
+		free(cs->rom);
+		cs->icache = NULL;
+		cs->dirty = NULL;
+		cs->dirty_kept = NULL;
+		cs->code = NULL;
+		cs->rom = NULL;
+		return -1;
+	}
+	cs->mem = m;
+	cs->ram = r->host;
+	cs->ram_base = r->base;
+	cs->guard_base = m->guard;
+	mem_bind(cs);
+	return 0;
+}
+
+/* guard mode and rom faults on this thread belong to cs */
+void mem_bind(struct cpu_state *cs)
+{
+	fault_cpu = cs;
+}
+
+static void icache_clear(struct cpu_state *cs)
+{
+	if (cs->icache) {
+		madvise(cs->icache - 1, icache_len(cs), MADV_DONTNEED);
+		memset(cs->dirty, 0, dirty_words(cs) * sizeof(uint64_t));
+		memset(cs->dirty_kept, 0, dirty_words(cs) * sizeof(uint64_t));
+		memset(cs->code, 0, dirty_words(cs) * sizeof(uint64_t));
+	}
+}
+
+/* a snapshot or delta has the dirty pages, the next one starts from
+   none. emu_reset still has to read them back, they are kept */
+void mem_dirty_saved(struct cpu_state *cs)
+{
+	size_t i;
+
+	for (i = 0; i < dirty_words(cs); i++)
+		cs->dirty_kept[i] |= cs->dirty[i];
+	memset(cs->dirty, 0, dirty_words(cs) * sizeof(uint64_t));
+}
+
+/* the current state is the one emu_reset goes back to */
+void mem_dirty_checkpoint(struct cpu_state *cs)
+{
+	memset(cs->dirty, 0, dirty_words(cs) * sizeof(uint64_t));
+	memset(cs->dirty_kept, 0, dirty_words(cs) * sizeof(uint64_t));
+}
+
+/* rom is ram again and leaves the map, loading the image places it
+   again */
+static void rom_drop(struct mem *m, struct cpu_state *cs)
+{
+	struct mem_region *r;
+	int i, n = 0;
+
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type == MEM_ROM)
+			mprotect(r->host, r->size, PROT_READ | PROT_WRITE);
+		else
+			m->regions[n++] = *r;
+	}
+	m->nregions = n;
+	if (cs->rom)
+		memset(cs->rom, 0, dirty_words(cs) * sizeof(uint64_t));
+}
+
+/* back to zero filled regions without rom and an empty icache, files
+   mapped by elf_map revert to their file contents */
+void mem_clear(struct mem *m, struct cpu_state *cs)
+{
+	struct mem_region *r;
+	int i;
+
+	rom_drop(m, cs);
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type == MEM_RAM)
+			madvise(r->host, r->size, MADV_DONTNEED);
+	}
+	icache_clear(cs);
+}
+
+/* like mem_clear, but file mappings are replaced by zero pages too,
+   so the regions can take a different image */
+int mem_zero(struct mem *m, struct cpu_state *cs)
+{
+	struct mem_region *r;
+	int i;
+
+	rom_drop(m, cs);
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type == MEM_RAM && mmap(r->host, r->size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+			return -1;
+	}
+	icache_clear(cs);
+	return 0;
+}
+
+/* the rom regions become read-only to the guest, once the image is
+   in ram */
+int mem_protect(struct mem *m, struct cpu_state *cs)
+{
+	struct mem_region *r;
+	uint32_t p, off;
+	int i, any = 0;
+
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type != MEM_ROM)
+			continue;
+		if (mprotect(r->host, r->size, PROT_READ) < 0)
+			return -1;
+		off = r->base - cs->ram_base;
+		for (p = off; p - off < r->size; p += DIRTY_PAGE_SIZE)
+			cs->rom[p >> (DIRTY_PAGE_SHIFT + 6)] |= 1ULL << ((p >> DIRTY_PAGE_SHIFT) & 63);
+		any = 1;
+	}
+	return any ? catch_segv() : 0;
+}
+
+/* any rom in ram at off .. off + len - 1 */
+int mem_in_rom(struct cpu_state *cs, uint32_t off, uint32_t len)
+{
+	uint32_t p;
+
+	if (!len)
+		return 0;
+	for (p = off >> DIRTY_PAGE_SHIFT; p <= (off + len - 1) >> DIRTY_PAGE_SHIFT; p++)
+		if (rom_page(p << DIRTY_PAGE_SHIFT, cs))
+			return 1;
+	return 0;
+}
+
+/* ram at off got its old contents back: drop what was decoded or
+   translated from it and the dirty bits */
+void mem_clean(struct cpu_state *cs, uint32_t off, uint32_t len)
+{
+	uint32_t p;
+
+	/* the entry in front may be a 32-bit instruction reaching in. pages
+	   nothing was decoded from have nothing in the icache, a reset after
+	   a short run only clears what that run's stores touched */
+	(cs->icache + (off >> 1))[-1].op = OP_NONE;
+	for (p = off; p < off + len; p += DIRTY_PAGE_SIZE) {
+		cs->dirty[p >> (DIRTY_PAGE_SHIFT + 6)] &= ~(1ULL << ((p >> DIRTY_PAGE_SHIFT) & 63));
+		cs->dirty_kept[p >> (DIRTY_PAGE_SHIFT + 6)] &= ~(1ULL << ((p >> DIRTY_PAGE_SHIFT) & 63));
+		if (cs->code[p >> (DIRTY_PAGE_SHIFT + 6)] & (1ULL << ((p >> DIRTY_PAGE_SHIFT) & 63)))
+			memset(cs->icache + (p >> 1), 0, (DIRTY_PAGE_SIZE >> 1) * sizeof(struct insn));
+	}
+	if (cs->jit_pages) {
+		for (p = off; p < off + len; p += JIT_PAGE_SIZE)
+			if (cs->jit_pages[p >> JIT_PAGE_SHIFT])
+				cs->jit_flush = 1;
+	}
+}
+
+/* ram_stored for a store of len bytes at off. the icache is only
+   cleared on pages something was decoded from, a large memset doesn't
+   touch the rest of it */
+void mem_stored(struct cpu_state *cs, uint32_t off, uint32_t len)
+{
+	uint32_t p, end, n;
+
+	if (!len)
+		return;
+	(cs->icache + (off >> 1))[-1].op = OP_NONE;
+	for (p = off; p - off < len; p = end) {
+		end = (p | (DIRTY_PAGE_SIZE - 1)) + 1;
+		n = (end - off < len ? end : off + len) - p;
+		dirty_mark(p, cs);
+		if (cs->code[p >> (DIRTY_PAGE_SHIFT + 6)] & (1ULL << ((p >> DIRTY_PAGE_SHIFT) & 63)))
+			memset(cs->icache + (p >> 1), 0,
+				(((p + n - 1) >> 1) - (p >> 1) + 1) * sizeof(struct insn));
+	}
+	if (cs->jit_pages) {
+		for (p = off & ~(JIT_PAGE_SIZE - 1); p < off + len; p += JIT_PAGE_SIZE)
+			if (cs->jit_pages[p >> JIT_PAGE_SHIFT])
+				cs->jit_flush = 1;
+	}
+}
+
+void mem_detach(struct cpu_state *cs)
+{
+	if (fault_cpu == cs)
+		fault_cpu = NULL;
+	if (cs->icache)
+		munmap(cs->icache - 1, icache_len(cs));
+	free(cs->dirty);
+	free(cs->dirty_kept);
+	free(cs->code);
+	free(cs->rom);
+	cs->icache = NULL;
+	cs->dirty = NULL;
+	cs->dirty_kept = NULL;
+	cs->code = NULL;
+	cs->rom = NULL;
+	cs->mem = NULL;
+}
+
+/* unmap ram and rom, io regions stay in the map */
+void mem_drop(struct mem *m)
+{
+	struct mem_region *r;
+	int i, n = 0;
+
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type == MEM_IO)
+			m->regions[n++] = *r;
+		else if (r->type == MEM_RAM && !m->guard)
+			munmap(r->host, r->size);
+	}
+	m->nregions = n;
+	if (m->guard)
+		munmap(m->guard, GUARD_SPAN);
+	m->guard = NULL;
+}
+
+/* drop the io regions of dev */
+void mem_remove(struct mem *m, void *dev)
+{
+	int i, n = 0;
+
+	for (i = 0; i < m->nregions; i++)
+		if (m->regions[i].type != MEM_IO || m->regions[i].dev != dev)
+			m->regions[n++] = m->regions[i];
+	m->nregions = n;
+}
+
+void mem_free(struct mem *m)
+{
+	struct mem_region *r;
+	int i;
+
+	if (m->guard) {
+		munmap(m->guard, GUARD_SPAN);
+	}
+	else {
+		for (i = 0; i < m->nregions; i++) {
+			r = &m->regions[i];
+			if (r->type == MEM_RAM)
+				munmap(r->host, r->size);
+		}
+	}
+	pthread_mutex_destroy(&m->io_lock);
+	memset(m, 0, sizeof(*m));
+}
+
+/* cs->pc is the faulting instruction. the loops are left either way,
+   run_hart goes on at the guest's trap handler when it has one and
+   else stops the emulator */
+_Noreturn void mem_fault(uint32_t addr, int write, struct cpu_state *cs)
+{
+	if (cs->fault && cpu_trap(cs, write ? CAUSE_STORE_FAULT : CAUSE_LOAD_FAULT, addr))
+		longjmp(*cs->fault, 2);
+	fprintf(stderr, "access fault: %s 0x%x at pc 0x%x\n",
+		write ? "store to" : "load from", addr, cs->pc);
+	if (cs->fault)
+		longjmp(*cs->fault, 1);
+	exit(1);
+}
+
+uint32_t mem_read_slow(uint32_t addr, int size, struct cpu_state *cs)
+{
+	struct mem_region *r = mem_find(cs->mem, addr, size);
+	uint32_t v = 0;
+	int i;
+
+	if (!r)
+		mem_fault(addr, 0, cs);
+	if (r->type == MEM_IO)
+		return io_read(cs->mem, r, addr, size);
+	for (i = 0; i < size; i++)
+		v |= r->host[addr - r->base + i] << (8 * i);
+	return v;
+}
+
+void mem_write_slow(uint32_t addr, uint32_t data, int size, struct cpu_state *cs)
+{
+	struct mem_region *r = mem_find(cs->mem, addr, size);
+	int i;
+
+	if (!r || r->type == MEM_ROM)
+		mem_fault(addr, 1, cs);
+	if (size < 4)
+		data &= (1 << (8 * size)) - 1;
+	if (r->type == MEM_IO) {
+		io_write(cs->mem, r, addr, data, size);
+		return;
+	}
+	for (i = 0; i < size; i++)
+		r->host[addr - r->base + i] = data >> (8 * i);
+}
+
+static uint32_t amo_op(int op, uint32_t old, uint32_t v)
+{
+	switch (op) {
+	case OP_AMOSWAP_W:
+		return v;
+	case OP_AMOADD_W:
+		return old + v;
+	case OP_AMOXOR_W:
+		return old ^ v;
+	case OP_AMOAND_W:
+		return old & v;
+	case OP_AMOOR_W:
+		return old | v;
+	case OP_AMOMIN_W:
+		return (int32_t)old < (int32_t)v ? old : v;
+	case OP_AMOMAX_W:
+		return (int32_t)old > (int32_t)v ? old : v;
+	case OP_AMOMINU_W:
+		return old < v ? old : v;
+	default:
+		return old > v ? old : v;
+	}
+}
+
+/* amos and sc.w outside of ram, only devices take them */
+static struct mem_region *amo_region(uint32_t addr, struct cpu_state *cs)
+{
+	struct mem_region *r = mem_find(cs->mem, addr, 4);
+
+	if (!r || r->type != MEM_IO)
+		mem_fault(addr, 1, cs);
+	return r;
+}
+
+/*
+	amo op of the A extension at addr, returns the old word. ram words
+	change with a host compare and swap, sequentially consistent
+	whatever aq and rl ask for. devices see a read and a write under
+	io_lock. misaligned addresses fault.
+*/
+uint32_t mem_amo(uint32_t addr, uint32_t v, int op, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base, old, new;
+	struct mem_region *r;
+	uint32_t *p;
+
+	if (addr & 3)
+		mem_fault(addr, 1, cs);
+	if (off > cs->ram_size - 4) {
+		r = amo_region(addr, cs);
+		pthread_mutex_lock(&cs->mem->io_lock);
+		old = r->read(r->dev, addr - r->base, 4);
+		r->write(r->dev, addr - r->base, amo_op(op, old, v), 4);
+		pthread_mutex_unlock(&cs->mem->io_lock);
+		return old;
+	}
+	p = (uint32_t*)(cs->ram + off);
+	old = __atomic_load_n(p, __ATOMIC_RELAXED);
+	do
+		new = le32(amo_op(op, le32(old), v));
+	while (!__atomic_compare_exchange_n(p, &old, new, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	ram_stored(off, 4, cs);
+	return le32(old);
+}
+
+/*
+	sc.w as a compare and swap against the word lr.w read, 1 when the
+	store happened. another hart storing the same value in between
+	goes unnoticed, which lr/sc loops don't care about.
+*/
+int mem_sc(uint32_t addr, uint32_t expect, uint32_t v, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base, old;
+	struct mem_region *r;
+	int ok;
+
+	if (off > cs->ram_size - 4) {
+		r = amo_region(addr, cs);
+		pthread_mutex_lock(&cs->mem->io_lock);
+		ok = r->read(r->dev, addr - r->base, 4) == expect;
+		if (ok)
+			r->write(r->dev, addr - r->base, v, 4);
+		pthread_mutex_unlock(&cs->mem->io_lock);
+		return ok;
+	}
+	old = le32(expect);
+	if (!__atomic_compare_exchange_n((uint32_t*)(cs->ram + off), &old, le32(v), 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return 0;
+	ram_stored(off, 4, cs);
+	return 1;
+}
+
+/* out of line versions for callers that can't inline, zero extended */
+uint32_t mem_read(uint32_t addr, int size, struct cpu_state *cs)
+{
+	if (size == 1)
+		return read_byte(addr, cs);
+	if (size == 2)
+		return read_half(addr, cs);
+	return read_word(addr, cs);
+}
+
+void mem_write(uint32_t addr, uint32_t data, int size, struct cpu_state *cs)
+{
+	if (size == 1)
+		write_byte(addr, data, cs);
+	else if (size == 2)
+		write_half(addr, data, cs);
+	else
+		write_word(addr, data, cs);
+}
@@ -0,0 +1,276 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/*
+	guest memory map
+
+	a small table of regions: ram is backed by host memory,
+	io regions forward accesses to device callbacks. the ram region is
+	cached in cpu_state, loads and stores that fall inside it are a
+	bounds check and a single host access. everything else goes through
+	the region table, accesses no region covers stop the emulator with
+	an access fault.
+
+	rom regions are pages of ram the guest can't store to. mem_protect
+	makes them read-only on the host, so the ram fast paths stay as
+	they are and a store there ends in the SIGSEGV handler, which turns
+	it into a store access fault.
+
+	harts share all of it. ram accesses are plain host accesses, so
+	guest memory ordering is the host's, see do_FENCE. device callbacks
+	run under io_lock, one at a time.
+*/
+
+#define MEM_MAX_REGIONS 8
+
+enum {
+	MEM_RAM = 1,
+	MEM_ROM,
+	MEM_IO,
+};
+
+struct mem_region {
+	uint32_t base;
+	uint32_t size;
+	int type;
+	const char *name;
+	uint8_t *host;		/* backing store of ram and rom */
+	uint32_t (*read)(void *dev, uint32_t off, int size);
+	void (*write)(void *dev, uint32_t off, uint32_t data, int size);
+	void *dev;
+};
+
+struct mem {
+	struct mem_region regions[MEM_MAX_REGIONS];
+	int nregions;
+	uint8_t *guard;		/* 4 GiB guest address space, see mem_guard */
+	pthread_mutex_t io_lock;
+};
+
+/* reserved beyond 4 GiB so accesses straddling the top still fault */
+#define GUARD_SPAN (0x100000000ULL + 0x10000)
+
+void mem_init(struct mem *m);
+struct mem_region *mem_add(struct mem *m, const char *name, uint32_t base,
+	uint32_t size, int type);
+struct mem_region *mem_find(struct mem *m, uint32_t addr, uint32_t len);
+int mem_guard(struct mem *m);
+int mem_attach(struct cpu_state *cs, struct mem *m);
+void mem_bind(struct cpu_state *cs);
+void mem_clear(struct mem *m, struct cpu_state *cs);
+int mem_zero(struct mem *m, struct cpu_state *cs);
+void mem_clean(struct cpu_state *cs, uint32_t off, uint32_t len);
+void mem_stored(struct cpu_state *cs, uint32_t off, uint32_t len);
+void mem_dirty_saved(struct cpu_state *cs);
+void mem_dirty_checkpoint(struct cpu_state *cs);
+int mem_protect(struct mem *m, struct cpu_state *cs);
+int mem_in_rom(struct cpu_state *cs, uint32_t off, uint32_t len);
+void mem_detach(struct cpu_state *cs);
+void mem_drop(struct mem *m);
+void mem_remove(struct mem *m, void *dev);
+void mem_free(struct mem *m);
+uint32_t mem_read_slow(uint32_t addr, int size, struct cpu_state *cs);
+void mem_write_slow(uint32_t addr, uint32_t data, int size, struct cpu_state *cs);
+uint32_t mem_read(uint32_t addr, int size, struct cpu_state *cs);
+void mem_write(uint32_t addr, uint32_t data, int size, struct cpu_state *cs);
+uint32_t mem_amo(uint32_t addr, uint32_t v, int op, struct cpu_state *cs);
+int mem_sc(uint32_t addr, uint32_t expect, uint32_t v, struct cpu_state *cs);
+_Noreturn void mem_fault(uint32_t addr, int write, struct cpu_state *cs);
+
+/* guest memory is little endian */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define le16(x) __builtin_bswap16(x)
+#define le32(x) __builtin_bswap32(x)
+#else
+#define le16(x) (x)
+#define le32(x) (x)
+#endif
+
+static inline void dirty_mark(uint32_t off, struct cpu_state *cs)
+{
+	cs->dirty[off >> (DIRTY_PAGE_SHIFT + 6)] |= 1ULL << ((off >> DIRTY_PAGE_SHIFT) & 63);
+}
+
+static inline int rom_page(uint32_t off, struct cpu_state *cs)
+{
+	return (cs->rom[off >> (DIRTY_PAGE_SHIFT + 6)] >> ((off >> DIRTY_PAGE_SHIFT) & 63)) & 1;
+}
+
+/* pages holding decoded instructions, for mem_stored. set before the
+   entry is published, and only once, harts decode concurrently */
+static inline void code_mark(uint32_t off, struct cpu_state *cs)
+{
+	uint64_t *w = &cs->code[off >> (DIRTY_PAGE_SHIFT + 6)];
+	uint64_t bit = 1ULL << ((off >> DIRTY_PAGE_SHIFT) & 63);
+
+	if (!(__atomic_load_n(w, __ATOMIC_RELAXED) & bit))
+		__atomic_fetch_or(w, bit, __ATOMIC_RELAXED);
+}
+
+/* drop predecoded entries and translations overlapping a ram store,
+   mark its pages dirty */
+static inline void ram_stored(uint32_t off, int size, struct cpu_state *cs)
+{
+	uint32_t i = off >> 1, e = (off + size - 1) >> 1;
+
+	dirty_mark(off, cs);
+	if (size > 1)
+		dirty_mark(off + size - 1, cs);
+
+	/* a 32-bit instruction may start in the halfword before,
+	   icache has a spare entry in front of halfword 0 */
+	(cs->icache + i)[-1].op = OP_NONE;
+	do
+		cs->icache[i].op = OP_NONE;
+	while (i++ < e);
+	if (cs->jit_pages && (cs->jit_pages[off >> JIT_PAGE_SHIFT] |
+	    cs->jit_pages[(off + size - 1) >> JIT_PAGE_SHIFT]))
+		cs->jit_flush = 1;
+}
+
+static inline uint32_t read_byte(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+
+	if (off < cs->ram_size)
+		return cs->ram[off];
+	return mem_read_slow(addr, 1, cs);
+}
+
+static inline uint32_t read_half(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint16_t h;
+
+	if (off <= cs->ram_size - 2) {
+		memcpy(&h, cs->ram + off, 2);
+		return le16(h);
+	}
+	return mem_read_slow(addr, 2, cs);
+}
+
+static inline uint32_t read_word(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint32_t w;
+
+	if (off <= cs->ram_size - 4) {
+		memcpy(&w, cs->ram + off, 4);
+		return le32(w);
+	}
+	return mem_read_slow(addr, 4, cs);
+}
+
+static inline void write_byte(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+
+	if (off < cs->ram_size) {
+		cs->ram[off] = data;
+		ram_stored(off, 1, cs);
+		return;
+	}
+	mem_write_slow(addr, data, 1, cs);
+}
+
+static inline void write_half(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint16_t h = le16((uint16_t)data);
+
+	if (off <= cs->ram_size - 2) {
+		memcpy(cs->ram + off, &h, 2);
+		ram_stored(off, 2, cs);
+		return;
+	}
+	mem_write_slow(addr, data, 2, cs);
+}
+
+static inline void write_word(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint32_t w = le32(data);
+
+	if (off <= cs->ram_size - 4) {
+		memcpy(cs->ram + off, &w, 4);
+		ram_stored(off, 4, cs);
+		return;
+	}
+	mem_write_slow(addr, data, 4, cs);
+}
+
+/*
+	guard mode accessors, guest address addr is host address
+	guard_base + addr. io windows and unmapped addresses are PROT_NONE,
+	the SIGSEGV handler in mem.c decodes the faulting mov and emulates
+	it, so the instruction forms here are fixed.
+*/
+#if defined(__x86_64__)
+#define GUARD_LD(insn, p, v) __asm__ volatile(insn " %1, %0" : "=r"(v) : "m"(*(p)))
+#define GUARD_ST(insn, p, v) __asm__ volatile(insn " %1, %0" : "=m"(*(p)) : "r"(v))
+#else
+#define GUARD_LD(insn, p, v) ((v) = *(volatile __typeof__(*(p))*)(p))
+#define GUARD_ST(insn, p, v) (*(volatile __typeof__(*(p))*)(p) = (v))
+#endif
+
+static inline uint32_t guard_read_byte(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t v;
+
+	GUARD_LD("movzbl", cs->guard_base + addr, v);
+	return v;
+}
+
+static inline uint32_t guard_read_half(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t v;
+
+	GUARD_LD("movzwl", (uint16_t*)(cs->guard_base + addr), v);
+	return v;
+}
+
+static inline uint32_t guard_read_word(uint32_t addr, struct cpu_state *cs)
+{
+	uint32_t v;
+
+	GUARD_LD("movl", (uint32_t*)(cs->guard_base + addr), v);
+	return v;
+}
+
+/* only the icache upkeep needs to know whether the store hit ram */
+static inline void guard_write_byte(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint8_t b = data;
+
+	GUARD_ST("movb", cs->guard_base + addr, b);
+	if (off < cs->ram_size)
+		ram_stored(off, 1, cs);
+}
+
+static inline void guard_write_half(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+	uint16_t h = data;
+
+	GUARD_ST("movw", (uint16_t*)(cs->guard_base + addr), h);
+	if (off <= cs->ram_size - 2)
+		ram_stored(off, 2, cs);
+}
+
+static inline void guard_write_word(uint32_t addr, uint32_t data, struct cpu_state *cs)
+{
+	uint32_t off = addr - cs->ram_base;
+
+	GUARD_ST("movl", (uint32_t*)(cs->guard_base + addr), data);
+	if (off <= cs->ram_size - 4)
+		ram_stored(off, 4, cs);
+}
+
+#endif
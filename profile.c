@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "loader.h"
+#include "profile.h"
+
+/* lines per section of the report */
+#define PROF_TOP 20
+/* longest straight line run walked for a block, and deepest stack printed */
+#define PROF_MAX_BLOCK 4096
+#define PROF_MAX_DEPTH 256
+
+struct prof_block {
+	uint32_t pc;
+	uint32_t len;		/* instructions */
+	uint64_t entries;
+	uint64_t insns;
+};
+
+struct prof_site {
+	uint32_t addr;
+	uint64_t a;
+	uint64_t b;
+};
+
+static size_t halfwords_len(struct profile *p)
+{
+	return (size_t)(p->ram_size / 2) * sizeof(uint64_t);
+}
+
+/* counters for the ram of cs, the current pc is the root of the tree */
+struct profile *prof_open(struct cpu_state *cs)
+{
+	struct profile *p;
+	uint8_t *m;
+
+	p = (struct profile*)calloc(1, sizeof(struct profile));
+	if (!p)
+		return NULL;
+	p->ram_base = cs->ram_base;
+	p->ram_size = cs->ram_size;
+	p->npages = (cs->ram_size + (1 << PROF_PAGE_SHIFT) - 1) >> PROF_PAGE_SHIFT;
+	/* zero pages until something runs there, like the icache */
+	m = mmap(NULL, 3 * halfwords_len(p), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		free(p);
+		return NULL;
+	}
+	p->entries = (uint64_t*)m;
+	p->taken = (uint64_t*)(m + halfwords_len(p));
+	p->not_taken = (uint64_t*)(m + 2 * halfwords_len(p));
+	p->loads = (uint64_t*)calloc(p->npages + 1, sizeof(uint64_t));
+	p->stores = (uint64_t*)calloc(p->npages + 1, sizeof(uint64_t));
+	p->maxnodes = 1024;
+	p->nodes = (struct prof_node*)calloc(p->maxnodes, sizeof(struct prof_node));
+	p->hash = (uint32_t*)calloc(PROF_HASH_SIZE, sizeof(uint32_t));
+	if (!p->loads || !p->stores || !p->nodes || !p->hash) {
+		prof_close(p);
+		return NULL;
+	}
+	p->nodes[0].func = cs->pc;
+	p->nnodes = 1;
+	p->start = cs->icount;
+	p->last = cs->icount;
+	return p;
+}
+
+void prof_close(struct profile *p)
+{
+	if (!p)
+		return;
+	munmap(p->entries, 3 * halfwords_len(p));
+	free(p->loads);
+	free(p->stores);
+	free(p->nodes);
+	free(p->hash);
+	free(p);
+}
+
+static uint32_t node_hash(uint32_t parent, uint32_t func)
+{
+	return ((parent * 0x9e3779b1u) ^ (func * 0x85ebca6bu)) >> 16 & (PROF_HASH_SIZE - 1);
+}
+
+/* charge the instructions since the last call or return to cur */
+static void charge(struct profile *p, uint64_t icount)
+{
+	p->nodes[p->cur].insns += icount - p->last;
+	p->last = icount;
+}
+
+void prof_call(struct profile *p, uint32_t target, uint64_t icount)
+{
+	struct prof_node *n;
+	uint32_t h = node_hash(p->cur, target), i;
+
+	charge(p, icount);
+	for (i = p->hash[h]; i; i = p->nodes[i].next) {
+		if (p->nodes[i].parent == p->cur && p->nodes[i].func == target) {
+			p->cur = i;
+			return;
+		}
+	}
+	/* a full tree keeps charging the caller */
+	if (p->nnodes == p->maxnodes) {
+		if (p->maxnodes == PROF_MAX_NODES)
+			return;
+		n = (struct prof_node*)realloc(p->nodes, 2 * p->maxnodes * sizeof(struct prof_node));
+		if (!n)
+			return;
+		p->nodes = n;
+		p->maxnodes *= 2;
+	}
+	i = p->nnodes++;
+	n = &p->nodes[i];
+	n->func = target;
+	n->parent = p->cur;
+	n->insns = 0;
+	n->next = p->hash[h];
+	p->hash[h] = i;
+	p->cur = i;
+}
+
+/* returns past the root, longjmp style unwinding, stay at the root */
+void prof_ret(struct profile *p, uint64_t icount)
+{
+	charge(p, icount);
+	p->cur = p->nodes[p->cur].parent;
+}
+
+/* symbol+offset, or the bare address */
+static void name_of(char *buf, size_t len, const struct symtab *st, uint32_t addr)
+{
+	const struct sym *s = sym_lookup(st, addr);
+
+	if (!s)
+		snprintf(buf, len, "0x%08x", addr);
+	else if (s->addr == addr)
+		snprintf(buf, len, "%s", s->name);
+	else
+		snprintf(buf, len, "%s+0x%x", s->name, addr - s->addr);
+}
+
+/* name_of for the report lines, nothing without symbols */
+static void label(char *buf, size_t len, const struct symtab *st, uint32_t addr)
+{
+	if (st->n)
+		name_of(buf, len, st, addr);
+	else
+		buf[0] = 0;
+}
+
+/* pages of a counter array the run has touched, the rest is all zero */
+static int resident(void *base, size_t len, unsigned char **vec)
+{
+	long pg = sysconf(_SC_PAGESIZE);
+
+	*vec = (unsigned char*)malloc((len + pg - 1) / pg);
+	if (!*vec || mincore(base, len, *vec) < 0) {
+		free(*vec);
+		*vec = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* the system instructions end blocks too, see do_CSRRW */
+static int is_jump(int op)
+{
+	return op == OP_JAL || op == OP_JALR || op == OP_INVALID ||
+		(op >= OP_BEQ && op <= OP_BGEU) || (op >= OP_CSRRW && op <= OP_WFI);
+}
+
+/* instructions from pc up to and including the next jump or branch */
+static uint32_t block_len(struct cpu_state *cs, uint32_t pc)
+{
+	struct insn in;
+	uint32_t n = 0;
+
+	while (n < PROF_MAX_BLOCK && pc - cs->ram_base < cs->ram_size) {
+		decode_insn(&in, pc, cs);
+		n++;
+		if (is_jump(in.op))
+			break;
+		pc += in.len;
+	}
+	return n;
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+	const struct prof_block *x = (const struct prof_block*)a, *y = (const struct prof_block*)b;
+
+	return x->insns < y->insns ? 1 : x->insns > y->insns ? -1 : 0;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const struct prof_site *x = (const struct prof_site*)a, *y = (const struct prof_site*)b;
+
+	return x->a + x->b < y->a + y->b ? 1 : x->a + x->b > y->a + y->b ? -1 : 0;
+}
+
+static double pct(uint64_t n, uint64_t total)
+{
+	return total ? 100.0 * n / total : 0;
+}
+
+static int sym_addr_cmp(const void *a, const void *b)
+{
+	const struct sym *x = (const struct sym*)a, *y = (const struct sym*)b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* without elf symbols the call targets the tree saw stand in for
+   functions, named by their address */
+static int call_targets(struct profile *p, struct symtab *st)
+{
+	uint32_t i, n = 0;
+
+	memset(st, 0, sizeof(*st));
+	st->syms = (struct sym*)malloc(p->nnodes * sizeof(struct sym));
+	st->strtab = (char*)malloc(p->nnodes * 11);
+	if (!st->syms || !st->strtab)
+		return -1;
+	for (i = 0; i < p->nnodes; i++)
+		st->syms[i].addr = p->nodes[i].func;
+	qsort(st->syms, p->nnodes, sizeof(struct sym), sym_addr_cmp);
+	for (i = 0; i < p->nnodes; i++) {
+		if (n && st->syms[n - 1].addr == st->syms[i].addr)
+			continue;
+		st->syms[n].addr = st->syms[i].addr;
+		st->syms[n].size = 0;
+		st->syms[n].name = st->strtab + 11 * n;
+		snprintf(st->strtab + 11 * n, 11, "0x%08x", st->syms[i].addr);
+		n++;
+	}
+	st->n = n;
+	return 0;
+}
+
+/* hot blocks, functions, branches and pages as text */
+int prof_report(struct profile *p, struct cpu_state *cs, const struct symtab *st, FILE *f)
+{
+	struct prof_block *blocks = NULL;
+	struct prof_site *sites = NULL;
+	const struct symtab *funcs = st;
+	struct symtab targets;
+	uint64_t *func = NULL, total = cs->icount - p->start, other = 0;
+	unsigned char *vec = NULL;
+	long pg = sysconf(_SC_PAGESIZE);
+	uint32_t i, nblocks = 0, nsites = 0, cap = 1024;
+	const struct sym *s;
+	char name[128];
+	int ret = -1;
+
+	memset(&targets, 0, sizeof(targets));
+	if (!st->n) {
+		if (call_targets(p, &targets) < 0)
+			goto out;
+		funcs = &targets;
+	}
+
+	/* blocks, weighted by the instructions they ran */
+	resident(p->entries, halfwords_len(p), &vec);
+	blocks = (struct prof_block*)malloc(cap * sizeof(struct prof_block));
+	if (!blocks)
+		goto out;
+	for (i = 0; i < p->ram_size / 2; i++) {
+		if (vec && !(vec[i * sizeof(uint64_t) / pg] & 1))
+			continue;
+		if (!p->entries[i])
+			continue;
+		if (nblocks == cap) {
+			struct prof_block *b = (struct prof_block*)realloc(blocks,
+				2 * cap * sizeof(struct prof_block));
+			if (!b)
+				goto out;
+			blocks = b;
+			cap *= 2;
+		}
+		blocks[nblocks].pc = p->ram_base + 2 * i;
+		blocks[nblocks].entries = p->entries[i];
+		blocks[nblocks].len = block_len(cs, p->ram_base + 2 * i);
+		blocks[nblocks].insns = p->entries[i] * blocks[nblocks].len;
+		nblocks++;
+	}
+	free(vec);
+	vec = NULL;
+	qsort(blocks, nblocks, sizeof(struct prof_block), block_cmp);
+
+	fprintf(f, "%llu instructions, %u blocks, %u call stacks\n\n",
+		(unsigned long long)total, nblocks, p->nnodes);
+	fprintf(f, "hot blocks\n%14s %7s %12s %5s  block\n", "insns", "%", "entries", "len");
+	for (i = 0; i < nblocks && i < PROF_TOP; i++) {
+		label(name, sizeof(name), st, blocks[i].pc);
+		fprintf(f, "%14llu %6.2f%% %12llu %5u  0x%08x %s\n",
+			(unsigned long long)blocks[i].insns, pct(blocks[i].insns, total),
+			(unsigned long long)blocks[i].entries, blocks[i].len, blocks[i].pc, name);
+	}
+
+	/* a block belongs to the function its first instruction is in */
+	func = (uint64_t*)calloc(funcs->n + 1, sizeof(uint64_t));
+	sites = (struct prof_site*)malloc((funcs->n + 1) * sizeof(struct prof_site));
+	if (!func || !sites)
+		goto out;
+	for (i = 0; i < nblocks; i++) {
+		s = sym_lookup(funcs, blocks[i].pc);
+		if (s)
+			func[s - funcs->syms] += blocks[i].insns;
+		else
+			other += blocks[i].insns;
+	}
+	for (i = 0; i < funcs->n; i++) {
+		sites[i].addr = i;
+		sites[i].a = func[i];
+		sites[i].b = 0;
+	}
+	qsort(sites, funcs->n, sizeof(struct prof_site), site_cmp);
+	fprintf(f, "\nhot functions\n%14s %7s  function\n", "insns", "%");
+	for (i = 0; i < funcs->n && i < PROF_TOP && sites[i].a; i++)
+		fprintf(f, "%14llu %6.2f%%  %s\n", (unsigned long long)sites[i].a,
+			pct(sites[i].a, total), funcs->syms[sites[i].addr].name);
+	if (other)
+		fprintf(f, "%14llu %6.2f%%  [no symbol]\n", (unsigned long long)other,
+			pct(other, total));
+	free(sites);
+	sites = NULL;
+
+	/* branch sites, by how often they ran */
+	cap = 1024;
+	sites = (struct prof_site*)malloc(cap * sizeof(struct prof_site));
+	if (!sites)
+		goto out;
+	/* taken and not_taken are next to each other */
+	resident(p->taken, 2 * halfwords_len(p), &vec);
+	for (i = 0; i < p->ram_size / 2; i++) {
+		if (vec && !(vec[i * sizeof(uint64_t) / pg] & 1) &&
+		    !(vec[(halfwords_len(p) + i * sizeof(uint64_t)) / pg] & 1))
+			continue;
+		if (!p->taken[i] && !p->not_taken[i])
+			continue;
+		if (nsites == cap) {
+			struct prof_site *b = (struct prof_site*)realloc(sites,
+				2 * cap * sizeof(struct prof_site));
+			if (!b)
+				goto out;
+			sites = b;
+			cap *= 2;
+		}
+		sites[nsites].addr = p->ram_base + 2 * i;
+		sites[nsites].a = p->taken[i];
+		sites[nsites].b = p->not_taken[i];
+		nsites++;
+	}
+	free(vec);
+	vec = NULL;
+	qsort(sites, nsites, sizeof(struct prof_site), site_cmp);
+	fprintf(f, "\nbranches\n%14s %7s  site\n", "count", "taken");
+	for (i = 0; i < nsites && i < PROF_TOP; i++) {
+		label(name, sizeof(name), st, sites[i].addr);
+		fprintf(f, "%14llu %6.2f%%  0x%08x %s\n",
+			(unsigned long long)(sites[i].a + sites[i].b),
+			pct(sites[i].a, sites[i].a + sites[i].b), sites[i].addr, name);
+	}
+
+	/* loads and stores per page */
+	nsites = 0;
+	for (i = 0; i < p->npages; i++) {
+		if (!p->loads[i] && !p->stores[i])
+			continue;
+		if (nsites == cap) {
+			struct prof_site *b = (struct prof_site*)realloc(sites,
+				2 * cap * sizeof(struct prof_site));
+			if (!b)
+				goto out;
+			sites = b;
+			cap *= 2;
+		}
+		sites[nsites].addr = p->ram_base + (i << PROF_PAGE_SHIFT);
+		sites[nsites].a = p->loads[i];
+		sites[nsites].b = p->stores[i];
+		nsites++;
+	}
+	qsort(sites, nsites, sizeof(struct prof_site), site_cmp);
+	fprintf(f, "\nmemory\n%14s %14s  page\n", "loads", "stores");
+	for (i = 0; i < nsites && i < PROF_TOP; i++)
+		fprintf(f, "%14llu %14llu  0x%08x\n", (unsigned long long)sites[i].a,
+			(unsigned long long)sites[i].b, sites[i].addr);
+	if (p->loads[p->npages] || p->stores[p->npages])
+		fprintf(f, "%14llu %14llu  outside ram\n",
+			(unsigned long long)p->loads[p->npages],
+			(unsigned long long)p->stores[p->npages]);
+	ret = 0;
+
+out:
+	free(vec);
+	free(blocks);
+	free(sites);
+	free(func);
+	free(targets.syms);
+	free(targets.strtab);
+	return ret;
+}
+
+/* one line per call stack: caller;callee;... instructions */
+int prof_folded(struct profile *p, struct cpu_state *cs, const struct symtab *st, FILE *f)
+{
+	uint32_t stack[PROF_MAX_DEPTH];
+	char name[128];
+	uint32_t i, n, k;
+
+	charge(p, cs->icount);
+	for (i = 0; i < p->nnodes; i++) {
+		if (!p->nodes[i].insns)
+			continue;
+		n = 0;
+		for (k = i; n < PROF_MAX_DEPTH; k = p->nodes[k].parent) {
+			stack[n++] = p->nodes[k].func;
+			if (!k)
+				break;
+		}
+		while (n--) {
+			name_of(name, sizeof(name), st, stack[n]);
+			fprintf(f, "%s%c", name, n ? ';' : ' ');
+		}
+		fprintf(f, "%llu\n", (unsigned long long)p->nodes[i].insns);
+	}
+	return ferror(f) ? -1 : 0;
+}
+
+/* fixed pseudo random weight in [-1, 1] of block pc in dimension j */
+static double bbv_weight(uint32_t pc, int j)
+{
+	uint32_t h = pc * 0x9e3779b1u ^ (uint32_t)j * 0x85ebca6bu;
+
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h / 2147483647.5 - 1;
+}
+
+/* the blocks run since the last call, instructions per block as a
+   fraction of all of them, projected down to dims. entries start
+   over, a report written afterwards only sees what ran since */
+void prof_bbv(struct profile *p, struct cpu_state *cs, double *v, int dims)
+{
+	unsigned char *vec = NULL;
+	long pg = sysconf(_SC_PAGESIZE);
+	uint64_t total = 0, n;
+	uint32_t i, pc, per_page = pg / sizeof(uint64_t);
+	int j;
+
+	memset(v, 0, dims * sizeof(double));
+	resident(p->entries, halfwords_len(p), &vec);
+	for (i = 0; i < p->ram_size / 2; i++) {
+		if (vec && !(vec[i / per_page] & 1)) {
+			i |= per_page - 1;
+			continue;
+		}
+		if (!p->entries[i])
+			continue;
+		pc = p->ram_base + 2 * i;
+		n = p->entries[i] * block_len(cs, pc);
+		p->entries[i] = 0;
+		for (j = 0; j < dims; j++)
+			v[j] += n * bbv_weight(pc, j);
+		total += n;
+	}
+	free(vec);
+	for (j = 0; total && j < dims; j++)
+		v[j] /= total;
+}
@@ -0,0 +1,75 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+
+/*
+	execution profile, see --profile
+
+	counters live in arrays shaped like ram, one per halfword or per
+	4K page, touched only where code runs or data is accessed. the
+	interpreter counts block entries (jump and branch targets and the
+	pc a run starts at) rather than every instruction: blocks only
+	end at jumps and branches, so the count of any instruction is the
+	sum over the entries of blocks running through it, worked out when
+	the report is written. branches count taken and not taken per site,
+	loads and stores per page of ram plus one bucket for everything
+	outside of it.
+
+	calls and returns (jal/jalr linking ra or t0, jalr through them
+	to x0) walk a calling context tree, instructions in between are
+	charged to the current node. that gives the folded stacks.
+*/
+
+#define PROF_PAGE_SHIFT 12
+#define PROF_HASH_SIZE (1 << 16)
+#define PROF_MAX_NODES (1 << 20)
+
+struct prof_node {
+	uint32_t func;		/* entry address */
+	uint32_t parent;
+	uint32_t next;		/* hash chain */
+	uint64_t insns;		/* run with exactly this call stack */
+};
+
+struct profile {
+	uint64_t *entries;	/* block entries per halfword of ram */
+	uint64_t *taken;	/* per branch site, halfword of ram */
+	uint64_t *not_taken;
+	uint64_t *loads;	/* per page of ram, then one for outside */
+	uint64_t *stores;
+	uint32_t ram_base;
+	uint32_t ram_size;
+	uint32_t npages;	/* pages of ram, also the outside bucket */
+	uint64_t start;		/* icount when profiling began */
+	struct prof_node *nodes;	/* node 0 is the root */
+	uint32_t nnodes;
+	uint32_t maxnodes;
+	uint32_t *hash;		/* children by parent and func */
+	uint32_t cur;
+	uint64_t last;		/* icount charged to the tree so far */
+};
+
+struct symtab;
+
+struct profile *prof_open(struct cpu_state *cs);
+void prof_close(struct profile *p);
+void prof_call(struct profile *p, uint32_t target, uint64_t icount);
+void prof_ret(struct profile *p, uint64_t icount);
+int prof_report(struct profile *p, struct cpu_state *cs, const struct symtab *st, FILE *f);
+int prof_folded(struct profile *p, struct cpu_state *cs, const struct symtab *st, FILE *f);
+void prof_bbv(struct profile *p, struct cpu_state *cs, double *v, int dims);
+
+static inline uint32_t prof_page(struct profile *p, uint32_t addr)
+{
+	uint32_t off = addr - p->ram_base;
+
+	if (off < p->ram_size)
+		return off >> PROF_PAGE_SHIFT;
+	return p->npages;
+}
+
+#endif
@@ -0,0 +1,555 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "uart.h"
+#include "emu.h"
+#include "simpoint.h"
+
+struct interval {
+	uint64_t start;		/* icount */
+	uint64_t len;
+	double v[SP_DIMS];
+};
+
+struct slice {
+	uint32_t interval;
+	uint32_t size;		/* intervals in the cluster */
+	double weight;
+	struct emu_timing_stats t;	/* of the interval alone */
+	int ok;
+};
+
+struct simpoint {
+	struct emu_config cfg;
+	const struct simpoint_config *sc;
+	const char *image;
+	const char *restore;
+	struct interval *iv;
+	uint32_t n;
+	uint64_t total;		/* instructions in the intervals */
+	struct slice *slices;
+	int nslices;
+	int next;		/* slice for the next free thread */
+	int failed;
+};
+
+static const char *results[] = {
+	[EMU_BUDGET] = "budget",
+	[EMU_FAULT] = "fault",
+	[EMU_BAD_PC] = "bad-pc",
+	[EMU_INVALID] = "invalid",
+	[EMU_ERROR] = "error",
+	[EMU_AT_PC] = "at-pc",
+	[EMU_ECALL] = "ecall",
+	[EMU_EBREAK] = "ebreak",
+	[EMU_EXIT] = "exit",
+};
+
+/* a console with nobody reading it, always ready to send */
+static uint32_t console_read(void *dev, uint32_t off, int size)
+{
+	return off == UART_LSR ? LSR_THRE | LSR_TEMT : 0;
+}
+
+static void console_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+}
+
+static double elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void snap_name(char *buf, size_t len, const struct simpoint *sp, int i)
+{
+	snprintf(buf, len, "%s.%d", sp->sc->prefix, i);
+}
+
+/* the guest as the user gave it, image or snapshot */
+static struct emu *open_guest(struct simpoint *sp, const struct emu_config *cfg,
+	const char *restore)
+{
+	struct emu *e;
+
+	e = emu_create(cfg);
+	if (!e)
+		return NULL;
+	if (emu_add_device(e, "uart", UART_BASE, UART_SIZE, console_read, console_write, NULL) < 0 ||
+	    (restore ? emu_restore(e, restore) : emu_load(e, sp->image, sp->sc->load_addr)) < 0) {
+		emu_destroy(e);
+		return NULL;
+	}
+	return e;
+}
+
+/* the profiling pass, a block vector per interval */
+static int collect(struct simpoint *sp)
+{
+	const struct simpoint_config *sc = sp->sc;
+	struct emu_config cfg = sp->cfg;
+	struct interval *iv;
+	struct emu *e;
+	uint64_t start, at, done = 0;
+	uint32_t max = 0;
+	int ret = EMU_BUDGET;
+
+	cfg.jit = 0;
+	cfg.aot = NULL;
+	cfg.timing = NULL;
+	cfg.profile = 1;
+	e = open_guest(sp, &cfg, sp->restore);
+	if (!e)
+		return -1;
+	start = emu_icount(e);
+	while (ret == EMU_BUDGET && done < sc->budget) {
+		at = emu_icount(e);
+		ret = emu_run(e, sc->interval < sc->budget - done ? sc->interval : sc->budget - done);
+		if (emu_icount(e) == at)
+			break;
+		if (sp->n == max) {
+			max = max ? 2 * max : 1024;
+			iv = (struct interval*)realloc(sp->iv, max * sizeof(struct interval));
+			if (!iv) {
+				emu_destroy(e);
+				return -1;
+			}
+			sp->iv = iv;
+		}
+		iv = &sp->iv[sp->n++];
+		iv->start = at;
+		iv->len = emu_icount(e) - at;
+		emu_bbv(e, iv->v, SP_DIMS);
+		done = emu_icount(e) - start;
+	}
+	if (ret != EMU_BUDGET && ret != EMU_EXIT)
+		fprintf(stderr, "guest stopped by %s at pc 0x%x\n", results[ret], emu_get_pc(e));
+	emu_destroy(e);
+
+	if (sp->n > 1 && sp->iv[sp->n - 1].len < sc->interval / 2)
+		sp->n--;
+	for (at = 0; at < sp->n; at++)
+		sp->total += sp->iv[at].len;
+	return sp->n ? 0 : -1;
+}
+
+/* xorshift64*, seeded the same every run */
+static uint64_t rng(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+static double dist2(const double *a, const double *b)
+{
+	double d = 0;
+	int j;
+
+	for (j = 0; j < SP_DIMS; j++)
+		d += (a[j] - b[j]) * (a[j] - b[j]);
+	return d;
+}
+
+/* k-means++ seeding, then lloyd's iterations. the sum of squared
+   distances to the centers */
+static double kmeans(struct simpoint *sp, int k, double *centers, uint32_t *assign,
+	double *d, uint64_t *seed)
+{
+	uint32_t i, j, *count;
+	double sum, r, best, x;
+	int c, it, changed;
+
+	for (i = 0; i < sp->n; i++)
+		d[i] = INFINITY;
+	i = rng(seed) % sp->n;
+	for (c = 0; c < k; c++) {
+		memcpy(&centers[c * SP_DIMS], sp->iv[i].v, sizeof(sp->iv[i].v));
+		sum = 0;
+		for (i = 0; i < sp->n; i++) {
+			x = dist2(sp->iv[i].v, &centers[c * SP_DIMS]);
+			if (x < d[i])
+				d[i] = x;
+			sum += d[i];
+		}
+		/* the next center with a chance proportional to d */
+		r = (rng(seed) >> 11) / 9007199254740992.0 * sum;
+		for (i = 0; i < sp->n - 1 && (r -= d[i]) >= 0; i++)
+			;
+	}
+
+	count = (uint32_t*)calloc(k, sizeof(uint32_t));
+	if (!count)
+		return INFINITY;
+	for (i = 0; i < sp->n; i++)
+		assign[i] = UINT32_MAX;
+	sum = 0;
+	for (it = 0; it < SP_ITERS; it++) {
+		changed = 0;
+		sum = 0;
+		for (i = 0; i < sp->n; i++) {
+			best = INFINITY;
+			j = 0;
+			for (c = 0; c < k; c++) {
+				x = dist2(sp->iv[i].v, &centers[c * SP_DIMS]);
+				if (x < best) {
+					best = x;
+					j = c;
+				}
+			}
+			sum += best;
+			if (assign[i] != j) {
+				assign[i] = j;
+				changed = 1;
+			}
+		}
+		if (!changed)
+			break;
+		/* an empty cluster keeps its center */
+		memset(count, 0, k * sizeof(uint32_t));
+		for (i = 0; i < sp->n; i++)
+			count[assign[i]]++;
+		for (c = 0; c < k; c++)
+			if (count[c])
+				memset(&centers[c * SP_DIMS], 0, SP_DIMS * sizeof(double));
+		for (i = 0; i < sp->n; i++)
+			for (c = 0; c < SP_DIMS; c++)
+				centers[assign[i] * SP_DIMS + c] += sp->iv[i].v[c];
+		for (c = 0; c < k * SP_DIMS; c++)
+			if (count[c / SP_DIMS])
+				centers[c] /= count[c / SP_DIMS];
+	}
+	free(count);
+	return sum;
+}
+
+/* bayesian information criterion of a clustering, spherical gaussians
+   with one variance as in x-means. higher is better */
+static double bic(struct simpoint *sp, int k, const uint32_t *assign, double sse)
+{
+	double n = sp->n, m = SP_DIMS, var, l = 0;
+	uint32_t i, *count;
+	int c;
+
+	count = (uint32_t*)calloc(k, sizeof(uint32_t));
+	if (!count)
+		return -INFINITY;
+	for (i = 0; i < sp->n; i++)
+		count[assign[i]]++;
+	var = sp->n > k ? sse / (m * (n - k)) : 0;
+	if (var < 1e-12)
+		var = 1e-12;
+	for (c = 0; c < k; c++)
+		if (count[c])
+			l += count[c] * log(count[c] / n);
+	l -= n * m / 2 * log(2 * M_PI * var) + m * (n - k) / 2;
+	free(count);
+	return l - k * (m + 1) / 2 * log(n);
+}
+
+static int slice_cmp(const void *a, const void *b)
+{
+	const struct slice *x = (const struct slice*)a, *y = (const struct slice*)b;
+
+	return x->interval < y->interval ? -1 : x->interval > y->interval;
+}
+
+/* the clustering with the smallest k close enough to the best score,
+   then the interval nearest to each center */
+static int pick(struct simpoint *sp)
+{
+	int max_k = sp->sc->max_k ? sp->sc->max_k : SP_MAX_K;
+	double *centers, *ct, *d, *score, sse, best, lo, hi, x;
+	uint32_t *assign, *tmp, i;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	int k, t, c, ret = -1;
+
+	if (max_k > sp->n)
+		max_k = sp->n;
+	centers = (double*)malloc((size_t)max_k * max_k * SP_DIMS * sizeof(double));
+	assign = (uint32_t*)malloc((size_t)max_k * sp->n * sizeof(uint32_t));
+	ct = (double*)malloc(max_k * SP_DIMS * sizeof(double));
+	tmp = (uint32_t*)malloc(sp->n * sizeof(uint32_t));
+	d = (double*)malloc(sp->n * sizeof(double));
+	score = (double*)malloc(max_k * sizeof(double));
+	sp->slices = (struct slice*)calloc(max_k, sizeof(struct slice));
+	if (!centers || !assign || !ct || !tmp || !d || !score || !sp->slices)
+		goto out;
+
+	/* the best of a few runs for every k, by squared distance */
+	for (k = 1; k <= max_k; k++) {
+		best = INFINITY;
+		for (t = 0; t < SP_TRIES; t++) {
+			sse = kmeans(sp, k, ct, tmp, d, &seed);
+			if (sse < best) {
+				best = sse;
+				memcpy(&centers[(size_t)(k - 1) * max_k * SP_DIMS], ct,
+					k * SP_DIMS * sizeof(double));
+				memcpy(&assign[(size_t)(k - 1) * sp->n], tmp, sp->n * sizeof(uint32_t));
+			}
+		}
+		score[k - 1] = bic(sp, k, &assign[(size_t)(k - 1) * sp->n], best);
+	}
+	lo = hi = score[0];
+	for (k = 1; k < max_k; k++) {
+		if (score[k] < lo)
+			lo = score[k];
+		if (score[k] > hi)
+			hi = score[k];
+	}
+	for (k = 1; k < max_k && score[k - 1] < lo + 0.9 * (hi - lo); k++)
+		;
+
+	for (c = 0; c < k; c++) {
+		struct slice *s = &sp->slices[sp->nslices];
+		uint64_t insns = 0;
+
+		best = INFINITY;
+		for (i = 0; i < sp->n; i++) {
+			if (assign[(size_t)(k - 1) * sp->n + i] != c)
+				continue;
+			insns += sp->iv[i].len;
+			s->size++;
+			x = dist2(sp->iv[i].v, &centers[((size_t)(k - 1) * max_k + c) * SP_DIMS]);
+			if (x < best) {
+				best = x;
+				s->interval = i;
+			}
+		}
+		if (!s->size)
+			continue;
+		s->weight = (double)insns / sp->total;
+		sp->nslices++;
+	}
+	qsort(sp->slices, sp->nslices, sizeof(struct slice), slice_cmp);
+	ret = 0;
+out:
+	free(centers);
+	free(assign);
+	free(ct);
+	free(tmp);
+	free(d);
+	free(score);
+	return ret;
+}
+
+/* full speed up to each slice, less the warmup, and a snapshot there */
+static int fast_forward(struct simpoint *sp)
+{
+	struct emu_config cfg = sp->cfg;
+	struct slice *s;
+	struct emu *e;
+	char name[PATH_MAX];
+	uint64_t at;
+	int i, ret;
+
+	cfg.timing = NULL;
+	cfg.profile = 0;
+	e = open_guest(sp, &cfg, sp->restore);
+	if (!e)
+		return -1;
+	for (i = 0; i < sp->nslices; i++) {
+		s = &sp->slices[i];
+		at = sp->iv[s->interval].start;
+		at = at - sp->iv[0].start > sp->sc->warmup ? at - sp->sc->warmup : sp->iv[0].start;
+		if (at > emu_icount(e)) {
+			ret = emu_run(e, at - emu_icount(e));
+			if (ret != EMU_BUDGET) {
+				fprintf(stderr, "guest stopped by %s before slice %d, it doesn't run the same "
+					"without the profile\n", results[ret], i);
+				emu_destroy(e);
+				return -1;
+			}
+		}
+		snap_name(name, sizeof(name), sp, i);
+		if (emu_snapshot(e, name) < 0) {
+			emu_destroy(e);
+			return -1;
+		}
+	}
+	emu_destroy(e);
+	return 0;
+}
+
+static void stats_sub(struct emu_timing_stats *a, const struct emu_timing_stats *b)
+{
+	a->insns -= b->insns;
+	a->cycles -= b->cycles;
+	a->fetches -= b->fetches;
+	a->imisses -= b->imisses;
+	a->daccesses -= b->daccesses;
+	a->dmisses -= b->dmisses;
+	a->branches -= b->branches;
+	a->mispredicts -= b->mispredicts;
+}
+
+static int run_slice(struct simpoint *sp, int i)
+{
+	struct slice *s = &sp->slices[i];
+	struct interval *iv = &sp->iv[s->interval];
+	struct emu_config cfg = sp->cfg;
+	struct emu_timing_stats warm;
+	struct emu *e;
+	char name[PATH_MAX];
+	int ret = -1;
+
+	cfg.jit = 0;
+	cfg.aot = NULL;
+	cfg.profile = 0;
+	cfg.harts = 0;
+	snap_name(name, sizeof(name), sp, i);
+	e = open_guest(sp, &cfg, name);
+	if (!e)
+		return -1;
+	if (iv->start > emu_icount(e))
+		emu_run(e, iv->start - emu_icount(e));
+	if (emu_timing_stats(e, &warm) < 0)
+		goto out;
+	if (iv->start + iv->len > emu_icount(e))
+		emu_run(e, iv->start + iv->len - emu_icount(e));
+	emu_timing_stats(e, &s->t);
+	stats_sub(&s->t, &warm);
+	strncat(name, ".timing", sizeof(name) - strlen(name) - 1);
+	ret = emu_timing(e, name);
+	s->ok = 1;
+out:
+	emu_destroy(e);
+	return ret;
+}
+
+static void *slice_thread(void *arg)
+{
+	struct simpoint *sp = (struct simpoint*)arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&sp->next, 1, __ATOMIC_RELAXED)) < sp->nslices)
+		if (run_slice(sp, i) < 0)
+			__atomic_store_n(&sp->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static int run_slices(struct simpoint *sp)
+{
+	pthread_t *threads;
+	int jobs = sp->sc->jobs, k, started;
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > sp->nslices)
+		jobs = sp->nslices;
+	threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+	if (!threads)
+		return -1;
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, slice_thread, sp))
+			break;
+	if (!started)
+		slice_thread(sp);
+	for (k = 0; k < started; k++)
+		pthread_join(threads[k], NULL);
+	free(threads);
+	return sp->failed ? -1 : 0;
+}
+
+static double per_k(uint64_t n, uint64_t insns)
+{
+	return insns ? 1000.0 * n / insns : 0;
+}
+
+/* the table of slices and the weighted estimates */
+static int report(struct simpoint *sp)
+{
+	char name[PATH_MAX];
+	struct slice *s;
+	double cpi = 0, imiss = 0, dmiss = 0, mispredict = 0;
+	FILE *f;
+	int i;
+
+	snprintf(name, sizeof(name), "%s.simpoints", sp->sc->prefix);
+	f = fopen(name, "w");
+	if (!f) {
+		fprintf(stderr, "can't write %s\n", name);
+		return -1;
+	}
+	fprintf(f, "# %llu instructions, %u intervals of %llu, %d slices, %llu warmup\n",
+		(unsigned long long)sp->total, sp->n, (unsigned long long)sp->sc->interval,
+		sp->nslices, (unsigned long long)sp->sc->warmup);
+	fprintf(f, "# snapshot start instructions intervals weight cpi "
+		"icache-mpki dcache-mpki mispredicts-pki\n");
+	for (i = 0; i < sp->nslices; i++) {
+		s = &sp->slices[i];
+		if (!s->ok || !s->t.insns)
+			continue;
+		snap_name(name, sizeof(name), sp, i);
+		fprintf(f, "%s %llu %llu %u %.6f %.4f %.4f %.4f %.4f\n", name,
+			(unsigned long long)sp->iv[s->interval].start,
+			(unsigned long long)s->t.insns, s->size, s->weight,
+			(double)s->t.cycles / s->t.insns, per_k(s->t.imisses, s->t.insns),
+			per_k(s->t.dmisses, s->t.insns), per_k(s->t.mispredicts, s->t.insns));
+		cpi += s->weight * s->t.cycles / s->t.insns;
+		imiss += s->weight * per_k(s->t.imisses, s->t.insns);
+		dmiss += s->weight * per_k(s->t.dmisses, s->t.insns);
+		mispredict += s->weight * per_k(s->t.mispredicts, s->t.insns);
+	}
+	if (fclose(f) < 0)
+		return -1;
+
+	printf("estimated CPI %.4f, %.0f cycles for %llu instructions\n", cpi,
+		cpi * sp->total, (unsigned long long)sp->total);
+	printf("icache %.3f, dcache %.3f misses and %.3f mispredicts per 1000 instructions\n",
+		imiss, dmiss, mispredict);
+	return 0;
+}
+
+/* 0 when every slice ran */
+int run_simpoint(const struct emu_config *cfg, const struct simpoint_config *sc,
+	const char *image, const char *restore)
+{
+	struct simpoint sp;
+	struct timespec t0;
+	int i, ret = 1;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.cfg = *cfg;
+	sp.sc = sc;
+	sp.image = image;
+	sp.restore = restore;
+	if (!sp.cfg.timing)
+		sp.cfg.timing = "";
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (collect(&sp) < 0 || pick(&sp) < 0)
+		goto out;
+	printf("%llu instructions in %u intervals, %d slices, profiled and clustered in %.3f s\n",
+		(unsigned long long)sp.total, sp.n, sp.nslices, elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (fast_forward(&sp) < 0)
+		goto out;
+	printf("snapshots taken in %.3f s\n", elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (run_slices(&sp) < 0)
+		printf("not every slice ran, the estimates are off\n");
+	printf("slices run in %.3f s\n", elapsed(&t0));
+	for (i = 0; i < sp.nslices; i++)
+		printf("  %s.%d: %llu instructions from %llu, weight %.4f\n", sc->prefix, i,
+			(unsigned long long)sp.iv[sp.slices[i].interval].len,
+			(unsigned long long)sp.iv[sp.slices[i].interval].start, sp.slices[i].weight);
+	ret = report(&sp) < 0 || sp.failed;
+out:
+	free(sp.iv);
+	free(sp.slices);
+	return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef SIMPOINT_H
+#define SIMPOINT_H
+
+#include <stdint.h>
+
+#include "emu.h"
+
+/*
+	--simpoint: the timing model on a few representative slices of a
+	long run instead of all of it
+
+	a profiling pass splits the run into intervals of a fixed number
+	of instructions and takes the basic block vector of each one, the
+	instructions per block, projected down to SP_DIMS. k-means groups
+	similar intervals for every k up to max_k and the smallest k that
+	scores within 90% of the best bic is used. the interval nearest to
+	each centroid stands in for its cluster, weighted by the share of
+	the instructions the cluster ran.
+
+	a second pass runs at full speed, with the jit or --aot if asked
+	for, and snapshots the guest warmup instructions before each
+	representative to prefix.0, prefix.1, ... the slices then run from
+	those snapshots under the timing model on jobs threads. warmup
+	instructions fill the caches and predictor without being counted,
+	without any they start cold. each slice's timing report, warmup
+	included, goes to prefix.<n>.timing, the table of slices to
+	prefix.simpoints and the weighted whole program estimates to
+	stdout. the snapshots stay, any other mode can rerun a slice with
+	--restore prefix.<n> -n <interval + warmup>.
+
+	device output is dropped. a last interval shorter than half of
+	the others is left out.
+*/
+
+#define SP_DIMS 15		/* of the projected block vectors */
+#define SP_MAX_K 10
+#define SP_TRIES 5		/* k-means runs per k, the best one is kept */
+#define SP_ITERS 100
+
+struct simpoint_config {
+	uint64_t interval;	/* instructions */
+	uint64_t warmup;	/* instructions before each slice */
+	int max_k;		/* 0 for SP_MAX_K */
+	const char *prefix;	/* of the snapshots and reports */
+	int jobs;		/* 0 for one per cpu */
+	uint64_t budget;	/* of the whole run */
+	uint32_t load_addr;
+};
+
+/* image or restore. cfg.timing is the model's spec, the rest goes
+   for the fast forward */
+int run_simpoint(const struct emu_config *cfg, const struct simpoint_config *sc,
+	const char *image, const char *restore);
+
+#endif
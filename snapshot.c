@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "snapshot.h"
+#include "clint.h"
+
+static int zero_page(uint8_t *p, long pg)
+{
+	uint64_t *w = (uint64_t*)p, *e = (uint64_t*)(p + pg);
+
+	while (w < e)
+		if (*w++)
+			return 0;
+	return 1;
+}
+
+static int pwrite_all(int fd, uint8_t *p, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, p, len, off);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* fd has to be empty, h is filled in for the caller. later deltas
+   build on this, see mem_dirty_saved */
+int snap_write(int fd, struct cpu_state *cs, struct mem *m, struct snap_header *h)
+{
+	struct mem_region *r;
+	struct snap_region *s;
+	long pg = sysconf(_SC_PAGESIZE);
+	uint64_t off;
+	uint32_t a, b;
+	int i;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+	memcpy(h->regs, cs->regs, sizeof(h->regs));
+	h->pc = cs->pc;
+	h->icount = cs->icount;
+	h->csr = cs->csr;
+	h->mtime = clint_mtime(cs->clint);
+
+	off = (sizeof(*h) + pg - 1) & ~(pg - 1);
+	for (i = 0; i < m->nregions; i++) {
+		r = &m->regions[i];
+		if (r->type == MEM_IO)
+			continue;
+		s = &h->regions[h->nregions++];
+		s->base = r->base;
+		s->size = r->size;
+		s->type = r->type;
+		if (r->type == MEM_ROM)
+			continue;
+		s->off = off;
+		/* one write per run of pages holding data */
+		for (a = 0; a < r->size; a = b) {
+			while (a < r->size && zero_page(r->host + a, pg))
+				a += pg;
+			for (b = a; b < r->size && !zero_page(r->host + b, pg); b += pg)
+				;
+			if (b > a && pwrite_all(fd, r->host + a, b - a, off + a) < 0)
+				return -1;
+		}
+		off += (r->size + pg - 1) & ~(pg - 1);
+	}
+	if (ftruncate(fd, off) < 0 || pwrite_all(fd, (uint8_t*)h, sizeof(*h), 0) < 0)
+		return -1;
+	mem_dirty_saved(cs);
+	return 0;
+}
+
+int snap_read(int fd, struct snap_header *h)
+{
+	int i;
+
+	if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+	    memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) ||
+	    h->nregions > MEM_MAX_REGIONS)
+		return -1;
+	for (i = 0; i < h->nregions; i++)
+		if (h->regions[i].type != MEM_RAM && h->regions[i].type != MEM_ROM)
+			return -1;
+	return 0;
+}
+
+/* replace the contents of the ram regions h lists, m has to have
+   them. its rom regions are placed again, see mem_protect */
+int snap_map(int fd, struct snap_header *h, struct mem *m)
+{
+	struct mem_region *r;
+	struct snap_region *s;
+	int i;
+
+	for (i = 0; i < h->nregions; i++) {
+		s = &h->regions[i];
+		if (s->type == MEM_ROM) {
+			if (!mem_add(m, "rom", s->base, s->size, MEM_ROM))
+				return -1;
+			continue;
+		}
+		r = mem_find(m, s->base, s->size);
+		if (!r || r->base != s->base || r->size != s->size || r->type != s->type)
+			return -1;
+		if (mmap(r->host, r->size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, s->off) == MAP_FAILED)
+			return -1;
+	}
+	return 0;
+}
+
+static int page_dirty(struct cpu_state *cs, uint32_t pg)
+{
+	return ((cs->dirty[pg >> 6] | cs->dirty_kept[pg >> 6]) >> (pg & 63)) & 1;
+}
+
+/* ram pages stored to since h was written get its contents back, the
+   rest is still the same. snapshots and deltas written in between
+   don't count, their pages are in dirty_kept */
+int snap_restore_dirty(int fd, struct snap_header *h, struct cpu_state *cs)
+{
+	struct snap_region *s = NULL;
+	uint32_t a, b, n = cs->ram_size >> DIRTY_PAGE_SHIFT;
+	int i;
+
+	for (i = 0; i < h->nregions; i++)
+		if (h->regions[i].base == cs->ram_base && h->regions[i].size == cs->ram_size)
+			s = &h->regions[i];
+	if (!s)
+		return -1;
+	for (a = 0; a < n; a = b) {
+		while (a < n && !(a & 63) && !(cs->dirty[a >> 6] | cs->dirty_kept[a >> 6]))
+			a += 64;
+		if (a >= n)
+			break;
+		if (!page_dirty(cs, a)) {
+			b = a + 1;
+			continue;
+		}
+		for (b = a; b < n && page_dirty(cs, b); b++)
+			;
+		if (pread(fd, cs->ram + (a << DIRTY_PAGE_SHIFT), (b - a) << DIRTY_PAGE_SHIFT,
+		    s->off + (a << DIRTY_PAGE_SHIFT)) != (ssize_t)((b - a) << DIRTY_PAGE_SHIFT))
+			return -1;
+		mem_clean(cs, a << DIRTY_PAGE_SHIFT, (b - a) << DIRTY_PAGE_SHIFT);
+	}
+	return 0;
+}
+
+/* fd has to be empty, the next delta starts from here */
+int delta_write(int fd, struct cpu_state *cs)
+{
+	struct delta_header h;
+	uint32_t *pages, n = cs->ram_size >> DIRTY_PAGE_SHIFT, i;
+	uint64_t off;
+	int ret = -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+	memcpy(h.regs, cs->regs, sizeof(h.regs));
+	h.pc = cs->pc;
+	h.icount = cs->icount;
+	h.csr = cs->csr;
+	h.mtime = clint_mtime(cs->clint);
+
+	pages = (uint32_t*)malloc(n * sizeof(uint32_t));
+	if (!pages)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (cs->dirty[i >> 6] & (1ULL << (i & 63)))
+			pages[h.npages++] = cs->ram_base + (i << DIRTY_PAGE_SHIFT);
+
+	if (pwrite_all(fd, (uint8_t*)&h, sizeof(h), 0) < 0 ||
+	    pwrite_all(fd, (uint8_t*)pages, h.npages * sizeof(uint32_t), sizeof(h)) < 0)
+		goto out;
+	off = sizeof(h) + h.npages * sizeof(uint32_t);
+	for (i = 0; i < h.npages; i++, off += DIRTY_PAGE_SIZE)
+		if (pwrite_all(fd, cs->ram + (pages[i] - cs->ram_base), DIRTY_PAGE_SIZE, off) < 0)
+			goto out;
+	mem_dirty_saved(cs);
+	ret = 0;
+out:
+	free(pages);
+	return ret;
+}
+
+/* stores the pages into ram like the guest would and takes over the
+   hart state */
+int delta_apply(int fd, struct cpu_state *cs)
+{
+	struct delta_header h;
+	uint32_t *pages, i, off;
+	int ret = -1;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    memcmp(h.magic, DELTA_MAGIC, sizeof(h.magic)))
+		return -1;
+	pages = (uint32_t*)malloc(h.npages * sizeof(uint32_t) + 1);
+	if (!pages)
+		return -1;
+	if (pread(fd, pages, h.npages * sizeof(uint32_t), sizeof(h)) !=
+	    (ssize_t)(h.npages * sizeof(uint32_t)))
+		goto out;
+	for (i = 0; i < h.npages; i++) {
+		off = pages[i] - cs->ram_base;
+		if (off >= cs->ram_size || (off & (DIRTY_PAGE_SIZE - 1)) ||
+		    pread(fd, cs->ram + off, DIRTY_PAGE_SIZE, sizeof(h) +
+		    h.npages * sizeof(uint32_t) + (uint64_t)i * DIRTY_PAGE_SIZE) != DIRTY_PAGE_SIZE)
+			goto out;
+		ram_stored(off, DIRTY_PAGE_SIZE, cs);
+	}
+	memcpy(cs->regs, h.regs, sizeof(cs->regs));
+	cs->regs[0] = 0;
+	cs->pc = h.pc;
+	cs->icount = h.icount;
+	cs->csr = h.csr;
+	cs->lr_valid = 0;
+	cs->idiom_pc = 0;
+	cs->idiom_until = 0;
+	clint_set_mtime(cs->clint, h.mtime);
+	ret = 0;
+out:
+	free(pages);
+	return ret;
+}
@@ -0,0 +1,66 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+/*
+	guest snapshots
+
+	a header with the hart state and the region list, followed by the
+	contents of every ram region at page aligned offsets. rom is part
+	of ram, its regions are only listed. all zero pages are left as holes, so the file is about as large as
+	the memory the guest used. restoring maps the contents MAP_PRIVATE
+	over the regions: pages come in on first use and guest stores
+	copy them, the file itself is never written. host byte order like
+	the trace, a snapshot is only read back on the host that wrote it.
+
+	a delta holds the hart state and the ram pages stored to since the
+	previous snapshot or delta, see cs->dirty: a header, the guest
+	addresses of the pages and then the pages in the same order. a
+	snapshot with its deltas applied in order is the state at the
+	last delta.
+*/
+
+#define SNAP_MAGIC "RV32SNP2"
+#define DELTA_MAGIC "RV32DLT2"
+
+struct snap_region {
+	uint32_t base;
+	uint32_t size;
+	uint32_t type;
+	uint32_t pad;
+	uint64_t off;		/* file offset of the contents */
+};
+
+struct snap_header {
+	char magic[8];
+	uint32_t regs[32];
+	uint32_t pc;
+	uint32_t nregions;
+	uint64_t icount;
+	struct csr_state csr;
+	uint64_t mtime;
+	struct snap_region regions[MEM_MAX_REGIONS];
+};
+
+struct delta_header {
+	char magic[8];
+	uint32_t regs[32];
+	uint32_t pc;
+	uint32_t npages;
+	uint64_t icount;
+	struct csr_state csr;
+	uint64_t mtime;
+};
+
+int snap_write(int fd, struct cpu_state *cs, struct mem *m, struct snap_header *h);
+int snap_read(int fd, struct snap_header *h);
+int snap_map(int fd, struct snap_header *h, struct mem *m);
+int snap_restore_dirty(int fd, struct snap_header *h, struct cpu_state *cs);
+int delta_write(int fd, struct cpu_state *cs);
+int delta_apply(int fd, struct cpu_state *cs);
+
+#endif
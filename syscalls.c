@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "clint.h"
+#include "syscalls.h"
+
+/* newlib's open flags, sys/_default_fcntl.h */
+#define NL_ACCMODE 0x0003
+#define NL_APPEND 0x0008
+#define NL_CREAT 0x0200
+#define NL_TRUNC 0x0400
+#define NL_EXCL 0x0800
+#define NL_SYNC 0x2000
+#define NL_NONBLOCK 0x4000
+
+#define NL_AT_FDCWD -100
+
+/* libgloss's struct kernel_stat */
+#define KSTAT_DEV 0
+#define KSTAT_INO 8
+#define KSTAT_MODE 16
+#define KSTAT_NLINK 20
+#define KSTAT_UID 24
+#define KSTAT_GID 28
+#define KSTAT_RDEV 32
+#define KSTAT_SIZE 48
+#define KSTAT_BLKSIZE 56
+#define KSTAT_BLOCKS 64
+#define KSTAT_ATIM 72	/* struct timespec, 16 bytes each */
+#define KSTAT_MTIM 88
+#define KSTAT_CTIM 104
+#define KSTAT_LEN 128
+
+struct sys *sys_open(void (*exit)(void *dev, int code), void *dev)
+{
+	struct sys *s;
+	int i;
+
+	s = (struct sys*)calloc(1, sizeof(struct sys));
+	if (!s)
+		return NULL;
+	for (i = 0; i < SYS_MAX_FDS; i++)
+		s->fds[i] = i < 3 ? i : -1;
+	s->exit = exit;
+	s->dev = dev;
+	return s;
+}
+
+static void close_files(struct sys *s)
+{
+	int i;
+
+	for (i = 3; i < SYS_MAX_FDS; i++) {
+		if (s->fds[i] >= 0)
+			close(s->fds[i]);
+		s->fds[i] = -1;
+	}
+	for (i = 0; i < 3; i++)
+		s->fds[i] = i;
+}
+
+void sys_close(struct sys *s)
+{
+	if (!s)
+		return;
+	close_files(s);
+	free(s);
+}
+
+/* guest [addr, addr + len) in ram, NULL if it isn't */
+static uint8_t *guest(struct cpu_state *cs, uint32_t addr, uint32_t len)
+{
+	uint32_t off = addr - cs->ram_base;
+
+	if (off > cs->ram_size || len > cs->ram_size - off)
+		return NULL;
+	return cs->ram + off;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	v = le32(v);
+	memcpy(p, &v, 4);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+/* len bytes of buf to the guest, -EFAULT outside of ram */
+static int copy_out(struct cpu_state *cs, uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+	uint8_t *p = guest(cs, addr, len);
+
+	if (!p)
+		return -EFAULT;
+	memcpy(p, buf, len);
+	mem_stored(cs, addr - cs->ram_base, len);
+	return 0;
+}
+
+/* files opened since the start go, fds 0 - 2 are back. the break
+   stays where it is, emu_reset has put the guest's idea of it back
+   to at most that. a restored guest gets the upper half of ram */
+void sys_reset(struct sys *s, struct cpu_state *cs)
+{
+	close_files(s);
+	if (!s->brk) {
+		s->stack = cs->ram_base + cs->ram_size;
+		s->brk_min = cs->ram_base;
+		s->brk = s->stack - cs->ram_size / 2;
+	}
+}
+
+/* argc, argv and envp on a fresh stack at the top of ram, like pk */
+int sys_start(struct sys *s, struct cpu_state *cs, uint32_t image_end, int argc,
+	char **argv)
+{
+	uint32_t sp = cs->ram_base + cs->ram_size, len = 0, *ptrs;
+	uint8_t *p;
+	int i;
+
+	close_files(s);
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	len = (len + 15) & ~15;
+	if ((uint64_t)len + (argc + 3) * 4 + 16 > cs->ram_size - (image_end - cs->ram_base)) {
+		fprintf(stderr, "no room for the guest's arguments\n");
+		return -1;
+	}
+	ptrs = (uint32_t*)calloc(argc + 3, sizeof(uint32_t));
+	if (!ptrs)
+		return -1;
+	sp -= len;
+	s->stack = sp;
+	ptrs[0] = le32(argc);
+	p = guest(cs, sp, len);
+	memset(p, 0, len);
+	for (i = 0; i < argc; i++) {
+		ptrs[i + 1] = le32(cs->ram_base + (p - cs->ram));
+		strcpy((char*)p, argv[i]);
+		p += strlen(argv[i]) + 1;
+	}
+	/* argv and envp end with a NULL each */
+	sp = (sp - (argc + 3) * 4) & ~15;
+	copy_out(cs, sp, (uint8_t*)ptrs, (argc + 3) * 4);
+	mem_stored(cs, s->stack - cs->ram_base, len);
+	free(ptrs);
+	cs->regs[2] = sp;
+	s->brk_min = (image_end + 15) & ~15;
+	s->brk = s->brk_min;
+	return 0;
+}
+
+static int host_fd(struct sys *s, uint32_t fd)
+{
+	return fd < SYS_MAX_FDS ? s->fds[fd] : -1;
+}
+
+static int result(long ret)
+{
+	return ret < 0 ? -errno : ret;
+}
+
+static int host_flags(uint32_t flags)
+{
+	int f = flags & NL_ACCMODE;
+
+	if (flags & NL_APPEND)
+		f |= O_APPEND;
+	if (flags & NL_CREAT)
+		f |= O_CREAT;
+	if (flags & NL_TRUNC)
+		f |= O_TRUNC;
+	if (flags & NL_EXCL)
+		f |= O_EXCL;
+	if (flags & NL_SYNC)
+		f |= O_SYNC;
+	if (flags & NL_NONBLOCK)
+		f |= O_NONBLOCK;
+	return f | O_CLOEXEC;
+}
+
+static int sys_openat(struct sys *s, struct cpu_state *cs, uint32_t dirfd, uint32_t path,
+	uint32_t flags, uint32_t mode)
+{
+	uint8_t *p = guest(cs, path, 1);
+	int dir = AT_FDCWD, fd, i;
+
+	if (!p || !memchr(p, 0, cs->ram_size - (path - cs->ram_base)))
+		return -EFAULT;
+	if ((int32_t)dirfd != NL_AT_FDCWD && (dir = host_fd(s, dirfd)) < 0)
+		return -EBADF;
+	for (i = 3; i < SYS_MAX_FDS && s->fds[i] >= 0; i++)
+		;
+	if (i == SYS_MAX_FDS)
+		return -EMFILE;
+	fd = openat(dir, (const char*)p, host_flags(flags), mode);
+	if (fd < 0)
+		return -errno;
+	s->fds[i] = fd;
+	return i;
+}
+
+static int sys_fstat(struct sys *s, struct cpu_state *cs, uint32_t fd, uint32_t addr)
+{
+	uint8_t buf[KSTAT_LEN];
+	struct stat st;
+
+	if (host_fd(s, fd) < 0)
+		return -EBADF;
+	if (fstat(host_fd(s, fd), &st) < 0)
+		return -errno;
+	memset(buf, 0, sizeof(buf));
+	put64(buf + KSTAT_DEV, st.st_dev);
+	put64(buf + KSTAT_INO, st.st_ino);
+	put32(buf + KSTAT_MODE, st.st_mode);
+	put32(buf + KSTAT_NLINK, st.st_nlink);
+	put32(buf + KSTAT_UID, st.st_uid);
+	put32(buf + KSTAT_GID, st.st_gid);
+	put64(buf + KSTAT_RDEV, st.st_rdev);
+	put64(buf + KSTAT_SIZE, st.st_size);
+	put32(buf + KSTAT_BLKSIZE, st.st_blksize);
+	put64(buf + KSTAT_BLOCKS, st.st_blocks);
+	put64(buf + KSTAT_ATIM, st.st_atim.tv_sec);
+	put32(buf + KSTAT_ATIM + 8, st.st_atim.tv_nsec);
+	put64(buf + KSTAT_MTIM, st.st_mtim.tv_sec);
+	put32(buf + KSTAT_MTIM + 8, st.st_mtim.tv_nsec);
+	put64(buf + KSTAT_CTIM, st.st_ctim.tv_sec);
+	put32(buf + KSTAT_CTIM + 8, st.st_ctim.tv_nsec);
+	return copy_out(cs, addr, buf, sizeof(buf));
+}
+
+/* a timespec, or a timeval with usec, both a 64-bit seconds and a
+   32-bit fraction */
+static int sys_time(struct cpu_state *cs, uint32_t addr, int usec)
+{
+	uint64_t t = clint_mtime(cs->clint);
+	uint8_t buf[16];
+
+	memset(buf, 0, sizeof(buf));
+	put64(buf, t / SYS_TIMEBASE);
+	if (usec)
+		put32(buf + 8, t % SYS_TIMEBASE * 1000000 / SYS_TIMEBASE);
+	else
+		put32(buf + 8, t % SYS_TIMEBASE * 1000000000 / SYS_TIMEBASE);
+	return copy_out(cs, addr, buf, sizeof(buf));
+}
+
+/* anywhere from the end of the image up to SYS_STACK below argv,
+   else it stays. 0 asks where it is */
+static uint32_t sys_brk(struct sys *s, uint32_t addr)
+{
+	if (addr >= s->brk_min && s->stack - s->brk_min > SYS_STACK &&
+	    addr <= s->stack - SYS_STACK)
+		s->brk = addr;
+	return s->brk;
+}
+
+void sys_ecall(struct sys *s, struct cpu_state *cs)
+{
+	uint32_t *a = &cs->regs[10], n = cs->regs[17];
+	uint8_t *p;
+	int fd;
+	off_t off;
+
+	switch (n) {
+	case SYS_READ:
+	case SYS_WRITE:
+		fd = host_fd(s, a[0]);
+		p = guest(cs, a[1], a[2]);
+		if (fd < 0) {
+			a[0] = -EBADF;
+			break;
+		}
+		if (!p) {
+			a[0] = -EFAULT;
+			break;
+		}
+		if (n == SYS_WRITE) {
+			a[0] = result(write(fd, p, a[2]));
+			break;
+		}
+		a[0] = result(read(fd, p, a[2]));
+		if ((int32_t)a[0] > 0)
+			mem_stored(cs, a[1] - cs->ram_base, a[0]);
+		break;
+	case SYS_OPENAT:
+		a[0] = sys_openat(s, cs, a[0], a[1], a[2], a[3]);
+		break;
+	case SYS_CLOSE:
+		fd = host_fd(s, a[0]);
+		if (fd < 0) {
+			a[0] = -EBADF;
+			break;
+		}
+		s->fds[a[0]] = -1;
+		a[0] = a[0] < 3 ? 0 : result(close(fd));
+		break;
+	case SYS_LSEEK:
+		fd = host_fd(s, a[0]);
+		if (fd < 0) {
+			a[0] = -EBADF;
+			break;
+		}
+		off = lseek(fd, (int32_t)a[1], a[2]);
+		a[0] = off > INT32_MAX ? -EOVERFLOW : result(off);
+		break;
+	case SYS_FSTAT:
+		a[0] = sys_fstat(s, cs, a[0], a[1]);
+		break;
+	case SYS_BRK:
+		a[0] = sys_brk(s, a[0]);
+		break;
+	case SYS_CLOCK_GETTIME:
+	case SYS_CLOCK_GETTIME64:
+		a[0] = sys_time(cs, a[1], 0);
+		break;
+	case SYS_GETTIMEOFDAY:
+		a[0] = a[0] ? sys_time(cs, a[0], 1) : 0;
+		break;
+	case SYS_EXIT:
+	case SYS_EXIT_GROUP:
+		s->exit(s->dev, a[0] & 0xff);
+		break;
+	default:
+		if (!s->warned)
+			fprintf(stderr, "unknown syscall %u at pc 0x%x\n", n, cs->pc);
+		s->warned = 1;
+		a[0] = -ENOSYS;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef SYSCALLS_H
+#define SYSCALLS_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+	user mode syscalls on ecall, see --syscalls
+
+	the calls of riscv-pk as newlib's libgloss makes them: the number
+	in a7, arguments in a0 - a5, the result or -errno back in a0. the
+	ecall then retires like any other instruction, a trap handler at
+	mtvec never sees it.
+
+	guest fds are host fds, 0 - 2 are the emulator's own. read and
+	write go straight between the host fd and guest ram, the pages
+	they fill count as stored to. open flags are newlib's and the
+	stat buffer is libgloss's struct kernel_stat, time_t is 64-bit.
+
+	clock_gettime and gettimeofday read mtime at SYS_TIMEBASE, the
+	guest sees the time it ran rather than the host's clock, and
+	every run of it sees the same.
+
+	the program starts the way pk starts it: sp at the top of ram
+	pointing to argc, argv and an empty envp, the break right after
+	the image. files and the break aren't part of snapshots, a
+	restored guest gets the break at the middle of ram unless it had
+	it before.
+*/
+
+#define SYS_TIMEBASE 10000000	/* mtime ticks per second, qemu virt's */
+#define SYS_MAX_FDS 64
+#define SYS_STACK 65536		/* the break stays this far below argv */
+
+/* riscv-pk's numbers, the generic linux ones */
+#define SYS_OPENAT 56
+#define SYS_CLOSE 57
+#define SYS_LSEEK 62
+#define SYS_READ 63
+#define SYS_WRITE 64
+#define SYS_FSTAT 80
+#define SYS_EXIT 93
+#define SYS_EXIT_GROUP 94
+#define SYS_CLOCK_GETTIME 113
+#define SYS_GETTIMEOFDAY 169
+#define SYS_BRK 214
+#define SYS_CLOCK_GETTIME64 403
+
+struct sys {
+	int fds[SYS_MAX_FDS];	/* host fd per guest fd, -1 for none */
+	uint32_t brk;		/* 0 until known */
+	uint32_t brk_min;
+	uint32_t stack;		/* lowest byte of argv and its strings */
+	void (*exit)(void *dev, int code);
+	void *dev;
+	int warned;		/* of an unknown call */
+};
+
+struct sys *sys_open(void (*exit)(void *dev, int code), void *dev);
+void sys_close(struct sys *s);
+void sys_reset(struct sys *s, struct cpu_state *cs);
+int sys_start(struct sys *s, struct cpu_state *cs, uint32_t image_end, int argc,
+	char **argv);
+void sys_ecall(struct sys *s, struct cpu_state *cs);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+	library tests of emu_reset, make check runs them. the guest is a
+	few instructions, the tests set pc and write memory themselves.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../emu.h"
+
+static char image[] = "/tmp/rv32-test-XXXXXX";
+static char out[] = "/tmp/rv32-test-XXXXXX";
+static int failed;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		failed = 1; \
+	} \
+} while (0)
+
+static struct emu *open_guest(void)
+{
+	struct emu_config cfg;
+	struct emu *e;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ram_size = 65536;
+	e = emu_create(&cfg);
+	if (!e || emu_load(e, image, 0) < 0) {
+		fprintf(stderr, "can't set up the guest\n");
+		exit(1);
+	}
+	return e;
+}
+
+static uint32_t word(struct emu *e, uint32_t addr)
+{
+	uint32_t v = 0xdeadbeef;
+
+	emu_read_mem(e, addr, &v, 4);
+	return v;
+}
+
+/* checkpoint, store, then a snapshot or delta: the reset still has to
+   bring back the checkpoint's memory */
+static void reset_after_save(int delta)
+{
+	struct emu *e = open_guest();
+	uint32_t v = 7;
+
+	CHECK(emu_checkpoint(e) == 0);
+	CHECK(emu_write_mem(e, 0x4000, &v, 4) == 0);
+	if (delta)
+		CHECK(emu_delta(e, out) == 0);
+	else
+		CHECK(emu_snapshot(e, out) == 0);
+	v = 9;
+	CHECK(emu_write_mem(e, 0x5000, &v, 4) == 0);
+	emu_reset(e);
+	CHECK(word(e, 0x4000) == 0);
+	CHECK(word(e, 0x5000) == 0);
+	emu_destroy(e);
+}
+
+/* a reservation taken after the checkpoint is gone after the reset,
+   the sc.w there fails */
+static void reset_drops_reservation(void)
+{
+	struct emu *e = open_guest();
+
+	emu_set_reg(e, 4, 0x100);
+	emu_set_pc(e, 8);
+	CHECK(emu_checkpoint(e) == 0);
+	emu_set_pc(e, 0);
+	emu_run(e, 1);
+	emu_reset(e);
+	CHECK(emu_get_pc(e) == 8);
+	emu_run(e, 1);
+	CHECK(emu_get_reg(e, 2) == 1);
+	emu_destroy(e);
+}
+
+int main(void)
+{
+	static const uint32_t code[] = {
+		0x100220af,	/* lr.w x1, (x4) */
+		0x0000006f,	/* j . */
+		0x1832212f,	/* sc.w x2, x3, (x4) */
+		0x0000006f,	/* j . */
+	};
+	int fd;
+
+	fd = mkstemp(image);
+	if (fd < 0 || write(fd, code, sizeof(code)) != sizeof(code) || close(fd) < 0)
+		return 1;
+	fd = mkstemp(out);
+	if (fd < 0 || close(fd) < 0)
+		return 1;
+
+	reset_after_save(0);
+	reset_after_save(1);
+	reset_drops_reservation();
+
+	unlink(image);
+	unlink(out);
+	if (!failed)
+		printf("reset: ok\n");
+	return failed;
+}
@@ -0,0 +1,154 @@
+/*
+	library tests of rom, make check runs them. the guest is an elf
+	with a read-only text page at 0 and a data page after it, built
+	here since there is no risc-v toolchain to count on.
+*/
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../emu.h"
+
+static char image[] = "/tmp/rv32-test-XXXXXX";
+static char out[] = "/tmp/rv32-test-XXXXXX";
+static int failed;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		failed = 1; \
+	} \
+} while (0)
+
+/* text at 0x0, data at 0x1000 */
+static int write_image(int fd)
+{
+	static const uint32_t code[] = {
+		0x40102023,	/* sw x1, 0x400(x0) */
+		0x00112023,	/* sw x1, 0(x2) */
+		0x0000006f,	/* j . */
+	};
+	static uint8_t file[0x2004];
+	Elf32_Ehdr *eh = (Elf32_Ehdr*)file;
+	Elf32_Phdr *ph = (Elf32_Phdr*)(file + sizeof(*eh));
+
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS32;
+	eh->e_ident[EI_DATA] = ELFDATA2LSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_type = ET_EXEC;
+	eh->e_machine = EM_RISCV;
+	eh->e_version = EV_CURRENT;
+	eh->e_phoff = sizeof(*eh);
+	eh->e_ehsize = sizeof(*eh);
+	eh->e_phentsize = sizeof(*ph);
+	eh->e_phnum = 2;
+
+	ph[0].p_type = PT_LOAD;
+	ph[0].p_offset = 0x1000;
+	ph[0].p_vaddr = 0;
+	ph[0].p_filesz = 0x1000;
+	ph[0].p_memsz = 0x1000;
+	ph[0].p_flags = PF_R | PF_X;
+	ph[0].p_align = 0x1000;
+	ph[1].p_type = PT_LOAD;
+	ph[1].p_offset = 0x2000;
+	ph[1].p_vaddr = 0x1000;
+	ph[1].p_filesz = 4;
+	ph[1].p_memsz = 0x1000;
+	ph[1].p_flags = PF_R | PF_W;
+	ph[1].p_align = 0x1000;
+
+	memcpy(file + 0x1000, code, sizeof(code));
+	return write(fd, file, sizeof(file)) == sizeof(file) ? 0 : -1;
+}
+
+static struct emu *create(int jit, int guard)
+{
+	struct emu_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ram_size = 65536;
+	cfg.jit = jit;
+	cfg.guard = guard;
+	return emu_create(&cfg);
+}
+
+static struct emu *open_guest(int jit, int guard)
+{
+	struct emu *e = create(jit, guard);
+
+	if (!e || emu_load(e, image, 0) < 0) {
+		fprintf(stderr, "can't set up the guest\n");
+		exit(1);
+	}
+	return e;
+}
+
+/* the store to text faults, the one to data goes through */
+static void stores(struct emu *e)
+{
+	uint32_t v = 0;
+
+	emu_set_reg(e, 1, 0x1234);
+	emu_set_reg(e, 2, 0x1000);
+	emu_set_pc(e, 0);
+	CHECK(emu_run(e, 1) == EMU_FAULT);
+	CHECK(emu_read_mem(e, 0x400, &v, 4) == 0 && v == 0);
+	emu_set_pc(e, 4);
+	CHECK(emu_run(e, 1) == EMU_BUDGET);
+	CHECK(emu_read_mem(e, 0x1000, &v, 4) == 0 && v == 0x1234);
+}
+
+static void rom(int jit, int guard)
+{
+	struct emu *e = open_guest(jit, guard);
+	uint32_t v = 0;
+
+	stores(e);
+	CHECK(emu_read_mem(e, 0, &v, 4) == 0 && v == 0x40102023);
+	CHECK(emu_write_mem(e, 0x400, &v, 4) < 0);
+	CHECK(emu_write_mem(e, 0xffe, &v, 4) < 0);
+	CHECK(emu_write_mem(e, 0x1000, &v, 4) == 0);
+
+	/* loading the image again protects it again */
+	emu_reset(e);
+	stores(e);
+
+	/* so does a snapshot, restored or as a checkpoint */
+	CHECK(emu_snapshot(e, out) == 0);
+	emu_destroy(e);
+	e = create(jit, guard);
+	CHECK(e && emu_restore(e, out) == 0);
+	stores(e);
+	CHECK(emu_checkpoint(e) == 0);
+	emu_reset(e);
+	stores(e);
+	emu_destroy(e);
+}
+
+int main(void)
+{
+	int fd;
+
+	fd = mkstemp(image);
+	if (fd < 0 || write_image(fd) < 0 || close(fd) < 0)
+		return 1;
+	fd = mkstemp(out);
+	if (fd < 0 || close(fd) < 0)
+		return 1;
+
+	rom(0, 0);
+	rom(1, 0);
+	rom(0, 1);
+	rom(1, 1);
+
+	unlink(image);
+	unlink(out);
+	if (!failed)
+		printf("rom: ok\n");
+	return failed;
+}
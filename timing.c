@@ -0,0 +1,370 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "loader.h"
+#include "timing.h"
+
+/* lines per section of the report */
+#define TM_TOP 20
+#define TM_MAX_WAYS 64
+#define TM_MAX_BP_BITS 24
+
+/* an instruction's or a function's counts */
+struct tm_func {
+	uint32_t key;		/* pc, or the index of the symbol */
+	struct tm_site s;
+};
+
+static size_t sites_len(struct timing *t)
+{
+	return (size_t)(t->ram_size / 2) * sizeof(struct tm_site);
+}
+
+/* 16K, 64K, 1M, plain bytes */
+static int parse_num(const char **p, uint32_t *v)
+{
+	char *end;
+	unsigned long n = strtoul(*p, &end, 0);
+
+	if (end == *p)
+		return -1;
+	if (*end == 'k' || *end == 'K') {
+		n <<= 10;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M') {
+		n <<= 20;
+		end++;
+	}
+	if (n > UINT32_MAX)
+		return -1;
+	*v = n;
+	*p = end;
+	return 0;
+}
+
+static int parse_cache(const char **p, struct cache *c)
+{
+	if (parse_num(p, &c->size) < 0 || *(*p)++ != ':' ||
+	    parse_num(p, &c->ways) < 0 || *(*p)++ != ':' ||
+	    parse_num(p, &c->line) < 0)
+		return -1;
+	return 0;
+}
+
+/* the geometry has to come out as a power of two number of sets */
+static int cache_init(struct cache *c)
+{
+	if (c->line < 4 || (c->line & (c->line - 1)) || !c->ways || c->ways > TM_MAX_WAYS ||
+	    c->size % (c->ways * c->line))
+		return -1;
+	c->sets = c->size / (c->ways * c->line);
+	if (!c->sets || (c->sets & (c->sets - 1)))
+		return -1;
+	c->line_shift = __builtin_ctz(c->line);
+	c->tags = (uint32_t*)calloc((size_t)c->sets * c->ways, sizeof(uint32_t));
+	c->used = (uint64_t*)calloc((size_t)c->sets * c->ways, sizeof(uint64_t));
+	c->dirty = (uint8_t*)calloc((size_t)c->sets * c->ways, 1);
+	return c->tags && c->used && c->dirty ? 0 : -1;
+}
+
+static void cache_free(struct cache *c)
+{
+	free(c->tags);
+	free(c->used);
+	free(c->dirty);
+}
+
+static int parse_spec(struct timing *t, const char *spec)
+{
+	const char *p = spec, *v;
+	size_t n;
+
+	while (*p) {
+		v = strchr(p, '=');
+		if (!v)
+			return -1;
+		n = v++ - p;
+		if (n == 1 && *p == 'i') {
+			if (parse_cache(&v, &t->i) < 0)
+				return -1;
+		}
+		else if (n == 1 && *p == 'd') {
+			if (parse_cache(&v, &t->d) < 0)
+				return -1;
+		}
+		else if (n == 2 && !strncmp(p, "bp", 2)) {
+			if (!strncmp(v, "bimodal:", 8))
+				t->predictor = TM_BIMODAL;
+			else if (!strncmp(v, "gshare:", 7))
+				t->predictor = TM_GSHARE;
+			else
+				return -1;
+			v = strchr(v, ':') + 1;
+			if (parse_num(&v, &t->bp_bits) < 0 || !t->bp_bits ||
+			    t->bp_bits > TM_MAX_BP_BITS)
+				return -1;
+		}
+		else if (n == 4 && !strncmp(p, "miss", 4)) {
+			if (parse_num(&v, &t->miss_cycles) < 0)
+				return -1;
+		}
+		else if (n == 10 && !strncmp(p, "mispredict", 10)) {
+			if (parse_num(&v, &t->mispredict_cycles) < 0)
+				return -1;
+		}
+		else {
+			return -1;
+		}
+		if (*v && *v != ',')
+			return -1;
+		p = *v ? v + 1 : v;
+	}
+	return 0;
+}
+
+/* cold caches and predictor for the ram of cs, spec as in timing.h */
+struct timing *tm_open(struct cpu_state *cs, const char *spec)
+{
+	struct cache def = { .size = 16384, .ways = 4, .line = 64 };
+	struct timing *t;
+	void *m;
+
+	t = (struct timing*)calloc(1, sizeof(struct timing));
+	if (!t)
+		return NULL;
+	t->i = def;
+	t->d = def;
+	t->predictor = TM_GSHARE;
+	t->bp_bits = 12;
+	t->miss_cycles = 20;
+	t->mispredict_cycles = 3;
+	if (parse_spec(t, spec ? spec : "") < 0) {
+		fprintf(stderr, "bad timing spec %s, see timing.h\n", spec);
+		free(t);
+		return NULL;
+	}
+	if (cache_init(&t->i) < 0 || cache_init(&t->d) < 0) {
+		fprintf(stderr, "the caches need a power of two line size and number of sets\n");
+		tm_close(t);
+		return NULL;
+	}
+	t->counters = (uint8_t*)malloc(1u << t->bp_bits);
+	t->ram_base = cs->ram_base;
+	t->ram_size = cs->ram_size;
+	/* zero pages until something misses there, like the profile */
+	m = mmap(NULL, sites_len(t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (!t->counters || m == MAP_FAILED) {
+		fprintf(stderr, "can't set up the timing model\n");
+		tm_close(t);
+		return NULL;
+	}
+	t->sites = (struct tm_site*)m;
+	/* weakly not taken */
+	memset(t->counters, 1, 1u << t->bp_bits);
+	t->fetch_line = UINT32_MAX;
+	t->start = cs->icount;
+	return t;
+}
+
+void tm_close(struct timing *t)
+{
+	if (!t)
+		return;
+	cache_free(&t->i);
+	cache_free(&t->d);
+	free(t->counters);
+	if (t->sites)
+		munmap(t->sites, sites_len(t));
+	free(t);
+}
+
+/* look up the line of addr, 1 on a miss. the least recently used way
+   makes room, written back if it is dirty */
+int tm_miss(struct cache *c, uint32_t addr, int write)
+{
+	uint32_t line = addr >> c->line_shift, tag = line + 1;
+	uint32_t set = line & (c->sets - 1), i, lru;
+	uint32_t *tags = &c->tags[set * c->ways];
+	uint64_t *used = &c->used[set * c->ways];
+	uint8_t *dirty = &c->dirty[set * c->ways];
+
+	c->accesses++;
+	c->clock++;
+	lru = 0;
+	for (i = 0; i < c->ways; i++) {
+		if (tags[i] == tag) {
+			used[i] = c->clock;
+			dirty[i] |= write;
+			return 0;
+		}
+		if (used[i] < used[lru])
+			lru = i;
+	}
+	c->misses++;
+	if (dirty[lru])
+		c->writebacks++;
+	tags[lru] = tag;
+	used[lru] = c->clock;
+	dirty[lru] = write;
+	return 1;
+}
+
+static uint64_t stalls(struct timing *t, const struct tm_site *s)
+{
+	return (s->imiss + s->dmiss) * t->miss_cycles + s->mispredicts * t->mispredict_cycles;
+}
+
+static int func_cmp(const void *a, const void *b)
+{
+	const struct tm_func *x = (const struct tm_func*)a, *y = (const struct tm_func*)b;
+	uint64_t n = x->s.imiss + x->s.dmiss + x->s.mispredicts;
+	uint64_t m = y->s.imiss + y->s.dmiss + y->s.mispredicts;
+
+	return n < m ? 1 : n > m ? -1 : 0;
+}
+
+static double pct(uint64_t n, uint64_t total)
+{
+	return total ? 100.0 * n / total : 0;
+}
+
+static void size_str(char *buf, size_t len, uint32_t n)
+{
+	if (n >= (1 << 20) && !(n & ((1 << 20) - 1)))
+		snprintf(buf, len, "%uM", n >> 20);
+	else if (n >= 1024 && !(n & 1023))
+		snprintf(buf, len, "%uK", n >> 10);
+	else
+		snprintf(buf, len, "%u", n);
+}
+
+static void cache_line(FILE *f, const char *name, struct cache *c, uint64_t accesses)
+{
+	char size[16];
+
+	size_str(size, sizeof(size), c->size);
+	fprintf(f, "%s %s %u-way %uB lines: %llu accesses, %llu misses (%.2f%%)",
+		name, size, c->ways, c->line, (unsigned long long)accesses,
+		(unsigned long long)c->misses, pct(c->misses, accesses));
+	if (c->writebacks)
+		fprintf(f, ", %llu writebacks", (unsigned long long)c->writebacks);
+	fprintf(f, "\n");
+}
+
+static void site_line(FILE *f, struct timing *t, const struct tm_site *s, const char *name)
+{
+	fprintf(f, "%12llu %12llu %12llu %14llu  %s\n", (unsigned long long)s->imiss,
+		(unsigned long long)s->dmiss, (unsigned long long)s->mispredicts,
+		(unsigned long long)stalls(t, s), name);
+}
+
+/* totals, then misses by function and by instruction */
+int tm_report(struct timing *t, struct cpu_state *cs, const struct symtab *st, FILE *f)
+{
+	struct tm_func *funcs = NULL, *sites = NULL;
+	struct tm_site *s, other;
+	const struct sym *sym;
+	unsigned char *vec = NULL;
+	long pg = sysconf(_SC_PAGESIZE);
+	uint64_t insns = cs->icount - t->start, cycles;
+	uint32_t i, nsites = 0, cap = 1024;
+	char name[128];
+	int ret = -1;
+
+	cycles = tm_cycles(t, insns);
+	fprintf(f, "%llu instructions, %llu cycles estimated, CPI %.3f\n",
+		(unsigned long long)insns, (unsigned long long)cycles,
+		insns ? (double)cycles / insns : 0);
+	cache_line(f, "icache", &t->i, t->fetches);
+	cache_line(f, "dcache", &t->d, t->d.accesses);
+	fprintf(f, "%s %u bits: %llu branches, %llu mispredicted (%.2f%%)\n",
+		t->predictor == TM_GSHARE ? "gshare" : "bimodal", t->bp_bits,
+		(unsigned long long)t->branches, (unsigned long long)t->mispredicts,
+		pct(t->mispredicts, t->branches));
+	fprintf(f, "1 cycle per instruction, %u per miss, %u per mispredict\n",
+		t->miss_cycles, t->mispredict_cycles);
+
+	/* instructions with a miss, only resident pages have any */
+	vec = (unsigned char*)malloc((sites_len(t) + pg - 1) / pg);
+	if (vec && mincore(t->sites, sites_len(t), vec) < 0) {
+		free(vec);
+		vec = NULL;
+	}
+	sites = (struct tm_func*)malloc(cap * sizeof(struct tm_func));
+	if (!sites)
+		goto out;
+	for (i = 0; i < t->ram_size / 2; i++) {
+		if (vec && !(vec[(size_t)i * sizeof(struct tm_site) / pg] & 1) &&
+		    !(vec[((size_t)i * sizeof(struct tm_site) + sizeof(struct tm_site) - 1) / pg] & 1))
+			continue;
+		s = &t->sites[i];
+		if (!s->imiss && !s->dmiss && !s->mispredicts)
+			continue;
+		if (nsites == cap) {
+			struct tm_func *n = (struct tm_func*)realloc(sites,
+				2 * cap * sizeof(struct tm_func));
+			if (!n)
+				goto out;
+			sites = n;
+			cap *= 2;
+		}
+		sites[nsites].key = t->ram_base + 2 * i;
+		sites[nsites].s = *s;
+		nsites++;
+	}
+
+	/* an instruction belongs to the function its symbol covers */
+	if (st->n) {
+		funcs = (struct tm_func*)calloc(st->n, sizeof(struct tm_func));
+		if (!funcs)
+			goto out;
+		memset(&other, 0, sizeof(other));
+		for (i = 0; i < (uint32_t)st->n; i++)
+			funcs[i].key = i;
+		for (i = 0; i < nsites; i++) {
+			sym = sym_lookup(st, sites[i].key);
+			s = sym ? &funcs[sym - st->syms].s : &other;
+			s->imiss += sites[i].s.imiss;
+			s->dmiss += sites[i].s.dmiss;
+			s->mispredicts += sites[i].s.mispredicts;
+		}
+		qsort(funcs, st->n, sizeof(struct tm_func), func_cmp);
+		fprintf(f, "\nby function\n%12s %12s %12s %14s  function\n",
+			"imiss", "dmiss", "mispredict", "stall cycles");
+		for (i = 0; i < (uint32_t)st->n && i < TM_TOP; i++) {
+			s = &funcs[i].s;
+			if (!s->imiss && !s->dmiss && !s->mispredicts)
+				break;
+			site_line(f, t, s, st->syms[funcs[i].key].name);
+		}
+		if (other.imiss || other.dmiss || other.mispredicts)
+			site_line(f, t, &other, "[no symbol]");
+	}
+
+	qsort(sites, nsites, sizeof(struct tm_func), func_cmp);
+	fprintf(f, "\nby instruction\n%12s %12s %12s %14s  pc\n",
+		"imiss", "dmiss", "mispredict", "stall cycles");
+	for (i = 0; i < nsites && i < TM_TOP; i++) {
+		sym = st->n ? sym_lookup(st, sites[i].key) : NULL;
+		if (!sym)
+			snprintf(name, sizeof(name), "0x%08x", sites[i].key);
+		else
+			snprintf(name, sizeof(name), "0x%08x %s+0x%x", sites[i].key,
+				sym->name, sites[i].key - sym->addr);
+		site_line(f, t, &sites[i].s, name);
+	}
+	ret = ferror(f) ? -1 : 0;
+
+out:
+	free(vec);
+	free(sites);
+	free(funcs);
+	return ret;
+}
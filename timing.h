@@ -0,0 +1,144 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+
+/*
+	cache and branch predictor model, see --timing
+
+	an interpreter variant of its own feeds it every instruction fetch,
+	every load and store and every conditional branch, the other loops
+	don't know it exists. split l1 caches, set associative with lru
+	replacement, write back and write allocate. the predictor is a
+	table of 2-bit counters indexed by pc (bimodal) or by pc xor the
+	global history (gshare). atomics other than lr.w and the jumps
+	aren't modeled.
+
+	cycles are estimated as one per instruction plus a penalty per
+	cache miss and per mispredicted branch. misses and mispredicts are
+	counted per instruction too, the report adds them up per function.
+
+	the spec is a comma separated list, anything left out keeps its
+	default:
+
+		i=<size>:<ways>:<line>	l1 instruction cache, 16K:4:64
+		d=<size>:<ways>:<line>	l1 data cache, 16K:4:64
+		bp=<bimodal|gshare>:<bits>	2^bits counters, gshare:12
+		miss=<cycles>		per cache miss, 20
+		mispredict=<cycles>	per mispredicted branch, 3
+*/
+
+struct cache {
+	uint32_t size;		/* bytes */
+	uint32_t ways;
+	uint32_t line;		/* bytes, a power of two */
+	uint32_t sets;		/* a power of two */
+	int line_shift;
+	uint32_t *tags;		/* line number + 1 per way, 0 is empty */
+	uint64_t *used;		/* clock of the last access per way */
+	uint8_t *dirty;
+	uint64_t clock;
+	uint64_t accesses;
+	uint64_t misses;
+	uint64_t writebacks;
+};
+
+enum {
+	TM_BIMODAL = 1,
+	TM_GSHARE,
+};
+
+/* per halfword of ram, charged to the instruction at pc */
+struct tm_site {
+	uint64_t imiss;
+	uint64_t dmiss;
+	uint64_t mispredicts;
+};
+
+struct timing {
+	struct cache i, d;
+	int predictor;
+	uint32_t bp_bits;
+	uint8_t *counters;	/* 2-bit, taken from 2 up */
+	uint32_t history;	/* gshare's, last branch in bit 0 */
+	uint64_t branches;
+	uint64_t mispredicts;
+	uint32_t miss_cycles;
+	uint32_t mispredict_cycles;
+	uint32_t fetch_line;	/* of the last fetch, UINT32_MAX for none */
+	uint64_t fetches;
+	struct tm_site *sites;
+	uint32_t ram_base;
+	uint32_t ram_size;
+	uint64_t start;		/* icount when the model started */
+};
+
+struct symtab;
+
+struct timing *tm_open(struct cpu_state *cs, const char *spec);
+void tm_close(struct timing *t);
+int tm_miss(struct cache *c, uint32_t addr, int write);
+int tm_report(struct timing *t, struct cpu_state *cs, const struct symtab *st, FILE *f);
+
+/* the estimate for insns instructions run under the model */
+static inline uint64_t tm_cycles(struct timing *t, uint64_t insns)
+{
+	return insns + (t->i.misses + t->d.misses) * t->miss_cycles +
+		t->mispredicts * t->mispredict_cycles;
+}
+
+static inline struct tm_site *tm_site(struct timing *t, uint32_t pc)
+{
+	uint32_t off = pc - t->ram_base;
+
+	return off < t->ram_size ? &t->sites[off >> 1] : NULL;
+}
+
+/* straight line code stays in one line, only the first fetch there
+   looks it up. nothing else touches the instruction cache */
+static inline void tm_fetch(struct timing *t, uint32_t pc)
+{
+	struct tm_site *s;
+
+	t->fetches++;
+	if (pc >> t->i.line_shift == t->fetch_line)
+		return;
+	t->fetch_line = pc >> t->i.line_shift;
+	if (tm_miss(&t->i, pc, 0) && (s = tm_site(t, pc)))
+		s->imiss++;
+}
+
+static inline void tm_data(struct timing *t, uint32_t addr, int write, uint32_t pc)
+{
+	struct tm_site *s;
+
+	if (tm_miss(&t->d, addr, write) && (s = tm_site(t, pc)))
+		s->dmiss++;
+}
+
+static inline void tm_branch(struct timing *t, uint32_t pc, int taken)
+{
+	uint32_t i = pc >> 1;
+	uint8_t *c;
+	struct tm_site *s;
+
+	if (t->predictor == TM_GSHARE)
+		i ^= t->history;
+	c = &t->counters[i & ((1u << t->bp_bits) - 1)];
+	t->branches++;
+	if ((*c >= 2) != taken) {
+		t->mispredicts++;
+		if ((s = tm_site(t, pc)))
+			s->mispredicts++;
+	}
+	if (taken && *c < 3)
+		(*c)++;
+	else if (!taken && *c > 0)
+		(*c)--;
+	t->history = t->history << 1 | taken;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "loader.h"
+#include "trace.h"
+
+void *trace_writer(void *arg)
+{
+	struct trace *t = (struct trace*)arg;
+	struct timespec ts = { 0, 100000 };
+	uint64_t head, tail = 0, n;
+	int done;
+
+	while (1) {
+		/* done first, so head includes everything written before it */
+		done = atomic_load_explicit(&t->done, memory_order_acquire);
+		head = atomic_load_explicit(&t->head, memory_order_acquire);
+		if (head == tail) {
+			if (done) break;
+			fflush(t->f);
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		n = head - tail;
+		if (n > TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1)))
+			n = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1));
+		fwrite(&t->ring[tail & (TRACE_RING_SIZE - 1)], sizeof(struct trace_rec), n, t->f);
+		tail += n;
+		atomic_store_explicit(&t->tail, tail, memory_order_release);
+	}
+	fflush(t->f);
+	return NULL;
+}
+
+struct trace *trace_open(const char *path)
+{
+	struct trace *t;
+
+	t = (struct trace*)calloc(1, sizeof(struct trace));
+	if (!t) return NULL;
+	t->f = fopen(path, "wb");
+	if (!t->f) {
+		free(t);
+		return NULL;
+	}
+	fwrite(TRACE_MAGIC, 1, 8, t->f);
+	if (pthread_create(&t->thread, NULL, trace_writer, t)) {
+		fclose(t->f);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void trace_close(struct trace *t)
+{
+	atomic_store_explicit(&t->done, 1, memory_order_release);
+	pthread_join(t->thread, NULL);
+	fclose(t->f);
+	free(t);
+}
+
+/* print a trace file the way the emulator used to print while running */
+/* symbols label function entries, st may be empty */
+int trace_decode(const char *path, const struct symtab *st)
+{
+	const struct sym *s;
+	struct trace_rec r[1024];
+	struct insn in;
+	char magic[8];
+	size_t i, n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		printf("can't open %s\n", path);
+		return -1;
+	}
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8)) {
+		printf("%s is not a trace file\n", path);
+		fclose(f);
+		return -1;
+	}
+	while ((n = fread(r, sizeof(struct trace_rec), 1024, f)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (is_compressed(r[i].insn))
+				decode_compressed_cmd(r[i].insn, &in);
+			else
+				decode_cmd(r[i].insn, &in);
+			s = sym_lookup(st, r[i].pc);
+			if (s && s->addr == r[i].pc)
+				printf("<%s>:\n", s->name);
+			print_insn(r[i].pc, r[i].insn, &in, r[i].addr);
+		}
+	}
+	fclose(f);
+	return 0;
+}
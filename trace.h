@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+/*
+	binary instruction trace
+
+	the emulator thread appends fixed size records to a single producer,
+	single consumer ring, a writer thread drains it to the trace file.
+	the file is TRACE_MAGIC followed by records in host byte order.
+*/
+
+struct trace_rec {
+	uint32_t pc;
+	uint32_t insn;		/* raw opcode, upper half is 0 for compressed ones */
+	uint32_t rd;		/* rd after the instruction */
+	uint32_t addr;		/* effective address of loads and stores */
+};
+
+#define TRACE_MAGIC "RV32TRC1"
+#define TRACE_RING_SIZE (1 << 16)	/* records, power of two */
+
+struct trace {
+	struct trace_rec ring[TRACE_RING_SIZE];
+	_Alignas(64) _Atomic uint64_t head;	/* written by the emulator */
+	_Alignas(64) _Atomic uint64_t tail;	/* written by the writer thread */
+	_Atomic int done;
+	FILE *f;
+	pthread_t thread;
+};
+
+struct symtab;
+
+struct trace *trace_open(const char *path);
+void trace_close(struct trace *t);
+int trace_decode(const char *path, const struct symtab *st);
+
+static inline void trace_put(struct trace *t, struct trace_rec *r)
+{
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+	while (head - atomic_load_explicit(&t->tail, memory_order_acquire) == TRACE_RING_SIZE)
+		sched_yield();
+	t->ring[head & (TRACE_RING_SIZE - 1)] = *r;
+	atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+#endif
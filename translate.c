@@ -0,0 +1,688 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "aot.h"
+#include "emu.h"
+#include "translate.h"
+
+/*
+	the walk: block starts go into a set and a queue. a block runs
+	from its start to the first branch or jump, or up to an
+	instruction the translation leaves to the interpreter. the
+	targets of its last instruction are queued, the address after a
+	call as well since the callee comes back there, and so is the
+	address after an instruction left to the interpreter unless it is
+	an mret. lui, auipc and addi are followed within a block, so jalr
+	and mtvec targets put together from them are found too.
+*/
+
+/* how a block ends */
+enum {
+	END_JUMP,	/* its last instruction is a branch or jump */
+	END_STOP,	/* before an instruction left to the interpreter */
+	END_SPLIT,	/* AOT_MAX_INSNS long, the next block goes on */
+};
+
+struct block {
+	uint32_t start, end;
+	int kind;
+	int n;
+	struct insn in[AOT_MAX_INSNS];
+	uint32_t pc[AOT_MAX_INSNS];
+};
+
+struct walk {
+	struct emu *e;
+	uint32_t *set;		/* pc + 1 of every queued start, 0 is empty */
+	uint32_t cap, nset;
+	uint32_t *queue;
+	uint32_t nqueue, maxqueue, head;
+	uint32_t *starts;	/* blocks with at least one instruction */
+	uint32_t nstarts, maxstarts;
+	uint32_t lo, hi;
+};
+
+static int translated(int op)
+{
+	switch (op) {
+	case OP_LUI: case OP_AUIPC: case OP_JAL: case OP_JALR:
+	case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+	case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+	case OP_SB: case OP_SH: case OP_SW:
+	case OP_ADDI: case OP_SLTI: case OP_SLTIU: case OP_XORI: case OP_ORI: case OP_ANDI:
+	case OP_SLLI: case OP_SRLI: case OP_SRAI:
+	case OP_ADD: case OP_SUB: case OP_SLL: case OP_SLT: case OP_SLTU:
+	case OP_XOR: case OP_SRL: case OP_SRA: case OP_OR: case OP_AND:
+	case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+	case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+	case OP_FENCE: case OP_FENCE_I:
+		return 1;
+	}
+	return 0;
+}
+
+static int writes_rd(int op)
+{
+	switch (op) {
+	case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+	case OP_SB: case OP_SH: case OP_SW:
+	case OP_FENCE: case OP_FENCE_I:
+		return 0;
+	}
+	return 1;
+}
+
+static int fetch(struct emu *e, uint32_t pc, struct insn *in)
+{
+	uint16_t h[2];
+
+	memset(in, 0, sizeof(*in));
+	if ((pc & 1) || emu_read_mem(e, pc, h, 2) < 0)
+		return -1;
+	if (is_compressed(le16(h[0]))) {
+		decode_compressed_cmd(le16(h[0]), in);
+		return 0;
+	}
+	if (emu_read_mem(e, pc + 2, h + 1, 2) < 0)
+		return -1;
+	decode_cmd(le16(h[0]) | (uint32_t)le16(h[1]) << 16, in);
+	return 0;
+}
+
+static int grow(uint32_t **p, uint32_t n, uint32_t *max)
+{
+	uint32_t *q;
+
+	if (n < *max)
+		return 0;
+	q = (uint32_t*)realloc(*p, (*max ? 2 * *max : 1024) * sizeof(uint32_t));
+	if (!q)
+		return -1;
+	*p = q;
+	*max = *max ? 2 * *max : 1024;
+	return 0;
+}
+
+static uint32_t *slot(uint32_t *set, uint32_t cap, uint32_t pc)
+{
+	uint32_t i = (pc * 0x9e3779b1u) & (cap - 1);
+
+	while (set[i] && set[i] != pc + 1)
+		i = (i + 1) & (cap - 1);
+	return &set[i];
+}
+
+/* a new block start, once */
+static int queue(struct walk *w, uint32_t pc)
+{
+	uint32_t *old = w->set, cap = w->cap, i, *s;
+
+	if (2 * (w->nset + 1) > w->cap) {
+		w->cap = w->cap ? 2 * w->cap : 1024;
+		w->set = (uint32_t*)calloc(w->cap, sizeof(uint32_t));
+		if (!w->set)
+			return -1;
+		for (i = 0; i < cap; i++)
+			if (old[i])
+				*slot(w->set, w->cap, old[i] - 1) = old[i];
+		free(old);
+	}
+	s = slot(w->set, w->cap, pc);
+	if (*s)
+		return 0;
+	*s = pc + 1;
+	w->nset++;
+	if (grow(&w->queue, w->nqueue, &w->maxqueue) < 0)
+		return -1;
+	w->queue[w->nqueue++] = pc;
+	return 0;
+}
+
+/* decode the block at start, queue what it leads to if w is given */
+static void walk_block(struct emu *e, uint32_t start, struct block *b, struct walk *w)
+{
+	uint32_t pc = start, known = 1, val[32] = { 0 }, v = 0;
+	struct insn *in;
+	int k;
+
+	b->start = start;
+	b->n = 0;
+	for (;;) {
+		if (b->n == AOT_MAX_INSNS) {
+			b->kind = END_SPLIT;
+			if (w)
+				queue(w, pc);
+			break;
+		}
+		in = &b->in[b->n];
+		if (fetch(e, pc, in) < 0 || in->op == OP_INVALID) {
+			b->kind = END_STOP;
+			break;
+		}
+		if (!translated(in->op)) {
+			b->kind = END_STOP;
+			if (w && in->op == OP_CSRRW &&
+			    (in->imm & 0xfff) == CSR_MTVEC && (known & (1u << in->rs1)))
+				queue(w, val[in->rs1] & ~3);
+			if (w && in->op != OP_MRET)
+				queue(w, pc + in->len);
+			break;
+		}
+		b->pc[b->n++] = pc;
+		switch (in->op) {
+		case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+			if (w) {
+				queue(w, pc + in->imm);
+				queue(w, pc + in->len);
+			}
+			b->kind = END_JUMP;
+			b->end = pc + in->len;
+			return;
+		case OP_JAL:
+		case OP_JALR:
+			if (w && in->op == OP_JAL)
+				queue(w, pc + in->imm);
+			if (w && in->op == OP_JALR && (known & (1u << in->rs1)))
+				queue(w, (val[in->rs1] + in->imm) & ~1);
+			if (w && in->rd)
+				queue(w, pc + in->len);
+			b->kind = END_JUMP;
+			b->end = pc + in->len;
+			return;
+		}
+		if (writes_rd(in->op) && in->rd) {
+			k = 1;
+			if (in->op == OP_LUI)
+				v = in->imm;
+			else if (in->op == OP_AUIPC)
+				v = pc + in->imm;
+			else if (in->op == OP_ADDI && (known & (1u << in->rs1)))
+				v = val[in->rs1] + in->imm;
+			else
+				k = 0;
+			known &= ~(1u << in->rd);
+			if (k) {
+				val[in->rd] = v;
+				known |= 1u << in->rd;
+			}
+		}
+		pc += in->len;
+	}
+	b->end = pc;
+}
+
+/* the generated file's helpers, LD and ST go to ram inline and take
+   the device path through the emulator with the state written back */
+static const char prologue[] =
+"/* generated by rv32_emu --translate, see aot.h */\n"
+"#include <stdint.h>\n"
+"#include <string.h>\n"
+"\n"
+"#include \"cpu.h\"\n"
+"#include \"mem.h\"\n"
+"#include \"aot.h\"\n"
+"\n"
+"/* blocks chain with sibling calls, without optimization every one\n"
+"   goes back to aot_loop so the stack doesn't grow */\n"
+"#if defined(__has_attribute)\n"
+"#if __has_attribute(musttail)\n"
+"#define TAIL __attribute__((musttail))\n"
+"#endif\n"
+"#endif\n"
+"#if !defined(TAIL) && defined(__OPTIMIZE__)\n"
+"#define TAIL\n"
+"#endif\n"
+"\n"
+"#ifdef TAIL\n"
+"#define GOTO(target) \\\n"
+"\tdo { \\\n"
+"\t\tcs->pc = (target); \\\n"
+"\t\tif (cs->icount < cpu_limit(cs) && cs->pc - LO < HI - LO && \\\n"
+"\t\t    !(cs->pc & 1) && (fn = cs->aot->table[(cs->pc - LO) >> 1])) \\\n"
+"\t\t\tTAIL return fn(cs); \\\n"
+"\t\treturn 0; \\\n"
+"\t} while (0)\n"
+"#else\n"
+"#define GOTO(target) \\\n"
+"\tdo { \\\n"
+"\t\t(void)fn; \\\n"
+"\t\tcs->pc = (target); \\\n"
+"\t\treturn 0; \\\n"
+"\t} while (0)\n"
+"#endif\n"
+"\n"
+"static inline uint32_t ram_ld(struct cpu_state *cs, uint32_t off, int size)\n"
+"{\n"
+"\tuint32_t w;\n"
+"\tuint16_t h;\n"
+"\n"
+"\tif (size == 1)\n"
+"\t\treturn cs->ram[off];\n"
+"\tif (size == 2) {\n"
+"\t\tmemcpy(&h, cs->ram + off, 2);\n"
+"\t\treturn le16(h);\n"
+"\t}\n"
+"\tmemcpy(&w, cs->ram + off, 4);\n"
+"\treturn le32(w);\n"
+"}\n"
+"\n"
+"static inline void ram_st(struct cpu_state *cs, uint32_t off, uint32_t v, int size)\n"
+"{\n"
+"\tuint16_t h = le16((uint16_t)v);\n"
+"\tuint32_t w = le32(v);\n"
+"\n"
+"\tif (size == 1)\n"
+"\t\tcs->ram[off] = v;\n"
+"\telse if (size == 2)\n"
+"\t\tmemcpy(cs->ram + off, &h, 2);\n"
+"\telse\n"
+"\t\tmemcpy(cs->ram + off, &w, 4);\n"
+"\tram_stored(off, size, cs);\n"
+"}\n"
+"\n"
+"/* pc and icount are those of the access for devices and faults */\n"
+"static __attribute__((noinline)) uint32_t ld_slow(struct cpu_state *cs,\n"
+"\tuint32_t addr, int size, int n, uint32_t pc)\n"
+"{\n"
+"\tuint32_t v;\n"
+"\n"
+"\tcs->pc = pc;\n"
+"\tcs->icount += n;\n"
+"\tv = mem_read_slow(addr, size, cs);\n"
+"\tcs->icount -= n;\n"
+"\treturn v;\n"
+"}\n"
+"\n"
+"static __attribute__((noinline)) void st_slow(struct cpu_state *cs,\n"
+"\tuint32_t addr, uint32_t v, int size, int n, uint32_t pc)\n"
+"{\n"
+"\tcs->pc = pc;\n"
+"\tcs->icount += n;\n"
+"\tmem_write_slow(addr, v, size, cs);\n"
+"\tcs->icount -= n;\n"
+"}\n"
+"\n"
+"/* sync writes the block's registers back before the slow path */\n"
+"#define LD(size, n, pc, addr, sync) \\\n"
+"\t(a = (addr), a - cs->ram_base <= cs->ram_size - (size) ? \\\n"
+"\t\tram_ld(cs, a - cs->ram_base, size) : \\\n"
+"\t\t((void)(sync), ld_slow(cs, a, size, n, pc)))\n"
+"/* nonzero when the store hit translated code. rom faults in the slow\n"
+"   path, where pc and the registers are right */\n"
+"#define ST(size, n, pc, addr, v, sync) \\\n"
+"\t(a = (addr), a - cs->ram_base <= cs->ram_size - (size) && \\\n"
+"\t    !rom_page(a - cs->ram_base, cs) && !rom_page(a - cs->ram_base + (size) - 1, cs) ? \\\n"
+"\t\tram_st(cs, a - cs->ram_base, v, size) : \\\n"
+"\t\t((void)(sync), st_slow(cs, a, v, size, n, pc)), cs->jit_flush)\n"
+"\n";
+
+static const char *reg(int r, char *buf)
+{
+	if (!r)
+		return "0u";
+	sprintf(buf, "x%d", r);
+	return buf;
+}
+
+/* registers a block reads or writes */
+static uint32_t used_regs(struct block *b, uint32_t *written)
+{
+	uint32_t used = 0;
+	struct insn *in;
+	int i;
+
+	*written = 0;
+	for (i = 0; i < b->n; i++) {
+		in = &b->in[i];
+		if (writes_rd(in->op) && in->rd)
+			*written |= 1u << in->rd;
+		switch (in->op) {
+		case OP_LUI: case OP_AUIPC: case OP_JAL: case OP_FENCE: case OP_FENCE_I:
+			break;
+		case OP_JALR: case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+		case OP_ADDI: case OP_SLTI: case OP_SLTIU: case OP_XORI: case OP_ORI: case OP_ANDI:
+		case OP_SLLI: case OP_SRLI: case OP_SRAI:
+			used |= 1u << in->rs1;
+			break;
+		default:
+			used |= 1u << in->rs1 | 1u << in->rs2;
+		}
+	}
+	return (used | *written) & ~1u;
+}
+
+/* the register write back as statements, or as an expression */
+static void sync_stmt(FILE *f, uint32_t written, const char *indent)
+{
+	int r;
+
+	for (r = 1; r < 32; r++)
+		if (written & (1u << r))
+			fprintf(f, "%scs->regs[%d] = x%d;\n", indent, r, r);
+}
+
+static void sync_expr(char *s, uint32_t written)
+{
+	int r;
+
+	s += sprintf(s, "(");
+	for (r = 1; r < 32; r++)
+		if (written & (1u << r))
+			s += sprintf(s, "cs->regs[%d] = x%d, ", r, r);
+	sprintf(s, "0)");
+}
+
+static const char *const alu_ops[OP_MAX] = {
+	[OP_ADD] = "+", [OP_SUB] = "-", [OP_XOR] = "^", [OP_OR] = "|", [OP_AND] = "&",
+	[OP_ADDI] = "+", [OP_XORI] = "^", [OP_ORI] = "|", [OP_ANDI] = "&",
+	[OP_MUL] = "*",
+};
+
+static const char *const branch_ops[OP_MAX] = {
+	[OP_BEQ] = "==", [OP_BNE] = "!=", [OP_BLT] = "<", [OP_BGE] = ">=",
+	[OP_BLTU] = "<", [OP_BGEU] = ">=",
+};
+
+/* one instruction that neither branches nor jumps */
+static void emit_insn(FILE *f, struct insn *in, uint32_t pc, int i, const char *sync,
+	uint32_t written)
+{
+	char b1[8], b2[8], b3[8];
+	const char *d = reg(in->rd, b1), *s = reg(in->rs1, b2), *t = reg(in->rs2, b3);
+	uint32_t imm = in->imm;
+	int size;
+
+	switch (in->op) {
+	case OP_LB: case OP_LBU: size = 1; break;
+	case OP_LH: case OP_LHU: case OP_SH: size = 2; break;
+	case OP_SB: size = 1; break;
+	default: size = 4;
+	}
+
+	switch (in->op) {
+	case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+		if (in->rd)
+			fprintf(f, "\t%s = ", d);
+		else
+			fprintf(f, "\t(void)");
+		fprintf(f, "%sLD(%d, %d, 0x%xu, %s + 0x%xu, %s);\n",
+			in->op == OP_LB ? "(uint32_t)(int8_t)" :
+			in->op == OP_LH ? "(uint32_t)(int16_t)" : "",
+			size, i, pc, s, imm, sync);
+		return;
+	case OP_SB: case OP_SH: case OP_SW:
+		fprintf(f, "\tif (ST(%d, %d, 0x%xu, %s + 0x%xu, %s, %s)) {\n",
+			size, i, pc, s, imm, t, sync);
+		sync_stmt(f, written, "\t\t");
+		fprintf(f, "\t\tcs->icount += %d;\n\t\tcs->pc = 0x%xu;\n\t\treturn 0;\n\t}\n",
+			i + 1, pc + in->len);
+		return;
+	case OP_FENCE: case OP_FENCE_I:
+		/* one hart, nothing to order */
+		return;
+	}
+	if (!in->rd)
+		return;
+	fprintf(f, "\t%s = ", d);
+	switch (in->op) {
+	case OP_LUI:
+		fprintf(f, "0x%xu;\n", imm);
+		break;
+	case OP_AUIPC:
+		fprintf(f, "0x%xu;\n", pc + imm);
+		break;
+	case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI:
+		fprintf(f, "%s %s 0x%xu;\n", s, alu_ops[in->op], imm);
+		break;
+	case OP_SLTI:
+		fprintf(f, "(int32_t)%s < (int32_t)0x%xu;\n", s, imm);
+		break;
+	case OP_SLTIU:
+		fprintf(f, "%s < 0x%xu;\n", s, imm);
+		break;
+	case OP_SLLI:
+		fprintf(f, "%s << %u;\n", s, imm & 0x1f);
+		break;
+	case OP_SRLI:
+		fprintf(f, "%s >> %u;\n", s, imm & 0x1f);
+		break;
+	case OP_SRAI:
+		fprintf(f, "(uint32_t)((int32_t)%s >> %u);\n", s, imm & 0x1f);
+		break;
+	case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND: case OP_MUL:
+		fprintf(f, "%s %s %s;\n", s, alu_ops[in->op], t);
+		break;
+	case OP_SLL:
+		fprintf(f, "%s << (%s & 0x1f);\n", s, t);
+		break;
+	case OP_SRL:
+		fprintf(f, "%s >> (%s & 0x1f);\n", s, t);
+		break;
+	case OP_SRA:
+		fprintf(f, "(uint32_t)((int32_t)%s >> (%s & 0x1f));\n", s, t);
+		break;
+	case OP_SLT:
+		fprintf(f, "(int32_t)%s < (int32_t)%s;\n", s, t);
+		break;
+	case OP_SLTU:
+		fprintf(f, "%s < %s;\n", s, t);
+		break;
+	case OP_MULH:
+		fprintf(f, "(uint32_t)(((int64_t)(int32_t)%s * (int32_t)%s) >> 32);\n", s, t);
+		break;
+	case OP_MULHSU:
+		fprintf(f, "(uint32_t)(((int64_t)(int32_t)%s * (int64_t)%s) >> 32);\n", s, t);
+		break;
+	case OP_MULHU:
+		fprintf(f, "(uint32_t)(((uint64_t)%s * %s) >> 32);\n", s, t);
+		break;
+	/* the spec's results for division by zero and overflow */
+	case OP_DIV:
+		fprintf(f, "%s == 0 ? 0xffffffffu : %s == 0xffffffffu ? -%s : "
+			"(uint32_t)((int32_t)%s / (int32_t)%s);\n", t, t, s, s, t);
+		break;
+	case OP_DIVU:
+		fprintf(f, "%s == 0 ? 0xffffffffu : %s / %s;\n", t, s, t);
+		break;
+	case OP_REM:
+		fprintf(f, "%s == 0 ? %s : %s == 0xffffffffu ? 0 : "
+			"(uint32_t)((int32_t)%s %% (int32_t)%s);\n", t, s, t, s, t);
+		break;
+	case OP_REMU:
+		fprintf(f, "%s == 0 ? %s : %s %% %s;\n", t, s, s, t);
+		break;
+	}
+}
+
+static void emit_block(FILE *f, struct block *b)
+{
+	char b1[8], b2[8], b3[8], sync[32 * 24];
+	uint32_t used, written, pc;
+	struct insn *in;
+	int i, r, n = b->n, mem = 0, first;
+
+	used = used_regs(b, &written);
+	sync_expr(sync, written);
+	for (i = 0; i < n; i++)
+		if (b->in[i].op >= OP_LB && b->in[i].op <= OP_SW)
+			mem = 1;
+
+	fprintf(f, "static int b_%x(struct cpu_state *cs)\n{\n", b->start);
+	first = 1;
+	for (r = 1; r < 32; r++) {
+		if (!(used & (1u << r)))
+			continue;
+		fprintf(f, "%s x%d = cs->regs[%d]", first ? "\tuint32_t" : ",", r, r);
+		first = 0;
+	}
+	if (!first)
+		fprintf(f, ";\n");
+	in = &b->in[n - 1];
+	if (mem || in->op == OP_JALR)
+		fprintf(f, "\tuint32_t a;\n");
+	if (branch_ops[in->op])
+		fprintf(f, "\tint c;\n");
+	if (b->kind != END_STOP)
+		fprintf(f, "\taot_fn fn;\n");
+	fprintf(f, "\n");
+
+	for (i = 0; i < n - (b->kind == END_JUMP); i++)
+		emit_insn(f, &b->in[i], b->pc[i], i, sync, written);
+
+	if (b->kind == END_STOP) {
+		sync_stmt(f, written, "\t");
+		fprintf(f, "\tcs->icount += %d;\n\tcs->pc = 0x%xu;\n\treturn 0;\n}\n\n", n, b->end);
+		return;
+	}
+	if (b->kind == END_SPLIT) {
+		sync_stmt(f, written, "\t");
+		fprintf(f, "\tcs->icount += %d;\n\tGOTO(0x%xu);\n}\n\n", n, b->end);
+		return;
+	}
+
+	pc = b->pc[n - 1];
+	if (branch_ops[in->op]) {
+		if (in->op == OP_BLT || in->op == OP_BGE)
+			fprintf(f, "\tc = (int32_t)%s %s (int32_t)%s;\n", reg(in->rs1, b2),
+				branch_ops[in->op], reg(in->rs2, b3));
+		else
+			fprintf(f, "\tc = %s %s %s;\n", reg(in->rs1, b2),
+				branch_ops[in->op], reg(in->rs2, b3));
+		sync_stmt(f, written, "\t");
+		fprintf(f, "\tcs->icount += %d;\n\tGOTO(c ? 0x%xu : 0x%xu);\n}\n\n",
+			n, pc + in->imm, pc + in->len);
+		return;
+	}
+	/* the target before the link, rd may be rs1 */
+	if (in->op == OP_JALR)
+		fprintf(f, "\ta = (%s + 0x%xu) & ~1u;\n", reg(in->rs1, b2), (uint32_t)in->imm);
+	if (in->rd)
+		fprintf(f, "\t%s = 0x%xu;\n", reg(in->rd, b1), pc + in->len);
+	sync_stmt(f, written, "\t");
+	fprintf(f, "\tcs->icount += %d;\n", n);
+	if (in->op == OP_JALR)
+		fprintf(f, "\tGOTO(a);\n}\n\n");
+	else
+		fprintf(f, "\tGOTO(0x%xu);\n}\n\n", pc + in->imm);
+}
+
+static int cmp_pc(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int emit(FILE *f, struct walk *w, struct block *b)
+{
+	uint8_t *code;
+	uint32_t i, len = w->hi - w->lo;
+
+	code = (uint8_t*)malloc(len);
+	if (!code || emu_read_mem(w->e, w->lo, code, len) < 0) {
+		free(code);
+		return -1;
+	}
+	fprintf(f, "%s#define LO 0x%xu\n#define HI 0x%xu\n\n", prologue, w->lo, w->hi);
+	for (i = 0; i < w->nstarts; i++)
+		fprintf(f, "static int b_%x(struct cpu_state *cs);\n", w->starts[i]);
+	fprintf(f, "\n");
+	for (i = 0; i < w->nstarts; i++) {
+		walk_block(w->e, w->starts[i], b, NULL);
+		emit_block(f, b);
+	}
+
+	fprintf(f, "static const aot_fn table[(HI - LO) / 2] = {\n");
+	for (i = 0; i < w->nstarts; i++)
+		fprintf(f, "\t[0x%x] = b_%x,\n", (w->starts[i] - w->lo) >> 1, w->starts[i]);
+	fprintf(f, "};\n\nstatic const uint8_t code[] = {");
+	for (i = 0; i < len; i++)
+		fprintf(f, "%s0x%02x,", i % 16 ? " " : "\n\t", code[i]);
+	fprintf(f, "\n};\n\nstatic const uint32_t blocks[] = {\n");
+	for (i = 0; i < w->nstarts; i++) {
+		walk_block(w->e, w->starts[i], b, NULL);
+		fprintf(f, "\t0x%x, 0x%x,\n", b->start, b->end);
+	}
+	fprintf(f, "};\n\nconst struct aot_module rv32_aot_module = {\n"
+		"\tAOT_VERSION, sizeof(struct cpu_state), LO, HI,\n"
+		"\ttable, code, blocks, %u,\n};\n", w->nstarts);
+	free(code);
+	return 0;
+}
+
+int translate(const char *image, const char *out, const struct emu_config *cfg,
+	uint32_t load_addr)
+{
+	struct emu_config c = *cfg;
+	struct walk w;
+	struct block *b = NULL;
+	FILE *f = NULL;
+	uint32_t pc;
+	int ret = -1;
+
+	/* only loaded, never run */
+	c.jit = 0;
+	c.aot = NULL;
+	c.trace = NULL;
+	c.profile = 0;
+	c.harts = 0;
+	memset(&w, 0, sizeof(w));
+	w.e = emu_create(&c);
+	if (!w.e || emu_load(w.e, image, load_addr) < 0)
+		goto out;
+	b = (struct block*)malloc(sizeof(struct block));
+	if (!b || queue(&w, emu_get_pc(w.e)) < 0)
+		goto out;
+	w.lo = UINT32_MAX;
+	while (w.head < w.nqueue) {
+		pc = w.queue[w.head++];
+		walk_block(w.e, pc, b, &w);
+		if (!b->n)
+			continue;
+		if (grow(&w.starts, w.nstarts, &w.maxstarts) < 0)
+			goto out;
+		w.starts[w.nstarts++] = pc;
+		if (b->start < w.lo)
+			w.lo = b->start;
+		if (b->end > w.hi)
+			w.hi = b->end;
+	}
+	if (!w.nstarts) {
+		printf("%s: nothing to translate at the entry point\n", image);
+		goto out;
+	}
+	qsort(w.starts, w.nstarts, sizeof(uint32_t), cmp_pc);
+
+	f = out ? fopen(out, "w") : stdout;
+	if (!f) {
+		printf("can't create %s\n", out);
+		goto out;
+	}
+	if (emit(f, &w, b) < 0) {
+		printf("can't read the code of %s\n", image);
+		goto out;
+	}
+	if (f != stdout && fclose(f)) {
+		f = NULL;
+		printf("can't write %s\n", out);
+		goto out;
+	}
+	f = NULL;
+	if (out)
+		printf("%u blocks, 0x%x-0x%x, in %s\n", w.nstarts, w.lo, w.hi, out);
+	ret = 0;
+out:
+	if (f && f != stdout)
+		fclose(f);
+	if (w.e)
+		emu_destroy(w.e);
+	free(b);
+	free(w.set);
+	free(w.queue);
+	free(w.starts);
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include <stdint.h>
+
+#include "emu.h"
+
+/*
+	--translate: the code of an image as C, see aot.h
+
+	out gets one function per basic block reachable from the entry
+	point plus the rv32_aot_module that --aot loads. build it with
+
+		cc -O2 -shared -fPIC -I<emulator sources> -o image.so out.c
+
+	the emulator has to be the one whose headers it was built with.
+*/
+
+int translate(const char *image, const char *out, const struct emu_config *cfg,
+	uint32_t load_addr);
+
+#endif
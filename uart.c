@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "uart.h"
+
+struct uart {
+	uint8_t tx[UART_TX_RING];
+	uint8_t rx[UART_RX_RING];
+	_Alignas(64) _Atomic uint64_t tx_head;	/* written by the guest */
+	_Alignas(64) _Atomic uint64_t tx_tail;	/* written by the io thread */
+	_Alignas(64) _Atomic uint64_t rx_head;	/* written by the io thread */
+	_Alignas(64) _Atomic uint64_t rx_tail;	/* written by the guest */
+	_Atomic int rx_full;	/* the io thread waits for room */
+	_Atomic int done;
+	uint8_t ier, lcr, mcr, scr, fcr, dll, dlm;
+	int in_fd, out_fd;
+	int in_poll;		/* in_fd is in the epoll set, else a plain file */
+	int ep, kick;		/* epoll set and the eventfd waking the thread */
+	pthread_t thread;
+};
+
+static void kick(struct uart *u)
+{
+	uint64_t one = 1;
+
+	if (write(u->kick, &one, sizeof(one)) < 0)
+		return;
+}
+
+/* write out everything the guest sent so far */
+static void tx_drain(struct uart *u)
+{
+	uint64_t head = atomic_load_explicit(&u->tx_head, memory_order_acquire);
+	uint64_t tail = atomic_load_explicit(&u->tx_tail, memory_order_relaxed);
+	ssize_t n;
+	size_t len;
+
+	while (tail != head) {
+		len = head - tail;
+		if (len > UART_TX_RING - (tail & (UART_TX_RING - 1)))
+			len = UART_TX_RING - (tail & (UART_TX_RING - 1));
+		n = write(u->out_fd, &u->tx[tail & (UART_TX_RING - 1)], len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* nowhere to go, the bytes are dropped */
+		tail += n > 0 ? n : len;
+		atomic_store_explicit(&u->tx_tail, tail, memory_order_release);
+	}
+}
+
+static void in_events(struct uart *u, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.fd = u->in_fd };
+
+	epoll_ctl(u->ep, EPOLL_CTL_MOD, u->in_fd, &ev);
+}
+
+static void in_eof(struct uart *u)
+{
+	if (u->in_poll)
+		epoll_ctl(u->ep, EPOLL_CTL_DEL, u->in_fd, NULL);
+	u->in_poll = 0;
+	u->in_fd = -1;
+}
+
+/* one read into the free part of the ring. when it is full input
+   stops until the guest takes a byte */
+static void rx_fill(struct uart *u)
+{
+	uint64_t head = atomic_load_explicit(&u->rx_head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&u->rx_tail, memory_order_acquire);
+	size_t len = UART_RX_RING - (head - tail);
+	ssize_t n;
+
+	if (!len) {
+		atomic_store_explicit(&u->rx_full, 1, memory_order_seq_cst);
+		/* the guest may have taken a byte before it could see that */
+		if (atomic_load_explicit(&u->rx_tail, memory_order_seq_cst) != tail) {
+			atomic_store_explicit(&u->rx_full, 0, memory_order_relaxed);
+			return;
+		}
+		if (u->in_poll)
+			in_events(u, 0);
+		return;
+	}
+	if (len > UART_RX_RING - (head & (UART_RX_RING - 1)))
+		len = UART_RX_RING - (head & (UART_RX_RING - 1));
+	n = read(u->in_fd, &u->rx[head & (UART_RX_RING - 1)], len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		in_eof(u);
+		return;
+	}
+	atomic_store_explicit(&u->rx_head, head + n, memory_order_release);
+}
+
+static void *uart_thread(void *arg)
+{
+	struct uart *u = (struct uart*)arg;
+	struct epoll_event ev[2];
+	uint64_t v;
+	int i, n, readable;
+
+	while (!atomic_load_explicit(&u->done, memory_order_acquire)) {
+		n = epoll_wait(u->ep, ev, 2, UART_FLUSH_MS);
+		readable = u->in_fd >= 0 && !u->in_poll;
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd != u->kick) {
+				readable = 1;
+				continue;
+			}
+			if (read(u->kick, &v, sizeof(v)) < 0)
+				continue;
+			/* the guest made room */
+			if (u->in_poll)
+				in_events(u, EPOLLIN);
+		}
+		tx_drain(u);
+		if (readable && u->in_fd >= 0)
+			rx_fill(u);
+	}
+	tx_drain(u);
+	return NULL;
+}
+
+struct uart *uart_open(int in_fd, int out_fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct uart *u;
+
+	u = (struct uart*)calloc(1, sizeof(struct uart));
+	if (!u)
+		return NULL;
+	u->in_fd = in_fd;
+	u->out_fd = out_fd;
+	u->ep = epoll_create1(EPOLL_CLOEXEC);
+	u->kick = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (u->ep < 0 || u->kick < 0)
+		goto fail;
+	ev.data.fd = u->kick;
+	if (epoll_ctl(u->ep, EPOLL_CTL_ADD, u->kick, &ev) < 0)
+		goto fail;
+	/* ttys, pipes and sockets are polled, regular files that epoll
+	   refuses are read as the guest takes their bytes */
+	if (in_fd >= 0) {
+		ev.data.fd = in_fd;
+		if (epoll_ctl(u->ep, EPOLL_CTL_ADD, in_fd, &ev) == 0)
+			u->in_poll = 1;
+		else if (errno != EPERM)
+			u->in_fd = -1;
+	}
+	if (pthread_create(&u->thread, NULL, uart_thread, u))
+		goto fail;
+	return u;
+
+fail:
+	if (u->ep >= 0)
+		close(u->ep);
+	if (u->kick >= 0)
+		close(u->kick);
+	free(u);
+	return NULL;
+}
+
+/* everything sent is written out when this returns */
+void uart_close(struct uart *u)
+{
+	if (!u)
+		return;
+	atomic_store_explicit(&u->done, 1, memory_order_release);
+	kick(u);
+	pthread_join(u->thread, NULL);
+	close(u->ep);
+	close(u->kick);
+	free(u);
+}
+
+static uint8_t rx_get(struct uart *u)
+{
+	uint64_t tail = atomic_load_explicit(&u->rx_tail, memory_order_relaxed);
+	uint8_t c;
+
+	if (tail == atomic_load_explicit(&u->rx_head, memory_order_acquire))
+		return 0;
+	c = u->rx[tail & (UART_RX_RING - 1)];
+	atomic_store_explicit(&u->rx_tail, tail + 1, memory_order_seq_cst);
+	if (atomic_load_explicit(&u->rx_full, memory_order_seq_cst) &&
+	    atomic_exchange_explicit(&u->rx_full, 0, memory_order_relaxed))
+		kick(u);
+	return c;
+}
+
+static void tx_put(struct uart *u, uint8_t c)
+{
+	uint64_t head = atomic_load_explicit(&u->tx_head, memory_order_relaxed);
+	uint64_t used = head - atomic_load_explicit(&u->tx_tail, memory_order_acquire);
+
+	while (used == UART_TX_RING) {
+		sched_yield();
+		used = head - atomic_load_explicit(&u->tx_tail, memory_order_acquire);
+	}
+	u->tx[head & (UART_TX_RING - 1)] = c;
+	atomic_store_explicit(&u->tx_head, head + 1, memory_order_release);
+	/* don't wait for the next flush when the guest is this fast */
+	if (used == UART_TX_RING / 2)
+		kick(u);
+}
+
+static int rx_ready(struct uart *u)
+{
+	return atomic_load_explicit(&u->rx_tail, memory_order_relaxed) !=
+		atomic_load_explicit(&u->rx_head, memory_order_acquire);
+}
+
+/* any access size, the register at off gets the low byte */
+uint32_t uart_read(void *dev, uint32_t off, int size)
+{
+	struct uart *u = (struct uart*)dev;
+
+	switch (off) {
+	case UART_RBR:
+		return u->lcr & LCR_DLAB ? u->dll : rx_get(u);
+	case UART_IER:
+		return u->lcr & LCR_DLAB ? u->dlm : u->ier;
+	case UART_IIR:
+		/* fifos enabled, then the interrupt that would be pending */
+		return (u->fcr & 1 ? 0xc0 : 0) |
+			(u->ier & 1 && rx_ready(u) ? 0x04 : u->ier & 2 ? 0x02 : 0x01);
+	case UART_LCR:
+		return u->lcr;
+	case UART_MCR:
+		return u->mcr;
+	case UART_LSR:
+		return LSR_THRE | LSR_TEMT | (rx_ready(u) ? LSR_DR : 0);
+	case UART_MSR:
+		return 0xb0;	/* carrier, data set ready, clear to send */
+	case UART_SCR:
+		return u->scr;
+	}
+	return 0;
+}
+
+void uart_write(void *dev, uint32_t off, uint32_t data, int size)
+{
+	struct uart *u = (struct uart*)dev;
+
+	switch (off) {
+	case UART_RBR:
+		if (u->lcr & LCR_DLAB)
+			u->dll = data;
+		else
+			tx_put(u, data);
+		break;
+	case UART_IER:
+		if (u->lcr & LCR_DLAB)
+			u->dlm = data;
+		else
+			u->ier = data & 0x0f;
+		break;
+	case UART_IIR:
+		u->fcr = data & 0xc9;
+		break;
+	case UART_LCR:
+		u->lcr = data;
+		break;
+	case UART_MCR:
+		u->mcr = data & 0x1f;
+		break;
+	case UART_SCR:
+		u->scr = data;
+		break;
+	}
+}
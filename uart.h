@@ -0,0 +1,46 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+
+/*
+	16550 console, the ns16550a of qemu's virt board with its
+	registers at consecutive bytes. what the guest sends goes into a
+	single producer, single consumer ring that an io thread drains in
+	large writes, at least every UART_FLUSH_MS. the same thread reads
+	input with epoll into a second ring as the guest makes room.
+
+	register reads are answered from the rings and the register
+	values, a guest polling the line status never makes a syscall.
+	there is no interrupt controller, ier is kept but raises nothing
+	and the guest polls. the baud rate divisor is ignored, the line
+	is as fast as the guest.
+*/
+
+#define UART_RBR 0	/* receive buffer, transmit holding on writes */
+#define UART_IER 1
+#define UART_IIR 2	/* fifo control on writes */
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define LCR_DLAB 0x80	/* 0 and 1 are the divisor latch */
+#define LSR_DR 0x01	/* data ready */
+#define LSR_THRE 0x20	/* transmit holding register empty */
+#define LSR_TEMT 0x40	/* transmitter empty */
+
+#define UART_TX_RING 65536	/* bytes, powers of two */
+#define UART_RX_RING 4096
+#define UART_FLUSH_MS 5
+
+struct uart;
+
+/* in_fd < 0 for no input */
+struct uart *uart_open(int in_fd, int out_fd);
+void uart_close(struct uart *u);
+uint32_t uart_read(void *dev, uint32_t off, int size);
+void uart_write(void *dev, uint32_t off, uint32_t data, int size);
+
+#endif